@@ -15,11 +15,14 @@
  */
 #include <stdio.h>
 #include <stdint.h>
+#include <stddef.h>
 #include <inttypes.h>
 #include <string.h>
 #include <stdlib.h>
 #include <ccan/array_size/array_size.h>
 #include <unistd.h>
+#include <pthread.h>
+#include <time.h>
 
 #include "hwunit.h"
 #include "operations.h"
@@ -115,6 +118,19 @@ struct thread_state thread_status(struct pdbg_target *target)
 	return thread->status;
 }
 
+struct thread_state thread_status_poll(struct pdbg_target *target)
+{
+	struct thread *thread;
+
+	assert(!strcmp(target->class, "thread"));
+	thread = target_to_thread(target);
+
+	if (!thread->poll_status || thread->poll_status(thread))
+		target->probe(target);
+
+	return thread->status;
+}
+
 /*
  * Single step the thread count instructions.
  */
@@ -124,15 +140,41 @@ int thread_step(struct pdbg_target *thread_target, int count)
 
 	assert(!strcmp(thread_target->class, "thread"));
 	thread = target_to_thread(thread_target);
+	thread_translate_flush(thread_target);
 	return thread->step(thread, count);
 }
 
+/*
+ * Single step the thread count instructions, recording the NIA after
+ * each step in nia[] which must have room for count entries.
+ */
+int thread_step_trace(struct pdbg_target *thread_target, int count, uint64_t *nia)
+{
+	struct thread *thread;
+	int i;
+
+	assert(!strcmp(thread_target->class, "thread"));
+	thread = target_to_thread(thread_target);
+	thread_translate_flush(thread_target);
+
+	if (thread->step_trace)
+		return thread->step_trace(thread, count, nia);
+
+	for (i = 0; i < count; i++) {
+		CHECK_ERR(thread->step(thread, 1));
+		CHECK_ERR(thread_getnia(thread_target, &nia[i]));
+	}
+
+	return 0;
+}
+
 int thread_start(struct pdbg_target *thread_target)
 {
 	struct thread *thread;
 
 	assert(!strcmp(thread_target->class, "thread"));
 	thread = target_to_thread(thread_target);
+	thread_translate_flush(thread_target);
 	return thread->start(thread);
 }
 
@@ -151,139 +193,346 @@ int thread_sreset(struct pdbg_target *thread_target)
 
 	assert(!strcmp(thread_target->class, "thread"));
 	thread = target_to_thread(thread_target);
+	thread_translate_flush(thread_target);
 	return thread->sreset(thread);
 }
 
-int thread_step_all(void)
+/* Drop cached translations for every thread before they run */
+static void thread_translate_flush_all(void)
 {
-	struct pdbg_target *pib, *thread;
-	int rc = 0, count = 0;
+	struct pdbg_target *thread;
 
-	pdbg_for_each_class_target("pib", pib) {
-		struct sbefifo *sbefifo;
+	pdbg_for_each_class_target("thread", thread)
+		thread_translate_flush(thread);
+}
 
-		sbefifo = pib_to_sbefifo(pib);
-		if (!sbefifo)
-			break;
+enum thread_control_op {
+	THREAD_CONTROL_START,
+	THREAD_CONTROL_STOP,
+	THREAD_CONTROL_STEP,
+	THREAD_CONTROL_SRESET,
+};
+
+static const char *thread_control_names[] = {
+	[THREAD_CONTROL_START] = "start",
+	[THREAD_CONTROL_STOP] = "stop",
+	[THREAD_CONTROL_STEP] = "step",
+	[THREAD_CONTROL_SRESET] = "sreset",
+};
+
+/* Holds the workers until they have all been created */
+struct thread_control_gate {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	bool open;
+};
+
+/* Per-pib state for a control operation applied to every thread */
+struct thread_control {
+	pthread_t tid;
+	struct thread_control_gate *gate;
+	enum thread_control_op op;
+	struct pdbg_target *pib;
+	struct sbefifo *sbefifo;
+	struct timespec first, last;
+	int count;
+	int rc;
+};
+
+static uint64_t thread_control_last_skew;
+
+static int thread_control_sbefifo(struct sbefifo *sbefifo, enum thread_control_op op)
+{
+	/*
+	 * core_id = 0xff (all SMT4 cores)
+	 * thread_id = 0xf (all 4 threads in the SMT4 core)
+	 */
+	switch (op) {
+	case THREAD_CONTROL_START:
+		return sbefifo->thread_start(sbefifo, 0xff, 0xf);
+	case THREAD_CONTROL_STOP:
+		return sbefifo->thread_stop(sbefifo, 0xff, 0xf);
+	case THREAD_CONTROL_STEP:
+		return sbefifo->thread_step(sbefifo, 0xff, 0xf);
+	case THREAD_CONTROL_SRESET:
+		return sbefifo->thread_sreset(sbefifo, 0xff, 0xf);
+	}
 
-		/*
-		 * core_id = 0xff (all SMT4 cores)
-		 * thread_id = 0xf (all 4 threads in the SMT4 core)
-		 */
-		rc |= sbefifo->thread_step(sbefifo, 0xff, 0xf);
-		count++;
+	return -1;
+}
+
+static int thread_control_thread(struct pdbg_target *thread, enum thread_control_op op)
+{
+	switch (op) {
+	case THREAD_CONTROL_START:
+		return thread_start(thread);
+	case THREAD_CONTROL_STOP:
+		return thread_stop(thread);
+	case THREAD_CONTROL_STEP:
+		return thread_step(thread, 1);
+	case THREAD_CONTROL_SRESET:
+		return thread_sreset(thread);
 	}
 
-	if (count > 0)
-		return rc;
+	return -1;
+}
+
+static void *thread_control_run(void *arg)
+{
+	struct thread_control *ctl = arg;
+	struct pdbg_target *thread;
+
+	/* Hold every worker until they are all ready so the operations
+	 * are issued to each chip as close together as possible */
+	if (ctl->gate) {
+		pthread_mutex_lock(&ctl->gate->lock);
+		while (!ctl->gate->open)
+			pthread_cond_wait(&ctl->gate->cond, &ctl->gate->lock);
+		pthread_mutex_unlock(&ctl->gate->lock);
+	}
+
+	if (ctl->sbefifo) {
+		ctl->rc = thread_control_sbefifo(ctl->sbefifo, ctl->op);
+		clock_gettime(CLOCK_MONOTONIC, &ctl->first);
+		ctl->last = ctl->first;
+		ctl->count = 1;
+		return NULL;
+	}
 
-	pdbg_for_each_class_target("thread", thread) {
+	pdbg_for_each_target("thread", ctl->pib, thread) {
 		if (pdbg_target_status(thread) != PDBG_TARGET_ENABLED)
 			continue;
 
-		rc |= thread_step(thread, 1);
+		ctl->rc |= thread_control_thread(thread, ctl->op);
+		clock_gettime(CLOCK_MONOTONIC, &ctl->last);
+		if (!ctl->count++)
+			ctl->first = ctl->last;
 	}
 
-	return rc;
+	return NULL;
 }
 
-int thread_start_all(void)
+static uint64_t timespec_to_ns(const struct timespec *ts)
 {
-	struct pdbg_target *pib, *thread;
-	int rc = 0, count = 0;
+	return ts->tv_sec * 1000000000ULL + ts->tv_nsec;
+}
 
-	pdbg_for_each_class_target("pib", pib) {
-		struct sbefifo *sbefifo;
+/*
+ * Apply a control operation to every thread. Chips with an sbefifo use a
+ * single chip-op to control all their threads, otherwise each enabled
+ * thread is controlled individually. Each chip is handled by its own
+ * worker when the backend allows concurrent access so the spread between
+ * the first and last thread changing state is bounded by the slowest
+ * chip rather than the sum of all of them.
+ */
+static int thread_control_all(enum thread_control_op op)
+{
+	struct thread_control *ctls;
+	struct pdbg_target *pib;
+	bool parallel = pdbg_backend_is_threadsafe();
+	uint64_t first = UINT64_MAX, last = 0;
+	int i, n = 0, rc = 0, count = 0;
 
-		sbefifo = pib_to_sbefifo(pib);
-		if (!sbefifo)
-			break;
+	if (op != THREAD_CONTROL_STOP)
+		thread_translate_flush_all();
 
-		/*
-		 * core_id = 0xff (all SMT4 cores)
-		 * thread_id = 0xf (all 4 threads in the SMT4 core)
-		 */
-		rc |= sbefifo->thread_start(sbefifo, 0xff, 0xf);
-		count++;
+	pdbg_for_each_class_target("pib", pib)
+		n++;
+
+	ctls = calloc(n, sizeof(*ctls));
+	if (!ctls)
+		return -1;
+
+	/* Probing is not thread safe so find the sbefifos up front */
+	i = 0;
+	pdbg_for_each_class_target("pib", pib) {
+		ctls[i].op = op;
+		ctls[i].pib = pib;
+		ctls[i].sbefifo = pib_to_sbefifo(pib);
+		i++;
 	}
 
-	if (count > 0)
-		return rc;
+	if (parallel && n > 1) {
+		struct thread_control_gate gate = {
+			.lock = PTHREAD_MUTEX_INITIALIZER,
+			.cond = PTHREAD_COND_INITIALIZER,
+		};
+		int started;
 
-	pdbg_for_each_class_target("thread", thread) {
-		if (pdbg_target_status(thread) != PDBG_TARGET_ENABLED)
+		/* The workers mustn't create targets concurrently */
+		pdbg_targets_expand(NULL);
+
+		for (started = 0; started < n; started++) {
+			ctls[started].gate = &gate;
+			if (pthread_create(&ctls[started].tid, NULL, thread_control_run, &ctls[started])) {
+				PR_ERROR("Unable to create thread, controlling remaining chips serially\n");
+				break;
+			}
+		}
+
+		pthread_mutex_lock(&gate.lock);
+		gate.open = true;
+		pthread_cond_broadcast(&gate.cond);
+		pthread_mutex_unlock(&gate.lock);
+
+		for (i = started; i < n; i++)
+			thread_control_run(&ctls[i]);
+
+		for (i = 0; i < started; i++)
+			pthread_join(ctls[i].tid, NULL);
+	} else {
+		for (i = 0; i < n; i++)
+			thread_control_run(&ctls[i]);
+	}
+
+	for (i = 0; i < n; i++) {
+		if (!ctls[i].count)
 			continue;
 
-		rc |= thread_start(thread);
+		rc |= ctls[i].rc;
+		count += ctls[i].count;
+		if (timespec_to_ns(&ctls[i].first) < first)
+			first = timespec_to_ns(&ctls[i].first);
+		if (timespec_to_ns(&ctls[i].last) > last)
+			last = timespec_to_ns(&ctls[i].last);
 	}
 
+	free(ctls);
+
+	thread_control_last_skew = count ? last - first : 0;
+	PR_INFO("%s: %d operations, %"PRIu64"us skew\n",
+		thread_control_names[op], count, thread_control_last_skew / 1000);
+
 	return rc;
 }
 
+uint64_t thread_control_skew(void)
+{
+	return thread_control_last_skew;
+}
+
+int thread_step_all(void)
+{
+	return thread_control_all(THREAD_CONTROL_STEP);
+}
+
+int thread_start_all(void)
+{
+	return thread_control_all(THREAD_CONTROL_START);
+}
+
 int thread_stop_all(void)
 {
-	struct pdbg_target *pib, *thread;
-	int rc = 0, count = 0;
+	return thread_control_all(THREAD_CONTROL_STOP);
+}
 
-	pdbg_for_each_class_target("pib", pib) {
-		struct sbefifo *sbefifo;
+int thread_sreset_all(void)
+{
+	return thread_control_all(THREAD_CONTROL_SRESET);
+}
 
-		sbefifo = pib_to_sbefifo(pib);
-		if (!sbefifo)
-			break;
+/*
+ * Refresh the cached status of every probed thread on a core. Where the
+ * hardware reports the state of all threads in shared registers this
+ * costs a few SCOMs per core rather than per thread.
+ */
+int core_thread_status_fetch(struct pdbg_target *core_target)
+{
+	struct core *core;
 
-		/*
-		 * core_id = 0xff (all SMT4 cores)
-		 * thread_id = 0xf (all 4 threads in the SMT4 core)
-		 */
-		rc |= sbefifo->thread_stop(sbefifo, 0xff, 0xf);
-		count++;
-	}
+	assert(!strcmp(core_target->class, "core"));
 
-	if (count > 0)
-		return rc;
+	if (pdbg_target_status(core_target) != PDBG_TARGET_ENABLED)
+		return 1;
 
-	pdbg_for_each_class_target("thread", thread) {
-		if (pdbg_target_status(thread) != PDBG_TARGET_ENABLED)
+	core = target_to_core(core_target);
+	if (!core->thread_status_fetch)
+		return 0;
+
+	return core->thread_status_fetch(core);
+}
+
+/* Refresh the status of every probed thread on a chip */
+int chip_thread_status_fetch(struct pdbg_target *pib)
+{
+	struct pdbg_target *core;
+	int rc = 0;
+
+	assert(!strcmp(pib->class, "pib"));
+
+	pdbg_for_each_target("core", pib, core) {
+		if (pdbg_target_status(core) != PDBG_TARGET_ENABLED)
 			continue;
 
-		rc |= thread_stop(thread);
+		rc |= core_thread_status_fetch(core);
 	}
 
 	return rc;
 }
 
-int thread_sreset_all(void)
+static bool sticky_wakeup;
+
+/*
+ * In sticky mode releasing a core leaves special wakeup asserted so it
+ * doesn't need to be asserted again by the next user.
+ */
+void core_special_wakeup_set_sticky(bool sticky)
 {
-	struct pdbg_target *pib, *thread;
-	int rc = 0, count = 0;
+	sticky_wakeup = sticky;
+}
 
-	pdbg_for_each_class_target("pib", pib) {
-		struct sbefifo *sbefifo;
+bool core_special_wakeup_is_sticky(void)
+{
+	return sticky_wakeup;
+}
 
-		sbefifo = pib_to_sbefifo(pib);
-		if (!sbefifo)
-			break;
+/*
+ * Issue a special wakeup to a core without waiting for it to complete.
+ * Probing the core then only waits for the wakeup, so calling this for
+ * every core before probing any lets the wakeups complete in parallel.
+ */
+int core_special_wakeup_issue(struct pdbg_target *core_target)
+{
+	struct core *core;
 
-		/*
-		 * core_id = 0xff (all SMT4 cores)
-		 * thread_id = 0xf (all 4 threads in the SMT4 core)
-		 */
-		rc |= sbefifo->thread_sreset(sbefifo, 0xff, 0xf);
-		count++;
-	}
+	assert(!strcmp(core_target->class, "core"));
 
-	if (count > 0)
-		return rc;
+	/* Only cores which haven't been probed yet need a wakeup */
+	if (pdbg_target_status(core_target) != PDBG_TARGET_UNKNOWN)
+		return 0;
 
-	pdbg_for_each_class_target("thread", thread) {
-		if (pdbg_target_status(thread) != PDBG_TARGET_ENABLED)
-			continue;
+	if (pdbg_target_probe(core_target->parent) != PDBG_TARGET_ENABLED)
+		return 1;
 
-		rc |= thread_sreset(thread);
-	}
+	core = target_to_core(core_target);
+	if (!core->spwkup_issue || core->spwkup_pending)
+		return 0;
 
-	return rc;
+	return core->spwkup_issue(core);
+}
+
+int core_ram_session_begin(struct pdbg_target *core_target)
+{
+	struct core *core;
+
+	assert(!strcmp(core_target->class, "core"));
+	core = target_to_core(core_target);
+	if (!core->ram_session_begin)
+		return 0;
+
+	return core->ram_session_begin(core);
+}
+
+int core_ram_session_end(struct pdbg_target *core_target)
+{
+	struct core *core;
+
+	assert(!strcmp(core_target->class, "core"));
+	core = target_to_core(core_target);
+	if (!core->ram_session_end)
+		return 0;
+
+	return core->ram_session_end(core);
 }
 
 /*
@@ -389,6 +638,33 @@ int thread_getnia(struct pdbg_target *thread, uint64_t *value)
 	return 0;
 }
 
+/*
+ * Read the NIA of a thread which is already set up for ramming. Like
+ * thread_getnia() r0 is saved and restored around the read, but without
+ * setting up and tearing down RAM mode or touching r1.
+ */
+int ram_read_nia(struct thread *thread, uint64_t *nia)
+{
+	uint64_t r0 = 0, scratch = 0;
+	int rc;
+
+	/* Save r0, the last step may have changed it */
+	CHECK_ERR(thread->ram_instruction(thread, mtspr(277, 0), &r0));
+
+	rc = thread->ram_instruction(thread, mfnia(0), &scratch);
+	if (!rc)
+		rc = thread->ram_instruction(thread, mtspr(277, 0), &scratch);
+	if (!rc)
+		*nia = scratch;
+
+	/* Always put r0 back, the thread is about to run again */
+	scratch = r0;
+	if (thread->ram_instruction(thread, mfspr(0, 277), &scratch))
+		rc = 1;
+
+	return rc;
+}
+
 /*
  * P9 must MTNIA from LR, P8 can MTNIA from R0. So we set both LR and R0
  * to value. LR must be saved and restored.
@@ -425,6 +701,7 @@ int thread_putspr(struct pdbg_target *thread, int spr, uint64_t value)
 	uint64_t results[] = {value, 0};
 
 	CHECK_ERR(ram_instructions(thread, opcodes, results, ARRAY_SIZE(opcodes), 0));
+	thread_translate_flush(thread);
 	return 0;
 }
 
@@ -478,6 +755,7 @@ int thread_putmsr(struct pdbg_target *thread, uint64_t value)
 	uint64_t results[] = {value, 0};
 
 	CHECK_ERR(ram_instructions(thread, opcodes, results, ARRAY_SIZE(opcodes), 0));
+	thread_translate_flush(thread);
 	return 0;
 }
 
@@ -491,6 +769,64 @@ int thread_getmem(struct pdbg_target *thread, uint64_t addr, uint64_t *value)
 	return 0;
 }
 
+/* Number of doublewords loaded by each call to ram_instructions() */
+#define GETMEM_BATCH 256
+
+/*
+ * Load count doublewords starting at addr using the thread's view of
+ * memory. The base address is loaded into r1 once per batch and then
+ * each doubleword is fetched with a displacement load followed by a
+ * move to SCR0 to return it, so each doubleword costs two RAMed
+ * instructions rather than the eight needed by thread_getmem().
+ */
+int thread_getmem_range(struct pdbg_target *thread_target, uint64_t addr,
+			uint64_t *values, int count)
+{
+	uint64_t opcodes[2*GETMEM_BATCH + 2];
+	uint64_t results[2*GETMEM_BATCH + 2];
+	struct thread *thread;
+	bool did_setup = false;
+	int i, len, n, rc = 0;
+
+	assert(!strcmp(thread_target->class, "thread"));
+	thread = target_to_thread(thread_target);
+
+	if (!thread->ram_is_setup) {
+		CHECK_ERR(thread->ram_setup(thread));
+		did_setup = true;
+	}
+
+	while (count > 0) {
+		n = count > GETMEM_BATCH ? GETMEM_BATCH : count;
+
+		len = 0;
+		results[len] = addr;
+		opcodes[len++] = mfspr(1, 277);
+		for (i = 0; i < n; i++) {
+			results[len] = 0;
+			opcodes[len++] = ld(0, 2*i, 1);
+			results[len] = 0;
+			opcodes[len++] = mtspr(277, 0);
+		}
+
+		rc = ram_instructions(thread_target, opcodes, results, len, 0);
+		if (rc)
+			break;
+
+		for (i = 0; i < n; i++)
+			values[i] = results[2*i + 2];
+
+		values += n;
+		addr += n*sizeof(uint64_t);
+		count -= n;
+	}
+
+	if (did_setup)
+		CHECK_ERR(thread->ram_destroy(thread));
+
+	return rc;
+}
+
 int thread_getxer(struct pdbg_target *thread_target, uint64_t *value)
 {
 
@@ -528,6 +864,94 @@ int getring(struct pdbg_target *chiplet_target, uint64_t ring_addr, uint64_t rin
 	return chiplet->getring(chiplet, ring_addr, ring_len, result);
 }
 
+/* Opcodes needed for every register thread_getregs_subset() can RAM */
+#define REGS_SUBSET_OPCODES (32 + 2*6 + 2*8)
+
+int thread_getregs_subset(struct pdbg_target *thread, unsigned int mask,
+			  struct thread_regs *regs)
+{
+	static const struct {
+		unsigned int mask;
+		int spr;
+		size_t offset;
+	} sprs[] = {
+		{ THREAD_REG_LR, 8, offsetof(struct thread_regs, lr) },
+		{ THREAD_REG_CTR, 9, offsetof(struct thread_regs, ctr) },
+		{ THREAD_REG_CFAR, 28, offsetof(struct thread_regs, cfar) },
+		{ THREAD_REG_TAR, 815, offsetof(struct thread_regs, tar) },
+	};
+	uint64_t opcodes[REGS_SUBSET_OPCODES];
+	uint64_t results[REGS_SUBSET_OPCODES] = {0};
+	uint64_t *dest[REGS_SUBSET_OPCODES];
+	uint64_t cr[8];
+	uint32_t cr_field;
+	int i, len = 0;
+
+	assert(!strcmp(thread->class, "thread"));
+
+	/* GPRs must be read before r0 is used to move the SPRs */
+	if (mask & THREAD_REG_GPRS) {
+		for (i = 0; i < 32; i++) {
+			dest[len] = &regs->gprs[i];
+			opcodes[len++] = mtspr(277, i);
+		}
+	}
+
+	if (mask & THREAD_REG_NIA) {
+		dest[len] = NULL;
+		opcodes[len++] = mfnia(0);
+		dest[len] = &regs->nia;
+		opcodes[len++] = mtspr(277, 0);
+	}
+
+	if (mask & THREAD_REG_MSR) {
+		dest[len] = NULL;
+		opcodes[len++] = mfmsr(0);
+		dest[len] = &regs->msr;
+		opcodes[len++] = mtspr(277, 0);
+	}
+
+	for (i = 0; i < ARRAY_SIZE(sprs); i++) {
+		if (!(mask & sprs[i].mask))
+			continue;
+
+		dest[len] = NULL;
+		opcodes[len++] = mfspr(0, sprs[i].spr);
+		dest[len] = (uint64_t *) ((char *) regs + sprs[i].offset);
+		opcodes[len++] = mtspr(277, 0);
+	}
+
+	if (mask & THREAD_REG_CR) {
+		for (i = 0; i < 8; i++) {
+			dest[len] = NULL;
+			opcodes[len++] = mfocrf(0, i);
+			dest[len] = &cr[i];
+			opcodes[len++] = mtspr(277, 0);
+		}
+	}
+
+	if (len)
+		CHECK_ERR(ram_instructions(thread, opcodes, results, len, 0));
+
+	for (i = 0; i < len; i++)
+		if (dest[i])
+			*dest[i] = results[i];
+
+	if (mask & THREAD_REG_CR) {
+		regs->cr = 0;
+		for (i = 0; i < 8; i++) {
+			/* We are not guaranteed that the other bits will be zeroed out */
+			cr_field = cr[i];
+			regs->cr |= cr_field & (0xf << 4*i);
+		}
+	}
+
+	if (mask & THREAD_REG_XER)
+		CHECK_ERR(thread_getxer(thread, &regs->xer));
+
+	return 0;
+}
+
 int thread_getregs(struct pdbg_target *thread, struct thread_regs *regs)
 {
 	struct thread_regs _regs;
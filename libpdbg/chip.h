@@ -21,4 +21,8 @@ uint64_t mtspr(uint64_t spr, uint64_t reg) __attribute__ ((visibility("hidden"))
 int ram_instructions(struct pdbg_target *thread_target, uint64_t *opcodes,
 		uint64_t *results, int len, unsigned int lpar) __attribute__
 		((visibility("hidden")));
+int ram_read_nia(struct thread *thread, uint64_t *nia) __attribute__
+		((visibility("hidden")));
+void thread_translate_release(struct pdbg_target *thread_target) __attribute__
+		((visibility("hidden")));
 #endif
@@ -17,6 +17,9 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdarg.h>
+#include <ctype.h>
+#include <limits.h>
+#include <pthread.h>
 #include "target.h"
 #include <libfdt/libfdt.h>
 #include <libfdt/libfdt_internal.h>
@@ -40,6 +43,17 @@ static uint32_t last_phandle = 0;
 
 static struct pdbg_target *pdbg_dt_root;
 
+/*
+ * The fdt backing the tree. In lazy mode nodes are only created from it
+ * when something first needs them and their properties are read from it
+ * in place, so it must stay valid for as long as the targets are used.
+ * Otherwise the whole tree is copied out of it up front and this is
+ * cleared.
+ */
+static const void *pdbg_fdt;
+static bool pdbg_dt_lazy;
+static uint64_t pdbg_fdt_hash;
+
 /*
  * An in-memory representation of a node in the device tree.
  *
@@ -64,53 +78,227 @@ static const char *take_name(const char *name)
 	return name;
 }
 
-/* Adds information representing an actual target */
-static struct pdbg_target *dt_pdbg_target_new(const void *fdt, int node_offset)
+/*
+ * Targets and their names, and their properties when the tree is copied
+ * out of the fdt, are allocated from one arena sized from the fdt. Each
+ * node has a slot at its place in a pre-order walk of the fdt so that
+ * siblings and descendants end up next to each other in memory however
+ * the tree is expanded. Properties are allocated after the slots and
+ * anything which doesn't fit comes from the heap instead.
+ */
+#define DT_ARENA_ALIGN 16
+
+struct dt_slot {
+	int fdt_offset;
+	size_t offset;
+	size_t size;
+};
+
+static char *dt_arena;
+static size_t dt_arena_size;
+static size_t dt_arena_used;
+static struct dt_slot *dt_slots;
+static int dt_slot_count;
+
+static size_t dt_arena_align(size_t size)
 {
-	struct pdbg_target *target;
-	struct pdbg_target_class *target_class;
-	const struct hw_unit_info *hw_info = NULL;
+	return (size + DT_ARENA_ALIGN - 1) & ~((size_t) DT_ARENA_ALIGN - 1);
+}
+
+static bool dt_arena_owns(const void *p)
+{
+	return dt_arena && (const char *) p >= dt_arena &&
+		(const char *) p < dt_arena + dt_arena_size;
+}
+
+/* Returns NULL once the space reserved for properties is used up */
+static void *dt_arena_alloc(size_t size)
+{
+	void *p;
+
+	size = dt_arena_align(size);
+	if (!dt_arena || dt_arena_size - dt_arena_used < size)
+		return NULL;
+
+	p = dt_arena + dt_arena_used;
+	dt_arena_used += size;
+
+	return p;
+}
+
+static const char *dt_arena_name(const char *name)
+{
+	char *p = dt_arena_alloc(strlen(name) + 1);
+
+	if (!p)
+		return take_name(name);
+
+	strcpy(p, name);
+	return p;
+}
+
+static const struct hw_unit_info *dt_find_hw_unit(const void *fdt, int node_offset)
+{
+	const struct hw_unit_info *hw_info;
 	const struct fdt_property *prop;
-	size_t size;
+	int i, prop_len;
 
 	prop = fdt_get_property(fdt, node_offset, "compatible", NULL);
-	if (prop) {
-		int i, prop_len = fdt32_to_cpu(prop->len);
-
-		/*
-		 * If I understand correctly, the property we have
-		 * here can be a stringlist with a few compatible
-		 * strings
-		 */
-		i = 0;
-		while (i < prop_len) {
-			hw_info = pdbg_hwunit_find_compatible(&prop->data[i]);
-			if (hw_info) {
-				size = hw_info->size;
-				break;
+	if (!prop)
+		return NULL;
+
+	/*
+	 * If I understand correctly, the property we have
+	 * here can be a stringlist with a few compatible
+	 * strings
+	 */
+	prop_len = fdt32_to_cpu(prop->len);
+	for (i = 0; i < prop_len; i += strlen(&prop->data[i]) + 1) {
+		hw_info = pdbg_hwunit_find_compatible(&prop->data[i]);
+		if (hw_info)
+			return hw_info;
+	}
+
+	return NULL;
+}
+
+static size_t dt_slot_size(size_t size, size_t namelen)
+{
+	return dt_arena_align(size) + dt_arena_align(namelen + 1);
+}
+
+/* Works out where every node below the root goes in the arena */
+static void dt_arena_init(const void *fdt)
+{
+	const struct hw_unit_info *hw_info;
+	const char *name;
+	size_t size, nodes = 0, props = 0;
+	int offset, prop, depth = 0, len, alloc = 0;
+
+	dt_arena = NULL;
+	dt_arena_size = dt_arena_used = 0;
+	free(dt_slots);
+	dt_slots = NULL;
+	dt_slot_count = 0;
+
+	for (offset = fdt_next_node(fdt, 0, &depth);
+	     offset >= 0 && depth > 0;
+	     offset = fdt_next_node(fdt, offset, &depth)) {
+		if (dt_slot_count == alloc) {
+			alloc = alloc ? alloc * 2 : 64;
+			dt_slots = realloc(dt_slots, alloc * sizeof(*dt_slots));
+			if (!dt_slots) {
+				prerror("Failed to allocate arena slots\n");
+				abort();
 			}
+		}
+
+		hw_info = dt_find_hw_unit(fdt, offset);
+		size = hw_info ? hw_info->size : sizeof(struct pdbg_target);
+		fdt_get_name(fdt, offset, &len);
+
+		dt_slots[dt_slot_count].fdt_offset = offset;
+		dt_slots[dt_slot_count].offset = nodes;
+		dt_slots[dt_slot_count].size = size;
+		dt_slot_count++;
+		nodes += dt_slot_size(size, len);
+
+		if (pdbg_dt_lazy)
+			continue;
 
-			i += strlen(&prop->data[i]) + 1;
+		fdt_for_each_property_offset(prop, fdt, offset) {
+			fdt_getprop_by_offset(fdt, prop, &name, &len);
+			props += dt_arena_align(sizeof(struct dt_property) + len);
+			props += dt_arena_align(strlen(name) + 1);
 		}
 	}
 
-	if (!hw_info)
-		/* Couldn't find anything implementing this target */
+	if (!nodes)
+		return;
+
+	dt_arena = calloc(1, nodes + props);
+	if (!dt_arena) {
+		PR_DEBUG("Unable to allocate %zu byte target arena\n", nodes + props);
+		return;
+	}
+
+	dt_arena_size = nodes + props;
+	dt_arena_used = nodes;
+}
+
+static const struct dt_slot *dt_find_slot(int node_offset)
+{
+	int lo = 0, hi = dt_slot_count, mid;
+
+	if (!dt_arena || node_offset < 0)
 		return NULL;
 
-	target = calloc(1, size);
-	if (!target) {
-		prerror("Failed to allocate node\n");
-		abort();
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (dt_slots[mid].fdt_offset < node_offset)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	if (lo == dt_slot_count || dt_slots[lo].fdt_offset != node_offset)
+		return NULL;
+
+	return &dt_slots[lo];
+}
+
+/* Allocates a node, copied from init if given, along with its name */
+static struct pdbg_target *dt_node_alloc(int node_offset, const void *init,
+					 size_t size, const char *name)
+{
+	const struct dt_slot *slot = dt_find_slot(node_offset);
+	struct pdbg_target *node;
+	char *dn_name;
+
+	if (slot && slot->size == size) {
+		node = (struct pdbg_target *) (dt_arena + slot->offset);
+		dn_name = (char *) node + dt_arena_align(size);
+		strcpy(dn_name, name);
+	} else {
+		node = calloc(1, size);
+		if (!node) {
+			prerror("Failed to allocate node\n");
+			abort();
+		}
+		dn_name = (char *) take_name(name);
 	}
 
+	if (init)
+		memcpy(node, init, size);
+	node->dn_name = dn_name;
+
+	return node;
+}
+
+/* Adds information representing an actual target */
+static struct pdbg_target *dt_pdbg_target_new(const void *fdt, int node_offset,
+					      const char *name)
+{
+	struct pdbg_target *target;
+	struct pdbg_target_class *target_class;
+	const struct hw_unit_info *hw_info;
+
+	hw_info = dt_find_hw_unit(fdt, node_offset);
+	if (!hw_info)
+		/* Couldn't find anything implementing this target */
+		return NULL;
+
 	/* hw_info->hw_unit points to a per-target struct type. This
 	 * works because the first member in the per-target struct is
 	 * guaranteed to be the struct pdbg_target (see the comment
 	 * above DECLARE_HW_UNIT). */
-	memcpy(target, hw_info->hw_unit, size);
+	target = dt_node_alloc(node_offset, hw_info->hw_unit, hw_info->size, name);
+	target->fdt_offset = node_offset;
+
+	/* Classes are kept in device tree order regardless of the order
+	 * in which parts of the tree are expanded */
 	target_class = get_target_class(target);
-	list_add_tail(&target_class->targets, &target->class_link);
+	target_class_add(target_class, target);
 
 	return target;
 }
@@ -121,18 +309,14 @@ static struct pdbg_target *dt_new_node(const char *name, const void *fdt, int no
 	size_t size = sizeof(*node);
 
 	if (fdt)
-		node = dt_pdbg_target_new(fdt, node_offset);
+		node = dt_pdbg_target_new(fdt, node_offset, name);
 
 	if (!node)
-		node = calloc(1, size);
-
-	if (!node) {
-		prerror("Failed to allocate node\n");
-		abort();
-	}
+		node = dt_node_alloc(fdt ? node_offset : -1, NULL, size, name);
 
-	node->dn_name = take_name(name);
 	node->parent = NULL;
+	node->fdt_offset = fdt ? node_offset : -1;
+	node->fdt_end = INT_MAX;
 	list_head_init(&node->properties);
 	list_head_init(&node->children);
 	node->phandle = ++last_phandle;
@@ -140,72 +324,203 @@ static struct pdbg_target *dt_new_node(const char *name, const void *fdt, int no
 	return node;
 }
 
-static const char *get_unitname(const struct pdbg_target *node)
+/*
+ * A child of a node being expanded. The unit address is split out and
+ * parsed once so sorting doesn't have to keep doing it.
+ */
+struct dt_child {
+	struct pdbg_target *node;
+	/* Length of the name before any '@' */
+	unsigned int namel;
+	/* Unit address, NULL if there isn't one */
+	const char *addr;
+	unsigned int addrl;
+	unsigned long long unit;
+	bool unit_valid;
+	/* Position in the fdt, then in the list of children */
+	int pos;
+};
+
+/* The children of a node sorted by name then unit address for path
+ * lookups */
+struct dt_child_index {
+	int count;
+	struct dt_child children[];
+};
+
+static void dt_child_init(struct dt_child *child, struct pdbg_target *node, int pos)
 {
-	const char *c = strchr(node->dn_name, '@');
+	const char *at = strchr(node->dn_name, '@');
+	char *end;
 
-	if (!c)
-		return NULL;
+	child->node = node;
+	child->pos = pos;
+	child->unit_valid = false;
+
+	if (!at) {
+		child->namel = strlen(node->dn_name);
+		child->addr = NULL;
+		child->addrl = 0;
+		return;
+	}
+
+	child->namel = at - node->dn_name;
+	child->addr = at + 1;
+	child->addrl = strlen(child->addr);
 
-	return c + 1;
+	/* only compare by number if the unit addr parses correctly */
+	child->unit = strtoull(child->addr, &end, 16);
+	child->unit_valid = *end == 0;
 }
 
-static int dt_cmp_subnodes(const struct pdbg_target *a, const struct pdbg_target *b)
+static int dt_cmp_subnodes(const struct dt_child *a, const struct dt_child *b)
 {
-	const char *a_unit = get_unitname(a);
-	const char *b_unit = get_unitname(b);
+	/* sort hex unit addresses by number */
+	if (a->unit_valid && b->unit_valid && a->namel == b->namel &&
+	    !strncmp(a->node->dn_name, b->node->dn_name, a->namel))
+		return (a->unit > b->unit) - (a->unit < b->unit);
 
-	ptrdiff_t basenamelen = a_unit - a->dn_name;
+	return strcmp(a->node->dn_name, b->node->dn_name);
+}
 
-	/* sort hex unit addresses by number */
-	if (a_unit && b_unit && !strncmp(a->dn_name, b->dn_name, basenamelen)) {
-		unsigned long long a_num, b_num;
-		char *a_end, *b_end;
+/* Children are listed in subnode order, keeping the first of any
+ * duplicates */
+static int dt_cmp_children(const void *x, const void *y)
+{
+	const struct dt_child *a = x, *b = y;
+	int cmp = dt_cmp_subnodes(a, b);
 
-		a_num = strtoul(a_unit, &a_end, 16);
-		b_num = strtoul(b_unit, &b_end, 16);
+	if (cmp)
+		return cmp;
 
-		/* only compare if the unit addr parsed correctly */
-		if (*a_end == 0 && *b_end == 0)
-			return (a_num > b_num) - (a_num < b_num);
-	}
+	return (a->pos > b->pos) - (a->pos < b->pos);
+}
 
-	return strcmp(a->dn_name, b->dn_name);
+static int dt_cmp_str(const char *a, unsigned int al, const char *b, unsigned int bl)
+{
+	int cmp = memcmp(a, b, al < bl ? al : bl);
+
+	if (cmp)
+		return cmp;
+
+	return (al > bl) - (al < bl);
 }
 
-static bool dt_attach_root(struct pdbg_target *parent, struct pdbg_target *root)
+static int dt_cmp_child_name(const struct dt_child *child, const char *name, unsigned int namel)
 {
-	struct pdbg_target *node = NULL;
+	return dt_cmp_str(child->node->dn_name, child->namel, name, namel);
+}
+
+static int dt_cmp_child_addr(const struct dt_child *child, const char *addr, unsigned int addrl)
+{
+	return dt_cmp_str(child->addr ? child->addr : "", child->addrl, addr, addrl);
+}
 
-	assert(!root->parent);
+static int dt_cmp_index(const void *x, const void *y)
+{
+	const struct dt_child *a = x, *b = y;
+	int cmp = dt_cmp_child_name(a, b->node->dn_name, b->namel);
+
+	if (cmp)
+		return cmp;
 
-	if (list_empty(&parent->children)) {
-		list_add(&parent->children, &root->list);
-		root->parent = parent;
+	return dt_cmp_child_addr(a, b->addr ? b->addr : "", b->addrl);
+}
 
-		return true;
+/* Sorts the new children of a node into its list of children, dropping
+ * duplicates, and indexes them by name */
+static void dt_attach_children(struct pdbg_target *parent,
+			       struct dt_child *children, int count)
+{
+	struct dt_child_index *index;
+	struct dt_child *last = NULL;
+	int i;
+
+	assert(list_empty(&parent->children));
+
+	index = malloc(sizeof(*index) + count * sizeof(*children));
+	if (!index) {
+		prerror("Failed to allocate child index\n");
+		abort();
 	}
+	index->count = 0;
 
-	dt_for_each_child(parent, node) {
-		int cmp = dt_cmp_subnodes(node, root);
+	qsort(children, count, sizeof(*children), dt_cmp_children);
+
+	for (i = 0; i < count; i++) {
+		struct pdbg_target *node = children[i].node;
+
+		assert(!node->parent);
 
 		/* Look for duplicates */
-		if (cmp == 0) {
+		if (last && !dt_cmp_subnodes(last, &children[i])) {
 			prerror("DT: %s failed, duplicate %s\n",
-				__func__, root->dn_name);
-			return false;
+				__func__, node->dn_name);
+			continue;
 		}
 
-		/* insert before the first node that's larger
-		 * the the node we're inserting */
-		if (cmp > 0)
-			break;
+		list_add_tail(&parent->children, &node->list);
+		node->parent = parent;
+
+		last = &index->children[index->count];
+		*last = children[i];
+		last->pos = index->count++;
+	}
+
+	qsort(index->children, index->count, sizeof(*children), dt_cmp_index);
+
+	free(parent->child_index);
+	parent->child_index = index;
+}
+
+/* Returns the first child listed with the given name and, if addrl is
+ * not zero, unit address */
+static struct pdbg_target *dt_find_child(struct pdbg_target *parent,
+					 const char *name, unsigned int namel,
+					 const char *addr, unsigned int addrl)
+{
+	const struct dt_child_index *index = parent->child_index;
+	const struct dt_child *child, *first = NULL;
+	int lo = 0, hi, mid, cmp;
+
+	if (!index)
+		return NULL;
+
+	hi = index->count;
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		child = &index->children[mid];
+
+		cmp = dt_cmp_child_name(child, name, namel);
+		if (!cmp && addrl)
+			cmp = dt_cmp_child_addr(child, addr, addrl);
+
+		if (cmp < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
 	}
 
-	list_add_before(&parent->children, &root->list, &node->list);
-	root->parent = parent;
+	if (addrl) {
+		child = &index->children[lo];
+		if (lo < index->count && !dt_cmp_child_name(child, name, namel) &&
+		    !dt_cmp_child_addr(child, addr, addrl))
+			return child->node;
+
+		return NULL;
+	}
+
+	/* Without a unit address any child with the name will do */
+	for (; lo < index->count; lo++) {
+		child = &index->children[lo];
+		if (dt_cmp_child_name(child, name, namel))
+			break;
+
+		if (!first || child->pos < first->pos)
+			first = child;
+	}
 
-	return true;
+	return first ? first->node : NULL;
 }
 
 static char *dt_get_path(const struct pdbg_target *node)
@@ -284,13 +599,20 @@ static struct pdbg_target *dt_find_by_path(struct pdbg_target *root, const char
 		if (pnl == 0 && pal == 0)
 			break;
 
-		/* Compare with each child node */
+		dt_expand_children(root);
+		if (pnl) {
+			root = dt_find_child(root, pn, pnl, pa, pal);
+			if (!root)
+				return NULL;
+
+			continue;
+		}
+
+		/* Compare the unit address with each child node */
 		match = false;
 		list_for_each(&root->children, n, list) {
 			match = true;
 			__dt_path_split(n->dn_name, &nn, &nnl, &na, &nal);
-			if (pnl && (pnl != nnl || strncmp(pn, nn, pnl)))
-				match = false;
 			if (pal && (pal != nal || strncmp(pa, na, pal)))
 				match = false;
 			if (match) {
@@ -317,12 +639,433 @@ static struct dt_property *dt_find_property(const struct pdbg_target *node,
 	return NULL;
 }
 
+/* Finds a property in the fdt without copying it */
+static const void *dt_fdt_property(const struct pdbg_target *node,
+				   const char *name, size_t *size)
+{
+	const void *val;
+	int len;
+
+	if (!pdbg_fdt || node->fdt_offset < 0)
+		return NULL;
+
+	val = fdt_getprop(pdbg_fdt, node->fdt_offset, name, &len);
+	if (!val)
+		return NULL;
+
+	*size = len;
+	return val;
+}
+
+/* Properties set at runtime take precedence over those in the fdt */
+static const void *dt_scan_property(const struct pdbg_target *node,
+				    const char *name, size_t *size)
+{
+	struct dt_property *p;
+
+	p = dt_find_property(node, name);
+	if (p) {
+		*size = p->len;
+		return p->prop;
+	}
+
+	return dt_fdt_property(node, name, size);
+}
+
+/*
+ * Property names are interned as atoms so each node can keep an index of
+ * its properties sorted by atom rather than comparing strings on every
+ * lookup. A device tree only uses a few dozen distinct names.
+ */
+#define DT_ATOM_BUCKETS 64
+
+struct dt_atom {
+	struct dt_atom *next;
+	char name[];
+};
+
+/* A property along with its whole cells decoded to native endian */
+struct dt_prop_ref {
+	const struct dt_atom *atom;
+	const void *val;
+	size_t len;
+	const u32 *cells;
+};
+
+struct dt_prop_index {
+	/* Decoded "reg" using the parent's address and size cells */
+	bool has_reg;
+	u64 address;
+	u64 size;
+
+	size_t count;
+	struct dt_prop_ref refs[];
+};
+
+static struct dt_atom *dt_atoms[DT_ATOM_BUCKETS];
+
+/* Atoms and indexes are created on first use, which may be from several
+ * threads at once. Lookups don't take the lock. */
+static pthread_mutex_t dt_index_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static unsigned int dt_atom_hash(const char *name)
+{
+	unsigned int hash = 5381;
+
+	while (*name)
+		hash = hash * 33 + *name++;
+
+	return hash % DT_ATOM_BUCKETS;
+}
+
+static const struct dt_atom *dt_atom_find(const char *name)
+{
+	struct dt_atom *atom;
+
+	atom = __atomic_load_n(&dt_atoms[dt_atom_hash(name)], __ATOMIC_ACQUIRE);
+	for (; atom; atom = atom->next)
+		if (!strcmp(atom->name, name))
+			return atom;
+
+	return NULL;
+}
+
+/* Must be called with dt_index_lock held */
+static const struct dt_atom *dt_atom_intern(const char *name)
+{
+	unsigned int hash = dt_atom_hash(name);
+	const struct dt_atom *found;
+	struct dt_atom *atom;
+
+	found = dt_atom_find(name);
+	if (found)
+		return found;
+
+	atom = malloc(sizeof(*atom) + strlen(name) + 1);
+	if (!atom) {
+		prerror("Failed to allocate atom \"%s\"\n", name);
+		abort();
+	}
+
+	strcpy(atom->name, name);
+	atom->next = dt_atoms[hash];
+	__atomic_store_n(&dt_atoms[hash], atom, __ATOMIC_RELEASE);
+
+	return atom;
+}
+
+static int dt_prop_ref_cmp(const void *a, const void *b)
+{
+	uintptr_t a_atom = (uintptr_t) ((const struct dt_prop_ref *) a)->atom;
+	uintptr_t b_atom = (uintptr_t) ((const struct dt_prop_ref *) b)->atom;
+
+	return (a_atom > b_atom) - (a_atom < b_atom);
+}
+
+static const struct dt_prop_ref *dt_index_find(const struct dt_prop_index *index,
+					       const struct dt_atom *atom)
+{
+	struct dt_prop_ref key = { .atom = atom };
+
+	if (!atom)
+		return NULL;
+
+	return bsearch(&key, index->refs, index->count, sizeof(key), dt_prop_ref_cmp);
+}
+
+static u32 dt_index_u32(const struct dt_prop_index *index, const char *name, u32 def)
+{
+	const struct dt_prop_ref *ref = dt_index_find(index, dt_atom_find(name));
+
+	if (!ref || ref->len < sizeof(u32))
+		return def;
+
+	return ref->cells[0];
+}
+
+static u64 dt_get_number(const void *pdata, unsigned int cells)
+{
+	const u32 *p = pdata;
+	u64 ret = 0;
+
+	while(cells--)
+		ret = (ret << 32) | be32toh(*(p++));
+	return ret;
+}
+
+static void dt_index_add(struct dt_prop_index *index, u32 **cells,
+			 const char *name, const void *val, size_t len)
+{
+	struct dt_prop_ref *ref = &index->refs[index->count++];
+	size_t i;
+
+	ref->atom = dt_atom_intern(name);
+	ref->val = val;
+	ref->len = len;
+	ref->cells = *cells;
+
+	for (i = 0; i < len / sizeof(u32); i++)
+		(*cells)[i] = fdt32_to_cpu(((const u32 *) val)[i]);
+	*cells += len / sizeof(u32);
+}
+
+/* Must be called with dt_index_lock held and the parent indexed */
+static struct dt_prop_index *dt_index_build(struct pdbg_target *node)
+{
+	const struct dt_prop_index *parent_index;
+	struct dt_prop_index *index;
+	const struct dt_prop_ref *reg;
+	struct dt_property *p;
+	size_t count = 0, ncells = 0;
+	const char *name;
+	const void *val;
+	int offset, len;
+	u32 na = 0, ns = 0, *cells;
+
+	list_for_each(&node->properties, p, list) {
+		count++;
+		ncells += p->len / sizeof(u32);
+	}
+
+	if (pdbg_fdt && node->fdt_offset >= 0) {
+		fdt_for_each_property_offset(offset, pdbg_fdt, node->fdt_offset) {
+			fdt_getprop_by_offset(pdbg_fdt, offset, &name, &len);
+			count++;
+			ncells += len / sizeof(u32);
+		}
+	}
+
+	index = calloc(1, sizeof(*index) + count * sizeof(index->refs[0]) +
+		       ncells * sizeof(u32));
+	if (!index) {
+		prerror("Failed to allocate property index\n");
+		abort();
+	}
+	cells = (u32 *) &index->refs[count];
+
+	list_for_each(&node->properties, p, list)
+		dt_index_add(index, &cells, p->name, p->prop, p->len);
+
+	if (pdbg_fdt && node->fdt_offset >= 0) {
+		fdt_for_each_property_offset(offset, pdbg_fdt, node->fdt_offset) {
+			val = fdt_getprop_by_offset(pdbg_fdt, offset, &name, &len);
+
+			/* Overridden at runtime */
+			if (dt_find_property(node, name))
+				continue;
+
+			dt_index_add(index, &cells, name, val, len);
+		}
+	}
+
+	qsort(index->refs, index->count, sizeof(index->refs[0]), dt_prop_ref_cmp);
+
+	if (node->parent) {
+		parent_index = node->parent->prop_index;
+		na = dt_index_u32(parent_index, "#address-cells", 2);
+		ns = dt_index_u32(parent_index, "#size-cells", 1);
+	}
+
+	reg = dt_index_find(index, dt_atom_find("reg"));
+	if (reg && (na + ns) * sizeof(u32) <= reg->len) {
+		index->has_reg = true;
+		index->address = dt_get_number(reg->val, na);
+		index->size = dt_get_number((const char *) reg->val + na * sizeof(u32), ns);
+	}
+
+	return index;
+}
+
+static const struct dt_prop_index *dt_get_index(struct pdbg_target *node)
+{
+	struct dt_prop_index *index;
+
+	index = __atomic_load_n(&node->prop_index, __ATOMIC_ACQUIRE);
+	if (index)
+		return index;
+
+	/* Decoding "reg" needs the parent's index */
+	if (node->parent)
+		dt_get_index(node->parent);
+
+	pthread_mutex_lock(&dt_index_lock);
+	index = node->prop_index;
+	if (!index) {
+		index = dt_index_build(node);
+		__atomic_store_n(&node->prop_index, index, __ATOMIC_RELEASE);
+	}
+	pthread_mutex_unlock(&dt_index_lock);
+
+	return index;
+}
+
+/* Drops the index after the properties of a node change */
+static void dt_index_invalidate(struct pdbg_target *node)
+{
+	struct dt_prop_index *index;
+
+	pthread_mutex_lock(&dt_index_lock);
+	index = node->prop_index;
+	__atomic_store_n(&node->prop_index, NULL, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&dt_index_lock);
+
+	free(index);
+}
+
+static const struct dt_prop_ref *dt_get_property_ref(struct pdbg_target *node,
+						     const char *name)
+{
+	const struct dt_prop_index *index = dt_get_index(node);
+
+	return dt_index_find(index, dt_atom_find(name));
+}
+
+static const void *dt_get_property(struct pdbg_target *node,
+				   const char *name, size_t *size)
+{
+	const struct dt_prop_ref *ref = dt_get_property_ref(node, name);
+
+	if (!ref)
+		return NULL;
+
+	*size = ref->len;
+	return ref->val;
+}
+
+const u32 *dt_property_cells(struct pdbg_target *target, const char *name, size_t *size)
+{
+	const struct dt_prop_ref *ref = dt_get_property_ref(target, name);
+
+	if (!ref)
+		return NULL;
+
+	*size = ref->len;
+	return ref->cells;
+}
+
+/*
+ * Compatible strings are interned with a small id so each target can
+ * record its compatibles as a bitset, and each compatible keeps a list
+ * of the targets with it in device tree order. Like the strings they
+ * replace they are matched without regard to case.
+ */
+#define DT_COMPAT_BUCKETS 64
+
+struct dt_compat {
+	struct dt_compat *next;
+	int id;
+	struct target_array targets;
+	char name[];
+};
+
+static struct dt_compat *dt_compats[DT_COMPAT_BUCKETS];
+static int dt_compat_count;
+
+static unsigned int dt_compat_hash(const char *name)
+{
+	unsigned int hash = 5381;
+
+	while (*name)
+		hash = hash * 33 + tolower(*name++);
+
+	return hash % DT_COMPAT_BUCKETS;
+}
+
+static struct dt_compat *dt_compat_find(const char *name)
+{
+	struct dt_compat *compat;
+
+	compat = __atomic_load_n(&dt_compats[dt_compat_hash(name)], __ATOMIC_ACQUIRE);
+	for (; compat; compat = compat->next)
+		if (!strcasecmp(compat->name, name))
+			return compat;
+
+	return NULL;
+}
+
+/* Compatibles are only added as the tree is expanded, which is never
+ * done concurrently, but may be looked up from other threads */
+static struct dt_compat *dt_compat_intern(const char *name)
+{
+	unsigned int hash = dt_compat_hash(name);
+	struct dt_compat *compat;
+
+	compat = dt_compat_find(name);
+	if (compat)
+		return compat;
+
+	compat = calloc(1, sizeof(*compat) + strlen(name) + 1);
+	if (!compat) {
+		prerror("Failed to allocate compatible \"%s\"\n", name);
+		abort();
+	}
+
+	strcpy(compat->name, name);
+	compat->id = dt_compat_count++;
+	compat->next = dt_compats[hash];
+	__atomic_store_n(&dt_compats[hash], compat, __ATOMIC_RELEASE);
+
+	return compat;
+}
+
+static bool dt_compat_has(const struct pdbg_target *node, const struct dt_compat *compat)
+{
+	if (compat->id / 64 >= node->compat_words)
+		return false;
+
+	return node->compat_set[compat->id / 64] & (1ULL << (compat->id % 64));
+}
+
+/* Records the compatible strings of a node, replacing any from before */
+static void dt_compat_update(struct pdbg_target *node)
+{
+	struct dt_compat *compat;
+	const char *c, *end;
+	size_t len;
+	int i, words;
+
+	for (i = 0; i < DT_COMPAT_BUCKETS && node->compat_words; i++)
+		for (compat = dt_compats[i]; compat; compat = compat->next)
+			if (dt_compat_has(node, compat))
+				target_array_remove(&compat->targets, node);
+
+	free(node->compat_set);
+	node->compat_set = NULL;
+	node->compat_words = 0;
+
+	c = dt_scan_property(node, "compatible", &len);
+	if (!c)
+		return;
+
+	for (end = c + len; c < end; c += strlen(c) + 1) {
+		compat = dt_compat_intern(c);
+		if (dt_compat_has(node, compat))
+			continue;
+
+		words = compat->id / 64 + 1;
+		if (words > node->compat_words) {
+			node->compat_set = realloc(node->compat_set,
+						   words * sizeof(*node->compat_set));
+			assert(node->compat_set);
+			memset(&node->compat_set[node->compat_words], 0,
+			       (words - node->compat_words) * sizeof(*node->compat_set));
+			node->compat_words = words;
+		}
+
+		node->compat_set[compat->id / 64] |= 1ULL << (compat->id % 64);
+		target_array_insert(&compat->targets, node);
+	}
+}
+
 static struct dt_property *new_property(struct pdbg_target *node,
 					const char *name, size_t size)
 {
-	struct dt_property *p = malloc(sizeof(*p) + size);
+	struct dt_property *p = dt_arena_alloc(sizeof(*p) + size);
 	char *path;
 
+	if (!p)
+		p = malloc(sizeof(*p) + size);
+
 	if (!p) {
 		path = dt_get_path(node);
 		prerror("Failed to allocate property \"%s\" for %s of %zu bytes\n",
@@ -339,7 +1082,7 @@ static struct dt_property *new_property(struct pdbg_target *node,
 
 	}
 
-	p->name = take_name(name);
+	p->name = dt_arena_name(name);
 	p->len = size;
 	list_add_tail(&node->properties, &p->list);
 	return p;
@@ -373,8 +1116,23 @@ static struct dt_property *dt_add_property(struct pdbg_target *node,
 static void dt_resize_property(struct dt_property **prop, size_t len)
 {
 	size_t new_len = sizeof(**prop) + len;
+	struct dt_property *p;
+
+	if (dt_arena_owns(*prop)) {
+		/* Arena memory is never freed so move it to the heap */
+		p = malloc(new_len);
+		if (p)
+			memcpy(p, *prop, sizeof(**prop) + (*prop)->len);
+	} else {
+		p = realloc(*prop, new_len);
+	}
 
-	*prop = realloc(*prop, new_len);
+	if (!p) {
+		prerror("Failed to allocate property \"%s\" of %zu bytes\n",
+			(*prop)->name, len);
+		abort();
+	}
+	*prop = p;
 
 	/* Fix up linked lists in case we moved. (note: not an empty list). */
 	(*prop)->list.next->prev = &(*prop)->list;
@@ -384,6 +1142,8 @@ static void dt_resize_property(struct dt_property **prop, size_t len)
 void pdbg_target_set_property(struct pdbg_target *target, const char *name, const void *val, size_t size)
 {
 	struct dt_property *p;
+	const void *fdt_val;
+	size_t fdt_len;
 
 	if ((p = dt_find_property(target, name))) {
 		if (size > p->len) {
@@ -391,64 +1151,45 @@ void pdbg_target_set_property(struct pdbg_target *target, const char *name, cons
 			p->len = size;
 		}
 
+		memcpy(p->prop, val, size);
+	} else if ((fdt_val = dt_fdt_property(target, name, &fdt_len)) &&
+		   size < fdt_len) {
+		/* The fdt may be read-only so modify a copy instead */
+		p = dt_add_property(target, name, fdt_val, fdt_len);
 		memcpy(p->prop, val, size);
 	} else {
 		dt_add_property(target, name, val, size);
 	}
+
+	dt_index_invalidate(target);
+	if (!strcmp(name, "compatible"))
+		dt_compat_update(target);
 }
 
 void *pdbg_target_property(struct pdbg_target *target, const char *name, size_t *size)
 {
-	struct dt_property *p;
+	const void *val;
+	size_t len;
 
-	p = dt_find_property(target, name);
-	if (p) {
-		if (size)
-			*size = p->len;
-		return p->prop;
-	} else if (size)
-		*size = 0;
+	val = dt_get_property(target, name, &len);
+	if (size)
+		*size = val ? len : 0;
 
-	return NULL;
+	return (void *) val;
 }
 
-static u32 dt_property_get_cell(const struct dt_property *prop, u32 index)
+static u32 dt_property_get_cell(const void *prop, size_t len, u32 index)
 {
-	assert(prop->len >= (index+1)*sizeof(u32));
+	assert(len >= (index+1)*sizeof(u32));
 	/* Always aligned, so this works. */
-	return fdt32_to_cpu(((const u32 *)prop->prop)[index]);
-}
-
-/* First child of this node. */
-static struct pdbg_target *dt_first(const struct pdbg_target *root)
-{
-	return list_top(&root->children, struct pdbg_target, list);
+	return fdt32_to_cpu(((const u32 *)prop)[index]);
 }
 
-/* Return next node, or NULL. */
-static struct pdbg_target *dt_next(const struct pdbg_target *root,
-			const struct pdbg_target *prev)
+static const void *dt_require_property(struct pdbg_target *node,
+				       const char *name, int wanted_len,
+				       size_t *len)
 {
-	/* Children? */
-	if (!list_empty(&prev->children))
-		return dt_first(prev);
-
-	do {
-		/* More siblings? */
-		if (prev->list.next != &prev->parent->children.n)
-			return list_entry(prev->list.next, struct pdbg_target,list);
-
-		/* No more siblings, move up to parent. */
-		prev = prev->parent;
-	} while (prev != root);
-
-	return NULL;
-}
-
-static const struct dt_property *dt_require_property(const struct pdbg_target *node,
-						     const char *name, int wanted_len)
-{
-	const struct dt_property *p = dt_find_property(node, name);
+	const void *p = dt_get_property(node, name, len);
 
 	if (!p) {
 		const char *path = dt_get_path(node);
@@ -457,13 +1198,13 @@ static const struct dt_property *dt_require_property(const struct pdbg_target *n
 			path, name);
 		assert(false);
 	}
-	if (wanted_len >= 0 && p->len != wanted_len) {
+	if (wanted_len >= 0 && *len != wanted_len) {
 		const char *path = dt_get_path(node);
 
 		prerror("DT: Unexpected property length %s/%s\n",
 			path, name);
 		prerror("DT: Expected len: %d got len: %zu\n",
-			wanted_len, p->len);
+			wanted_len, *len);
 		assert(false);
 	}
 
@@ -472,46 +1213,41 @@ static const struct dt_property *dt_require_property(const struct pdbg_target *n
 
 bool pdbg_target_compatible(struct pdbg_target *target, const char *compatible)
 {
-        char *c, *end;
-        size_t len;
+	const struct dt_compat *compat = dt_compat_find(compatible);
 
-        c = pdbg_target_property(target, "compatible", &len);
-        if (!c)
-                return false;
-
-        end = c + len;
-        while(c < end) {
-                if (!strcasecmp(compatible, c))
-                        return true;
-
-                c += strlen(c) + 1;
-        }
-
-        return false;
+	return compat && dt_compat_has(target, compat);
 }
 
 struct pdbg_target *__pdbg_next_compatible_node(struct pdbg_target *root,
                                                 struct pdbg_target *prev,
                                                 const char *compat)
 {
-        struct pdbg_target *target;
+	const struct dt_compat *c;
+	struct pdbg_target *target;
+	int i;
 
-        target = prev ? dt_next(root, prev) : root;
-        for (; target; target = dt_next(root, target))
-                if (pdbg_target_compatible(target, compat))
-                        return target;
-        return NULL;
-}
+	if (!prev)
+		dt_expand_tree(root);
 
-static uint32_t dt_prop_get_u32_def(const struct pdbg_target *node,
-				    const char *prop, uint32_t def)
-{
-        const struct dt_property *p = dt_find_property(node, prop);
+	c = dt_compat_find(compat);
+	if (!c)
+		return NULL;
+
+	/* Descendants of root, including itself, are contiguous in device
+	 * tree order */
+	if (prev)
+		i = target_array_lower_bound(&c->targets, prev->fdt_offset) + 1;
+	else
+		i = target_array_lower_bound(&c->targets, root->fdt_offset);
 
-        if (!p)
-                return def;
+	if (i >= c->targets.count)
+		return NULL;
 
-        return dt_property_get_cell(p, 0);
+	target = c->targets.targets[i];
+	if (target->fdt_offset >= root->fdt_end)
+		return NULL;
+
+	return target;
 }
 
 static enum pdbg_target_status str_to_status(const char *status)
@@ -536,114 +1272,183 @@ static enum pdbg_target_status str_to_status(const char *status)
 		assert(0);
 }
 
-static int dt_expand_node(struct pdbg_target *node, const void *fdt, int fdt_node)
+/* Sets up a target from its fdt node. Only the properties needed up
+ * front are read unless the tree is being copied out of the fdt. */
+static void dt_init_node(struct pdbg_target *node, int fdt_node)
 {
-	const struct fdt_property *prop;
-	int offset, nextoffset, err;
-	struct pdbg_target *child;
 	const char *name;
-	uint32_t tag;
-	uint32_t data;
-
-	if (((err = fdt_check_header(fdt)) != 0)
-	    || (fdt_node < 0) || (fdt_node % FDT_TAGSIZE)
-	    || (fdt_next_tag(fdt, fdt_node, &fdt_node) != FDT_BEGIN_NODE)) {
-		prerror("FDT: Error %d parsing node 0x%x\n", err, fdt_node);
-		return -1;
-	}
-
-	nextoffset = fdt_node;
-	do {
-		offset = nextoffset;
-
-		tag = fdt_next_tag(fdt, offset, &nextoffset);
-		switch (tag) {
-		case FDT_PROP:
-			prop = fdt_offset_ptr(fdt, offset, 0);
-			name = fdt_string(fdt, fdt32_to_cpu(prop->nameoff));
-			if (strcmp("index", name) == 0) {
-				memcpy(&data, prop->data, sizeof(data));
-				node->index = fdt32_to_cpu(data);
-			}
+	const void *val;
+	size_t size;
+	int offset, len;
 
-			if (strcmp("status", name) == 0)
-				node->status = str_to_status(prop->data);
+	node->fdt_offset = fdt_node;
 
-			dt_add_property(node, name, prop->data,
-					fdt32_to_cpu(prop->len));
-			break;
-		case FDT_BEGIN_NODE:
-			name = fdt_get_name(fdt, offset, NULL);
-			child = dt_new_node(name, fdt, offset);
-			assert(child);
-			nextoffset = dt_expand_node(child, fdt, offset);
-
-			/*
-			 * This may fail in case of duplicate, keep it
-			 * going for now, we may ultimately want to
-			 * assert
-			 */
-			(void)dt_attach_root(node, child);
-			break;
-		case FDT_END:
-			return -1;
+	if (pdbg_dt_lazy) {
+		u32 phandle = fdt_get_phandle(pdbg_fdt, fdt_node);
+
+		if (phandle) {
+			node->phandle = phandle;
+			if (node->phandle >= last_phandle)
+				last_phandle = node->phandle;
 		}
-	} while (tag != FDT_END_NODE);
+	} else {
+		fdt_for_each_property_offset(offset, pdbg_fdt, fdt_node) {
+			val = fdt_getprop_by_offset(pdbg_fdt, offset, &name, &len);
+			dt_add_property(node, name, val, len);
+		}
+	}
+
+	val = dt_scan_property(node, "index", &size);
+	if (val)
+		node->index = dt_property_get_cell(val, size, 0);
 
-	return nextoffset;
+	val = dt_scan_property(node, "status", &size);
+	if (val)
+		node->status = str_to_status(val);
+
+	dt_compat_update(node);
 }
 
-static void dt_expand(void *root, const void *fdt)
+static bool dt_is_class(const struct pdbg_target *node, const char *class)
 {
-	PR_DEBUG("FDT: Parsing fdt @%p\n", fdt);
-
-	if (dt_expand_node(root, fdt, 0) < 0)
-		abort();
+	return node->class && !strcmp(node->class, class);
 }
 
-static u64 dt_get_number(const void *pdata, unsigned int cells)
+/* Works out the things about a node which depend on its place in the
+ * tree so they don't have to be found by walking up it each time */
+static void dt_link_node(struct pdbg_target *node)
 {
-	const u32 *p = pdata;
-	u64 ret = 0;
+	struct pdbg_target *parent = node->parent;
+	const char *parent_path = "";
+	char *path;
 
-	while(cells--)
-		ret = (ret << 32) | be32toh(*(p++));
-	return ret;
+	if (parent && parent->parent)
+		parent_path = parent->path;
+
+	path = malloc(strlen(parent_path) + strlen(node->dn_name) + 2);
+	if (!path) {
+		prerror("Failed to allocate path for %s\n", node->dn_name);
+		abort();
+	}
+	sprintf(path, "%s/%s", parent_path, node->dn_name);
+	node->path = path;
+
+	if (!parent)
+		return;
+
+	if (node->index == -1)
+		node->index = parent->index;
+
+	node->parent_fsi = dt_is_class(parent, "fsi") ? parent : parent->parent_fsi;
+	node->parent_pib = dt_is_class(parent, "pib") ? parent : parent->parent_pib;
+	node->parent_core = dt_is_class(parent, "core") ? parent : parent->parent_core;
 }
 
-static u32 dt_n_address_cells(const struct pdbg_target *node)
+void dt_expand_children(struct pdbg_target *node)
 {
-	if (!node->parent)
-		return 0;
-	return dt_prop_get_u32_def(node->parent, "#address-cells", 2);
+	struct pdbg_target *child, *prev = NULL;
+	struct dt_child *children = NULL;
+	int offset, count = 0, alloc = 0, i;
+
+	if (node->expanded)
+		return;
+
+	node->expanded = true;
+	if (!pdbg_fdt || node->fdt_offset < 0)
+		return;
+
+	fdt_for_each_subnode(offset, pdbg_fdt, node->fdt_offset) {
+		child = dt_new_node(fdt_get_name(pdbg_fdt, offset, NULL),
+				    pdbg_fdt, offset);
+		assert(child);
+		dt_init_node(child, offset);
+
+		/* A subtree ends where the next one starts */
+		if (prev)
+			prev->fdt_end = offset;
+		child->fdt_end = node->fdt_end;
+		prev = child;
+
+		if (count == alloc) {
+			alloc = alloc ? alloc * 2 : 8;
+			children = realloc(children, alloc * sizeof(*children));
+			if (!children) {
+				prerror("Failed to allocate children\n");
+				abort();
+			}
+		}
+		dt_child_init(&children[count], child, count);
+		count++;
+	}
+
+	/*
+	 * Duplicates are dropped with an error, keep it going for now,
+	 * we may ultimately want to assert
+	 */
+	dt_attach_children(node, children, count);
+
+	for (i = 0; i < count; i++)
+		dt_link_node(children[i].node);
+	free(children);
 }
 
-static u32 dt_n_size_cells(const struct pdbg_target *node)
+void dt_expand_tree(struct pdbg_target *root)
 {
-	if (!node->parent)
-		return 0;
-	return dt_prop_get_u32_def(node->parent, "#size-cells", 1);
+	struct pdbg_target *child;
+
+	if (root->subtree_expanded)
+		return;
+
+	dt_expand_children(root);
+	dt_for_each_child(root, child)
+		dt_expand_tree(child);
+
+	root->subtree_expanded = true;
 }
 
 uint64_t pdbg_target_address(struct pdbg_target *target, uint64_t *out_size)
 {
-	const struct dt_property *p;
-	u32 na = dt_n_address_cells(target);
-	u32 ns = dt_n_size_cells(target);
-	u32 n;
+	const struct dt_prop_index *index = dt_get_index(target);
+	size_t len;
+
+	if (!index->has_reg) {
+		/* Missing or too short for the parent's address cells */
+		dt_require_property(target, "reg", -1, &len);
+		assert(index->has_reg);
+	}
 
-	p = dt_require_property(target, "reg", -1);
-	n = (na + ns) * sizeof(u32);
-	assert(n <= p->len);
 	if (out_size)
-		*out_size = dt_get_number(p->prop + na * sizeof(u32), ns);
-	return dt_get_number(p->prop, na);
+		*out_size = index->size;
+	return index->address;
+}
+
+/* 64-bit FNV-1a */
+static uint64_t dt_hash_fdt(const void *fdt)
+{
+	const unsigned char *p = fdt;
+	uint64_t hash = 0xcbf29ce484222325ULL;
+	size_t i;
+
+	for (i = 0; i < fdt_totalsize(fdt); i++) {
+		hash ^= p[i];
+		hash *= 0x100000001b3ULL;
+	}
+
+	return hash;
+}
+
+uint64_t dt_fdt_hash(void)
+{
+	return pdbg_fdt_hash;
 }
 
 void pdbg_targets_init(void *fdt)
 {
+	int err;
+
 	/* Root node needs to be valid when this function returns */
 	pdbg_dt_root = dt_new_node("", NULL, 0);
+	pdbg_dt_root->path = "/";
 
 	if (!fdt)
 		fdt = pdbg_default_dtb();
@@ -653,14 +1458,48 @@ void pdbg_targets_init(void *fdt)
 		return;
 	}
 
-	dt_expand(pdbg_dt_root, fdt);
+	PR_DEBUG("FDT: Parsing fdt @%p\n", fdt);
+
+	err = fdt_check_header(fdt);
+	if (err) {
+		prerror("FDT: Error %d parsing header\n", err);
+		abort();
+	}
+
+	dt_arena_init(fdt);
+	pdbg_fdt = fdt;
+	pdbg_fdt_hash = dt_hash_fdt(fdt);
+	dt_init_node(pdbg_dt_root, 0);
+
+	if (!pdbg_dt_lazy) {
+		dt_expand_tree(pdbg_dt_root);
+		pdbg_fdt = NULL;
+	}
+}
+
+void pdbg_set_lazy_targets(bool lazy)
+{
+	pdbg_dt_lazy = lazy;
+}
+
+void pdbg_targets_expand(struct pdbg_target *target)
+{
+	dt_expand_tree(target ? target : pdbg_target_root());
 }
 
 char *pdbg_target_path(const struct pdbg_target *target)
 {
+	if (target && target->path)
+		return strdup(target->path);
+
 	return dt_get_path(target);
 }
 
+const char *pdbg_target_path_const(const struct pdbg_target *target)
+{
+	return target->path;
+}
+
 struct pdbg_target *pdbg_target_from_path(struct pdbg_target *target, const char *path)
 {
 	if (!target)
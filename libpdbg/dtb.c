@@ -224,11 +224,32 @@ int pdbg_set_backend(enum pdbg_backend backend, const char *backend_option)
 	return 0;
 }
 
+enum pdbg_backend pdbg_get_backend(void)
+{
+	return pdbg_backend;
+}
+
 const char *pdbg_get_backend_option(void)
 {
 	return pdbg_backend_option;
 }
 
+/* Returns true if targets under different pibs may be accessed
+ * concurrently from multiple threads. The FSI, I2C and cronus backends
+ * all share a single bus or connection without any locking. */
+bool pdbg_backend_is_threadsafe(void)
+{
+	switch(pdbg_backend) {
+	case PDBG_BACKEND_KERNEL:
+	case PDBG_BACKEND_HOST:
+	case PDBG_BACKEND_FAKE:
+		return true;
+
+	default:
+		return false;
+	}
+}
+
 /* Determines what platform we are running on and returns a pointer to
  * the fdt that is most likely to work on the system. */
 void *pdbg_default_dtb(void)
@@ -20,16 +20,41 @@
 #include "hwunit.h"
 
 #define MAX_HW_UNITS	1024
+#define HW_UNIT_BUCKETS	128
 
 static const struct hw_unit_info *g_hw_unit[MAX_HW_UNITS];
 static int g_hw_unit_count;
 
+/* Units are hashed by compatible string. Each bucket and chain entry is
+ * the index of the next unit plus one, so zero ends the chain. */
+static int g_hw_unit_bucket[HW_UNIT_BUCKETS];
+static int g_hw_unit_next[MAX_HW_UNITS];
+
+static unsigned int hwunit_hash(const char *compat)
+{
+	unsigned int hash = 5381;
+
+	while (*compat)
+		hash = hash * 33 + *compat++;
+
+	return hash % HW_UNIT_BUCKETS;
+}
+
 void pdbg_hwunit_register(const struct hw_unit_info *hw_unit)
 {
+	struct pdbg_target *target = hw_unit->hw_unit;
+	unsigned int hash = hwunit_hash(target->compatible);
+
 	assert(g_hw_unit_count < MAX_HW_UNITS);
 
+	/* The first unit registered for a compatible string wins */
+	if (pdbg_hwunit_find_compatible(target->compatible))
+		return;
+
 	g_hw_unit[g_hw_unit_count] = hw_unit;
+	g_hw_unit_next[g_hw_unit_count] = g_hw_unit_bucket[hash];
 	g_hw_unit_count++;
+	g_hw_unit_bucket[hash] = g_hw_unit_count;
 }
 
 const struct hw_unit_info *pdbg_hwunit_find_compatible(const char *compat)
@@ -38,8 +63,8 @@ const struct hw_unit_info *pdbg_hwunit_find_compatible(const char *compat)
 	struct pdbg_target *target;
 	int i;
 
-	for (i = 0; i < g_hw_unit_count; i++) {
-		p = g_hw_unit[i];
+	for (i = g_hw_unit_bucket[hwunit_hash(compat)]; i; i = g_hw_unit_next[i - 1]) {
+		p = g_hw_unit[i - 1];
 		target = p->hw_unit;
 
 		if (!strcmp(target->compatible, compat))
@@ -104,9 +104,36 @@ struct fsi {
 struct core {
 	struct pdbg_target target;
 	bool release_spwkup;
+
+	/* Special wakeup is issued and completed separately so requests to
+	 * many cores can be in flight at once. spwkup_wait() completes
+	 * whichever of assert or release was last issued. */
+	bool spwkup_pending;
+	bool spwkup_asserted;
+	int (*spwkup_issue)(struct core *);
+	int (*spwkup_wait)(struct core *);
+
+	/* A RAM session keeps every thread on the core quiesced and the core
+	 * in RAM mode across multiple ram_setup()/ram_destroy() calls on its
+	 * threads. Sessions may nest, only the outermost begin/end does any
+	 * work. */
+	int ram_session;
+	int ram_thread_sel;		/* thread currently selected in SPRC */
+	uint8_t ram_session_threads;	/* threads rammed during the session */
+	int (*ram_session_begin)(struct core *);
+	int (*ram_session_end)(struct core *);
+
+	/* Status of every thread on the core indexed by thread id, filled
+	 * in by thread_status_fetch() so probing each thread doesn't need
+	 * to read the core wide status registers again */
+	bool thread_status_valid;
+	struct thread_state thread_status[8];
+	int (*thread_status_fetch)(struct core *);
 };
 #define target_to_core(x) container_of(x, struct core, target)
 
+struct thread_xlate;
+
 struct thread {
 	struct pdbg_target target;
 	struct thread_state status;
@@ -116,6 +143,15 @@ struct thread {
 	int (*stop)(struct thread *);
 	int (*sreset)(struct thread *);
 
+	/* Refresh status.active and status.quiesced from as few registers as
+	 * possible. Optional, targets without it are probed instead. */
+	int (*poll_status)(struct thread *);
+
+	/* Step count instructions recording the NIA after each one in
+	 * nia[]. Optional, enters step mode once for the whole trace rather
+	 * than once per instruction. */
+	int (*step_trace)(struct thread *, int count, uint64_t *nia);
+
 	bool ram_did_quiesce; /* was the thread quiesced by ram mode */
 
 	/* ram_setup() should be called prior to using ram_instruction() to
@@ -128,6 +164,9 @@ struct thread {
 	int (*ram_getxer)(struct pdbg_target *, uint64_t *value);
 	int (*ram_putxer)(struct pdbg_target *, uint64_t value);
 	int (*enable_attn)(struct pdbg_target *);
+
+	/* Cached address translation state, see xlate.c */
+	struct thread_xlate *xlate;
 };
 #define target_to_thread(x) container_of(x, struct thread, target)
 
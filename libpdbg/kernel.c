@@ -66,14 +66,9 @@ static int kernel_fsi_getcfam(struct fsi *fsi, uint32_t addr64, uint32_t *value)
 	int rc;
 	uint32_t tmp, addr = (addr64 & 0x7ffc00) | ((addr64 & 0x3ff) << 2);
 
-	rc = lseek(fsi_fd, addr, SEEK_SET);
-	if (rc < 0) {
-		rc = errno;
-		PR_WARNING("seek failed: %s\n", strerror(errno));
-		return rc;
-	}
-
-	rc = read(fsi_fd, &tmp, 4);
+	/* Use pread()/pwrite() so accesses from multiple threads don't
+	 * race on the shared file offset */
+	rc = pread(fsi_fd, &tmp, 4, addr);
 	if (rc < 0) {
 		rc = errno;
 		if ((addr64 & 0xfff) != 0xc09)
@@ -93,15 +88,8 @@ static int kernel_fsi_putcfam(struct fsi *fsi, uint32_t addr64, uint32_t data)
 	int rc;
 	uint32_t tmp, addr = (addr64 & 0x7ffc00) | ((addr64 & 0x3ff) << 2);
 
-	rc = lseek(fsi_fd, addr, SEEK_SET);
-	if (rc < 0) {
-		rc = errno;
-		PR_WARNING("seek failed: %s\n", strerror(errno));
-		return rc;
-	}
-
 	tmp = htobe32(data);
-	rc = write(fsi_fd, &tmp, 4);
+	rc = pwrite(fsi_fd, &tmp, 4, addr);
 	if (rc < 0) {
 		rc = errno;
 		PR_ERROR("Failed to write to 0x%08" PRIx32 " (%016" PRIx32 ")\n", addr, addr64);
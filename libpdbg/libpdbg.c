@@ -6,46 +6,56 @@
 
 static pdbg_progress_tick_t progress_tick;
 
-struct pdbg_target *__pdbg_next_target(const char *class, struct pdbg_target *parent, struct pdbg_target *last)
+struct pdbg_target *__pdbg_next_expanded_target(const char *class, struct pdbg_target *parent, struct pdbg_target *last)
 {
-	struct pdbg_target *next, *tmp;
 	struct pdbg_target_class *target_class;
+	struct pdbg_target *next;
+	int i;
+
+	if (last) {
+		/* The class was resolved on the first step */
+		target_class = last->target_class;
+		i = last->class_index + 1;
+	} else {
+		if (class && !find_target_class(class))
+			return NULL;
+
+		target_class = require_target_class(class);
+		i = parent ? target_array_lower_bound(&target_class->targets, parent->fdt_offset) : 0;
+	}
 
-	if (class && !find_target_class(class))
+	/* No more targets left to check in this class */
+	if (i >= target_class->targets.count)
 		return NULL;
 
-	target_class = require_target_class(class);
+	next = target_class->targets.targets[i];
 
-retry:
-	/* No more targets left to check in this class */
-	if ((last && last->class_link.next == &target_class->targets.n) ||
-	    list_empty(&target_class->targets))
+	/* Descendants of the parent are contiguous in device tree order */
+	if (parent && next->fdt_offset >= parent->fdt_end)
 		return NULL;
 
-	if (last)
-		next = list_entry(last->class_link.next, struct pdbg_target, class_link);
-	else
-		if (!(next = list_top(&target_class->targets, struct pdbg_target, class_link)))
-			return NULL;
+	return next;
+}
 
-	if (!parent)
-		/* Parent is null, no need to check if this is a child */
-		return next;
-	else {
-		/* Check if this target is a child of the given parent */
-		for (tmp = next; tmp && next->parent && tmp != parent; tmp = tmp->parent) {}
-		if (tmp == parent)
-			return next;
-		else {
-			last = next;
-			goto retry;
-		}
-	}
+struct pdbg_target *__pdbg_next_target(const char *class, struct pdbg_target *parent, struct pdbg_target *last)
+{
+	/* The class list only holds targets which have been created so
+	 * make sure all those we could visit exist before starting */
+	if (!last)
+		dt_expand_tree(parent ? parent : pdbg_target_root());
+
+	return __pdbg_next_expanded_target(class, parent, last);
 }
 
 struct pdbg_target *__pdbg_next_child_target(struct pdbg_target *parent, struct pdbg_target *last)
 {
-	if (!parent || list_empty(&parent->children))
+	if (!parent)
+		return NULL;
+
+	if (!last)
+		dt_expand_children(parent);
+
+	if (list_empty(&parent->children))
 		return NULL;
 
 	if (!last)
@@ -92,6 +102,14 @@ struct pdbg_target *pdbg_target_parent(const char *class, struct pdbg_target *ta
 	if (!class)
 		return target->parent;
 
+	/* These are looked up so often they are found up front */
+	if (!strcmp(class, "core"))
+		return target->parent_core;
+	if (!strcmp(class, "pib"))
+		return target->parent_pib;
+	if (!strcmp(class, "fsi"))
+		return target->parent_fsi;
+
 	for (parent = target->parent; parent && parent->parent; parent = parent->parent) {
 		if (!strcmp(class, pdbg_target_class_name(parent)))
 			return parent;
@@ -137,15 +155,15 @@ const char *pdbg_target_dn_name(struct pdbg_target *target)
 
 int pdbg_target_u32_property(struct pdbg_target *target, const char *name, uint32_t *val)
 {
-	uint32_t *p;
+	const uint32_t *p;
 	size_t size;
 
-	p = pdbg_get_target_property(target, name, &size);
+	p = dt_property_cells(target, name, &size);
 	if (!p)
 		return -1;
 
 	assert(size == 4);
-	*val = be32toh(*p);
+	*val = *p;
 
 	return 0;
 }
@@ -153,19 +171,15 @@ int pdbg_target_u32_property(struct pdbg_target *target, const char *name, uint3
 int pdbg_target_u32_index(struct pdbg_target *target, const char *name, int index, uint32_t *val)
 {
         size_t len;
-	uint32_t *p;
+	const uint32_t *p;
 
-        p = pdbg_get_target_property(target, name, &len);
+        p = dt_property_cells(target, name, &len);
         if (!p)
                 return -1;
 
         assert(len >= (index+1)*sizeof(uint32_t));
 
-	/* FDT pointers should be aligned, but best to check */
-	assert(!((uintptr_t) p & 0x3));
-
-        /* Always aligned, so this works. */
-        *val = be32toh(p[index]);
+        *val = p[index];
         return 0;
 }
 
@@ -102,15 +102,44 @@ uint64_t pdbg_target_address(struct pdbg_target *target, uint64_t *size);
 
 /* Misc. */
 void pdbg_targets_init(void *fdt);
+
+/* By default pdbg_targets_init() copies the whole device tree out of the
+ * fdt. Enabling this beforehand instead creates targets as they are first
+ * used and reads their properties directly from the fdt, which must then
+ * remain valid. */
+void pdbg_set_lazy_targets(bool lazy);
+
+/* Create every target below target (or in the whole tree if NULL) which
+ * hasn't been created yet. Creating targets isn't thread safe, so this
+ * must be done before using them from more than one thread. */
+void pdbg_targets_expand(struct pdbg_target *target);
+
+/* Allows pdbg_target_probe_all() and pdbg_targets_probe() to probe
+ * targets on different chips concurrently when the backend is thread
+ * safe. Targets are still only probed after their parents. */
+void pdbg_set_parallel_probe(bool parallel);
 void pdbg_target_probe_all(struct pdbg_target *parent);
+void pdbg_targets_probe(struct pdbg_target **targets, int count);
+
+/* Probe results can be saved and used to avoid probing targets which
+ * don't exist in later runs, so long as they use the same device tree
+ * and hardware. Loading must be done before anything is probed. Both
+ * return 0 on success. */
+int pdbg_probe_cache_load(const char *path);
+int pdbg_probe_cache_save(const char *path);
 enum pdbg_target_status pdbg_target_probe(struct pdbg_target *target);
 void pdbg_target_release(struct pdbg_target *target);
 enum pdbg_target_status pdbg_target_status(struct pdbg_target *target);
 void pdbg_target_status_set(struct pdbg_target *target, enum pdbg_target_status status);
 int pdbg_set_backend(enum pdbg_backend backend, const char *backend_option);
+bool pdbg_backend_is_threadsafe(void);
 void *pdbg_default_dtb(void);
 uint32_t pdbg_target_index(struct pdbg_target *target);
 char *pdbg_target_path(const struct pdbg_target *target);
+
+/* Same as above but returns the path stored with the target, which must
+ * not be freed or modified */
+const char *pdbg_target_path_const(const struct pdbg_target *target);
 struct pdbg_target *pdbg_target_from_path(struct pdbg_target *target, const char *path);
 uint32_t pdbg_parent_index(struct pdbg_target *target, char *klass);
 char *pdbg_target_class_name(struct pdbg_target *target);
@@ -136,6 +165,22 @@ int pib_read(struct pdbg_target *target, uint64_t addr, uint64_t *val);
 int pib_write(struct pdbg_target *target, uint64_t addr, uint64_t val);
 int pib_write_mask(struct pdbg_target *target, uint64_t addr, uint64_t val, uint64_t mask);
 int pib_wait(struct pdbg_target *pib_dt, uint64_t addr, uint64_t mask, uint64_t data);
+int pib_wait_timeout(struct pdbg_target *pib_dt, uint64_t addr, uint64_t mask,
+		     uint64_t data, uint64_t timeout, uint64_t *value);
+int pib_wait_cond(struct pdbg_target *pib_dt, uint64_t addr,
+		  bool (*cond)(uint64_t value, void *priv), void *priv,
+		  uint64_t timeout, uint64_t *value);
+
+/* Accumulated over every pib_wait*() call. Times are in microseconds. */
+struct pib_wait_stats {
+	uint64_t waits;
+	uint64_t polls;
+	uint64_t sleeps;
+	uint64_t timeouts;
+	uint64_t total_us;
+	uint64_t max_us;
+};
+void pib_wait_get_stats(struct pib_wait_stats *stats);
 
 struct thread_regs {
 	uint64_t nia;
@@ -178,6 +223,7 @@ struct thread_regs {
 
 int thread_putmsr(struct pdbg_target *target, uint64_t val);
 int thread_getmem(struct pdbg_target *thread, uint64_t addr, uint64_t *value);
+int thread_getmem_range(struct pdbg_target *thread, uint64_t addr, uint64_t *values, int count);
 int thread_putnia(struct pdbg_target *target, uint64_t val);
 int thread_putspr(struct pdbg_target *target, int spr, uint64_t val);
 int thread_putgpr(struct pdbg_target *target, int spr, uint64_t val);
@@ -191,6 +237,41 @@ int thread_getxer(struct pdbg_target *thread, uint64_t *value);
 int thread_putxer(struct pdbg_target *thread, uint64_t value);
 int thread_getregs(struct pdbg_target *target, struct thread_regs *regs);
 
+/* Registers read by thread_getregs_subset() */
+#define THREAD_REG_GPRS		0x001
+#define THREAD_REG_NIA		0x002
+#define THREAD_REG_MSR		0x004
+#define THREAD_REG_CR		0x008
+#define THREAD_REG_LR		0x010
+#define THREAD_REG_CTR		0x020
+#define THREAD_REG_CFAR		0x040
+#define THREAD_REG_TAR		0x080
+#define THREAD_REG_XER		0x100
+
+/* Read only the registers in mask into the matching fields of regs, leaving
+ * the others untouched. Unlike thread_getregs() nothing is printed and the
+ * registers are RAMed in as few operations as possible. */
+int thread_getregs_subset(struct pdbg_target *target, unsigned int mask, struct thread_regs *regs);
+
+/* Translate a data effective address of a stopped thread to a real address
+ * by walking its page tables through the given mem target. Translations are
+ * cached until the thread is next started, stepped or has its MSR/SPRs
+ * changed. */
+int thread_translate(struct pdbg_target *thread, struct pdbg_target *mem, uint64_t ea, uint64_t *ra);
+void thread_translate_flush(struct pdbg_target *thread);
+
+int core_thread_status_fetch(struct pdbg_target *core);
+int chip_thread_status_fetch(struct pdbg_target *pib);
+int core_special_wakeup_issue(struct pdbg_target *core);
+void core_special_wakeup_set_sticky(bool sticky);
+bool core_special_wakeup_is_sticky(void);
+
+/* Hold all threads on a core quiesced while several of its threads are
+ * accessed in turn. Siblings stopped by the session are restarted by the
+ * matching end call. A no-op on cores that don't need it. */
+int core_ram_session_begin(struct pdbg_target *core);
+int core_ram_session_end(struct pdbg_target *core);
+
 enum pdbg_sleep_state {PDBG_THREAD_STATE_RUN, PDBG_THREAD_STATE_DOZE,
 		       PDBG_THREAD_STATE_NAP, PDBG_THREAD_STATE_SLEEP,
 		       PDBG_THREAD_STATE_STOP};
@@ -206,14 +287,22 @@ struct thread_state {
 
 int thread_start(struct pdbg_target *target);
 int thread_step(struct pdbg_target *target, int steps);
+int thread_step_trace(struct pdbg_target *target, int steps, uint64_t *nia);
 int thread_stop(struct pdbg_target *target);
 int thread_sreset(struct pdbg_target *target);
 int thread_start_all(void);
 int thread_step_all(void);
 int thread_stop_all(void);
 int thread_sreset_all(void);
+
+/* Nanoseconds between the first and last thread changing state during the
+ * most recent thread_*_all() call */
+uint64_t thread_control_skew(void);
 struct thread_state thread_status(struct pdbg_target *target);
 
+/* Cheaply refresh whether a running thread has stopped */
+struct thread_state thread_status_poll(struct pdbg_target *target);
+
 int getring(struct pdbg_target *chiplet_target, uint64_t ring_addr, uint64_t ring_len, uint32_t result[]);
 
 int htm_start(struct pdbg_target *target);
@@ -26,7 +26,10 @@
 #include "bitutils.h"
 #include "debug.h"
 
-#define RAS_STATUS_TIMEOUT	100
+/* Timeouts are in microseconds */
+#define RAS_STATUS_TIMEOUT	100000 /* 100ms */
+#define STEP_TIMEOUT		100000 /* 100ms */
+#define RAM_TIMEOUT		100000 /* 100ms */
 
 #define DIRECT_CONTROLS_REG    		0x0
 #define  DIRECT_CONTROL_SP_SRESET	PPC_BIT(60)
@@ -97,7 +100,8 @@
 #define MFXERF3_OPCODE 0x00000310UL
 
 /* How long (in us) to wait for a special wakeup to complete */
-#define SPECIAL_WKUP_TIMEOUT		10
+#define SPECIAL_WKUP_TIMEOUT		10000
+#define SPECIAL_WKUP_CLEAR_TIMEOUT	10000
 
 #include "chip.h"
 
@@ -143,23 +147,10 @@ static uint64_t mtxerf(uint64_t reg, uint64_t field)
 
 static int assert_special_wakeup(struct core *chip)
 {
-	int i = 0;
-	uint64_t gp0;
-
 	/* Assert special wakeup to prevent low power states */
 	CHECK_ERR(pib_write(&chip->target, PMSPCWKUPFSP_REG, FSP_SPECIAL_WAKEUP));
-
-	/* Poll for completion */
-	do {
-		usleep(1);
-		CHECK_ERR(pib_read(&chip->target, EX_PM_GP0_REG, &gp0));
-
-		if (i++ > SPECIAL_WKUP_TIMEOUT) {
-			PR_ERROR("Timeout waiting for special wakeup on %s@0x%08" PRIx64 "\n", chip->target.name,
-				 pdbg_target_address(&chip->target, NULL));
-			return -1;
-		}
-	} while (!(gp0 & SPECIAL_WKUP_DONE));
+	chip->spwkup_asserted = true;
+	chip->spwkup_pending = true;
 
 	return 0;
 }
@@ -168,6 +159,35 @@ static void deassert_special_wakeup(struct core *chip)
 {
 	/* Assert special wakeup to prevent low power states */
 	pib_write(&chip->target, PMSPCWKUPFSP_REG, 0);
+	chip->spwkup_asserted = false;
+	chip->spwkup_pending = true;
+}
+
+static int p8_core_spwkup_wait(struct core *chip)
+{
+	int rc;
+
+	if (!chip->spwkup_pending)
+		return 0;
+
+	chip->spwkup_pending = false;
+
+	if (!chip->spwkup_asserted) {
+		/* Other wakeup sources may keep the core awake so a
+		 * timeout here isn't an error */
+		pib_wait_timeout(&chip->target, EX_PM_GP0_REG, SPECIAL_WKUP_DONE, 0,
+				 SPECIAL_WKUP_CLEAR_TIMEOUT, NULL);
+		return 0;
+	}
+
+	/* Poll for completion */
+	rc = pib_wait_timeout(&chip->target, EX_PM_GP0_REG, SPECIAL_WKUP_DONE,
+			      SPECIAL_WKUP_DONE, SPECIAL_WKUP_TIMEOUT, NULL);
+	if (rc == -1)
+		PR_ERROR("Timeout waiting for special wakeup on %s@0x%08" PRIx64 "\n", chip->target.name,
+			 pdbg_target_address(&chip->target, NULL));
+
+	return rc;
 }
 
 static struct thread_state get_thread_status(struct thread *thread)
@@ -250,8 +270,8 @@ static struct thread_state get_thread_status(struct thread *thread)
 
 static int p8_thread_step(struct thread *thread, int count)
 {
-	int i;
-	uint64_t ras_mode, ras_status;
+	int i, rc = 0;
+	uint64_t ras_mode;
 
 	/* Activate single-step mode */
 	CHECK_ERR(pib_read(&thread->target, RAS_MODE_REG, &ras_mode));
@@ -259,46 +279,48 @@ static int p8_thread_step(struct thread *thread, int count)
 	CHECK_ERR(pib_write(&thread->target, RAS_MODE_REG, ras_mode));
 
 	/* Step the core */
-	for (i = 0; i < count; i++) {
+	for (i = 0; i < count && !rc; i++) {
 		CHECK_ERR(pib_write(&thread->target, DIRECT_CONTROLS_REG, DIRECT_CONTROL_SP_STEP));
 
 		/* Wait for step to complete */
-		do {
-			CHECK_ERR(pib_read(&thread->target, RAS_STATUS_REG, &ras_status));
-		} while (!(ras_status & RAS_STATUS_INST_COMPLETE));
+		rc = pib_wait_timeout(&thread->target, RAS_STATUS_REG, RAS_STATUS_INST_COMPLETE,
+				      RAS_STATUS_INST_COMPLETE, STEP_TIMEOUT, NULL);
+		if (rc)
+			PR_ERROR("Timeout waiting for thread %d to step\n", thread->id);
 	}
 
 	/* Deactivate single-step mode */
 	ras_mode &= ~MR_DO_SINGLE_MODE;
 	CHECK_ERR(pib_write(&thread->target, RAS_MODE_REG, ras_mode));
 
-	return 0;
+	return rc;
+}
+
+static bool p8_thread_quiesced(uint64_t val, void *priv)
+{
+	return (val & RAS_STATUS_INST_COMPLETE) || (val & RAS_STATUS_TS_QUIESCE);
 }
 
 static int p8_thread_stop(struct thread *thread)
 {
-	int i = 0;
 	uint64_t val;
+	int rc;
 
 	/* Quiese active thread */
 	CHECK_ERR(pib_write(&thread->target, DIRECT_CONTROLS_REG, DIRECT_CONTROL_SP_STOP));
 
-	do {
-		usleep(1);
-
-		/* Wait for thread to quiese */
-		CHECK_ERR(pib_read(&thread->target, RAS_STATUS_REG, &val));
-		if (i++ > RAS_STATUS_TIMEOUT) {
-			PR_ERROR("Unable to quiesce thread %d (0x%016" PRIx64 ").\n",
-				 thread->id, val);
-			PR_ERROR("Continuing anyway.\n");
-			if (val & PPC_BIT(48)) {
-				PR_ERROR("Unable to continue\n");
-			}
-			break;
+	/* Wait for thread to quiese */
+	rc = pib_wait_cond(&thread->target, RAS_STATUS_REG, p8_thread_quiesced, NULL,
+			   RAS_STATUS_TIMEOUT, &val);
+	if (rc == -1) {
+		PR_ERROR("Unable to quiesce thread %d (0x%016" PRIx64 ").\n",
+			 thread->id, val);
+		PR_ERROR("Continuing anyway.\n");
+		if (val & PPC_BIT(48)) {
+			PR_ERROR("Unable to continue\n");
 		}
-	} while (!(val & RAS_STATUS_INST_COMPLETE) &&
-		 !(val & RAS_STATUS_TS_QUIESCE));
+	} else
+		CHECK_ERR(rc);
 
 	thread->status = get_thread_status(thread);
 
@@ -315,11 +337,9 @@ static int p8_thread_start(struct thread *thread)
 	return 0;
 }
 
-static void p8_ram_unquiesce_siblings(struct thread *thread)
+static void p8_ram_unquiesce_siblings(struct core *chip)
 {
 	struct pdbg_target *target;
-	struct core *chip = target_to_core(
-		pdbg_target_require_parent("core", &thread->target));
 
 	pdbg_for_each_compatible(&chip->target, target, "ibm,power8-thread") {
 		struct thread *tmp;
@@ -335,16 +355,15 @@ static void p8_ram_unquiesce_siblings(struct thread *thread)
 			continue;
 
 		p8_thread_start(tmp);
+		thread_translate_flush(target);
 
 		tmp->ram_did_quiesce = false;
 	}
 }
 
-static int p8_ram_quiesce_siblings(struct thread *thread)
+static int p8_ram_quiesce_siblings(struct core *chip)
 {
 	struct pdbg_target *target;
-	struct core *chip = target_to_core(
-		pdbg_target_require_parent("core", &thread->target));
 	int rc = 0;
 
 	pdbg_for_each_compatible(&chip->target, target, "ibm,power8-thread") {
@@ -366,21 +385,68 @@ static int p8_ram_quiesce_siblings(struct thread *thread)
 	if (!rc)
 		return 0;
 
-	p8_ram_unquiesce_siblings(thread);
+	p8_ram_unquiesce_siblings(chip);
 
 	return rc;
 }
 
+static int p8_ram_select_thread(struct core *chip, struct thread *thread)
+{
+	uint64_t val;
+
+	if (chip->ram_session && chip->ram_thread_sel == thread->id)
+		return 0;
+
+	/* Setup SPRC to use SPRD */
+	val = SPR_MODE_SPRC_WR_EN;
+	val = SETFIELD(SPR_MODE_SPRC_SEL, val, 1 << (3 - 0));
+	val = SETFIELD(SPR_MODE_SPRC_T_SEL, val, 1 << (7 - thread->id));
+	CHECK_ERR(pib_write(&chip->target, SPR_MODE_REG, val));
+	CHECK_ERR(pib_write(&chip->target, L0_SCOM_SPRC_REG, SCOM_SPRC_SCRATCH_SPR));
+
+	chip->ram_thread_sel = thread->id;
+
+	return 0;
+}
+
+static int p8_ram_mode(struct core *chip, bool enable)
+{
+	uint64_t ram_mode;
+
+	CHECK_ERR(pib_read(&chip->target, RAM_MODE_REG, &ram_mode));
+	if (enable)
+		ram_mode |= RAM_MODE_ENABLE;
+	else
+		ram_mode &= ~RAM_MODE_ENABLE;
+	CHECK_ERR(pib_write(&chip->target, RAM_MODE_REG, ram_mode));
+
+	return 0;
+}
+
 static int p8_ram_setup(struct thread *thread)
 {
 	struct pdbg_target *target;
 	struct core *chip = target_to_core(
 		pdbg_target_require_parent("core", &thread->target));
-	uint64_t ram_mode, val;
 
 	if (thread->ram_is_setup)
 		return 1;
 
+	if (chip->ram_session) {
+		/* The session already quiesced the core and enabled RAM
+		 * mode so we only need to point the SPRC at this thread */
+		if (!(thread->status.active)) {
+			PR_WARNING("Thread is in power save state, can not RAM\n");
+			return 2;
+		}
+
+		CHECK_ERR(p8_ram_select_thread(chip, thread));
+		chip->ram_session_threads |= 1 << thread->id;
+		thread->ram_is_setup = true;
+
+		return 0;
+	}
+
 	/* We can only ram a thread if all the threads on the core/chip are
 	 * quiesced */
 	pdbg_for_each_compatible(&chip->target, target, "ibm,power8-thread") {
@@ -402,22 +468,19 @@ static int p8_ram_setup(struct thread *thread)
 	}
 
 	/* Activate RAM mode */
-	CHECK_ERR(pib_read(&chip->target, RAM_MODE_REG, &ram_mode));
-	ram_mode |= RAM_MODE_ENABLE;
-	CHECK_ERR(pib_write(&chip->target, RAM_MODE_REG, ram_mode));
-
-	/* Setup SPRC to use SPRD */
-	val = SPR_MODE_SPRC_WR_EN;
-	val = SETFIELD(SPR_MODE_SPRC_SEL, val, 1 << (3 - 0));
-	val = SETFIELD(SPR_MODE_SPRC_T_SEL, val, 1 << (7 - thread->id));
-	CHECK_ERR(pib_write(&chip->target, SPR_MODE_REG, val));
-	CHECK_ERR(pib_write(&chip->target, L0_SCOM_SPRC_REG, SCOM_SPRC_SCRATCH_SPR));
+	CHECK_ERR(p8_ram_mode(chip, true));
+	CHECK_ERR(p8_ram_select_thread(chip, thread));
 
 	thread->ram_is_setup = true;
 
 	return 0;
 }
 
+static bool p8_ram_complete(uint64_t val, void *priv)
+{
+	return (val & RAM_STATUS) || ((val & RAM_EXCEPTION) && (val & LSU_EMPTY));
+}
+
 static int p8_ram_instruction(struct thread *thread, uint64_t opcode, uint64_t *scratch)
 {
 	struct core *chip = target_to_core(
@@ -435,9 +498,8 @@ static int p8_ram_instruction(struct thread *thread, uint64_t opcode, uint64_t *
 	CHECK_ERR(pib_write(&chip->target, RAM_CTRL_REG, val));
 
 	/* wait for completion */
-	do {
-		CHECK_ERR(pib_read(&chip->target, RAM_STATUS_REG, &val));
-	} while (!((val & PPC_BIT(1)) || ((val & PPC_BIT(2)) && (val & PPC_BIT(3)))));
+	CHECK_ERR(pib_wait_cond(&chip->target, RAM_STATUS_REG, p8_ram_complete, NULL,
+				RAM_TIMEOUT, &val));
 
 	if (!(val & PPC_BIT(1))) {
 		if (GETFIELD(PPC_BITMASK(2,3), val) == 0x3) {
@@ -458,7 +520,13 @@ static int p8_ram_destroy(struct thread *thread)
 {
 	struct core *chip = target_to_core(
 		pdbg_target_require_parent("core", &thread->target));
-	uint64_t val, ram_mode;
+	uint64_t val;
+
+	thread->ram_is_setup = false;
+
+	/* Clean-up is deferred to the end of the session */
+	if (chip->ram_session)
+		return 0;
 
 	if (!(get_thread_status(thread).active)) {
 		/* Mark the RAM thread active so GPRs stick */
@@ -468,15 +536,66 @@ static int p8_ram_destroy(struct thread *thread)
 	}
 
 	/* Disable RAM mode */
-	CHECK_ERR(pib_read(&chip->target, RAM_MODE_REG, &ram_mode));
-	ram_mode &= ~RAM_MODE_ENABLE;
-	CHECK_ERR(pib_write(&chip->target, RAM_MODE_REG, ram_mode));
-
-	thread->ram_is_setup = false;
+	CHECK_ERR(p8_ram_mode(chip, false));
 
 	return 0;
 }
 
+/*
+ * Step count instructions recording the NIA after each one. Single-step
+ * mode and the RAM thread select are set up once for the whole trace so
+ * each step only has to enable RAM mode for as long as it takes to read
+ * the NIA.
+ */
+static int p8_thread_step_trace(struct thread *thread, int count, uint64_t *nia)
+{
+	struct core *chip = target_to_core(
+		pdbg_target_require_parent("core", &thread->target));
+	uint64_t ras_mode;
+	int i, rc;
+
+	if (chip->ram_session) {
+		PR_ERROR("Unable to step a thread during a RAM session\n");
+		return 1;
+	}
+
+	CHECK_ERR(p8_ram_setup(thread));
+
+	CHECK_ERR_GOTO(out, rc = p8_ram_mode(chip, false));
+
+	/* Activate single-step mode */
+	CHECK_ERR_GOTO(out, rc = pib_read(&thread->target, RAS_MODE_REG, &ras_mode));
+	CHECK_ERR_GOTO(out, rc = pib_write(&thread->target, RAS_MODE_REG,
+					   ras_mode | MR_DO_SINGLE_MODE));
+
+	for (i = 0; i < count && !rc; i++) {
+		rc = pib_write(&thread->target, DIRECT_CONTROLS_REG, DIRECT_CONTROL_SP_STEP);
+		if (!rc)
+			rc = pib_wait_timeout(&thread->target, RAS_STATUS_REG,
+					      RAS_STATUS_INST_COMPLETE,
+					      RAS_STATUS_INST_COMPLETE, STEP_TIMEOUT, NULL);
+		if (rc) {
+			PR_ERROR("Timeout waiting for thread %d to step\n", thread->id);
+			break;
+		}
+
+		rc = p8_ram_mode(chip, true);
+		if (!rc)
+			rc = ram_read_nia(thread, &nia[i]);
+		if (p8_ram_mode(chip, false))
+			rc = 1;
+	}
+
+	/* Deactivate single-step mode */
+	if (pib_write(&thread->target, RAS_MODE_REG, ras_mode))
+		rc = 1;
+
+out:
+	p8_ram_destroy(thread);
+
+	return rc;
+}
+
 static int p8_ram_getxer(struct pdbg_target *thread, uint64_t *value)
 {
 	uint64_t opcodes[] = {mfxerf(0, 0), mtspr(277, 0), mfxerf(0, 1),
@@ -556,6 +675,8 @@ static int emulate_sreset(struct thread *thread)
 
 static int p8_thread_sreset(struct thread *thread)
 {
+	struct core *chip = target_to_core(
+		pdbg_target_require_parent("core", &thread->target));
 	int rc;
 
 	if (!(thread->status.active)) {
@@ -565,19 +686,19 @@ static int p8_thread_sreset(struct thread *thread)
 		return 0;
 	}
 
-	rc = p8_ram_quiesce_siblings(thread);
+	rc = chip->ram_session_begin(chip);
 	if (rc)
 		return rc;
 
 	/* Thread was active, emulate the sreset */
 	rc = p8_ram_setup(thread);
 	if (rc) {
-		p8_ram_unquiesce_siblings(thread);
+		chip->ram_session_end(chip);
 		return rc;
 	}
 	rc = emulate_sreset(thread);
 	p8_ram_destroy(thread);
-	p8_ram_unquiesce_siblings(thread);
+	chip->ram_session_end(chip);
 	if (rc)
 		return rc;
 	return p8_thread_start(thread);
@@ -596,6 +717,19 @@ static int p8_thread_probe(struct pdbg_target *target)
 	return 0;
 }
 
+/* Debug mode was enabled when the thread was probed so RAS_STATUS alone
+ * says whether the thread is active and quiesced */
+static int p8_thread_poll_status(struct thread *thread)
+{
+	uint64_t val;
+
+	CHECK_ERR(pib_read(&thread->target, RAS_STATUS_REG, &val));
+	thread->status.active = !!(val & RAS_STATUS_THREAD_ACTIVE);
+	thread->status.quiesced = !!(val & RAS_STATUS_TS_QUIESCE);
+
+	return 0;
+}
+
 static void p8_thread_release(struct pdbg_target *target)
 {
 	struct core *core = target_to_core(pdbg_target_require_parent("core", target));
@@ -604,6 +738,8 @@ static void p8_thread_release(struct pdbg_target *target)
 	if (thread->status.quiesced)
 		/* this thread is still quiesced so don't release spwkup */
 		core->release_spwkup = false;
+
+	thread_translate_release(target);
 }
 
 static int p8_get_hid0(struct pdbg_target *chip, uint64_t *value)
@@ -656,9 +792,11 @@ static struct thread p8_thread = {
 		.release = p8_thread_release,
 	},
 	.step = p8_thread_step,
+	.step_trace = p8_thread_step_trace,
 	.start = p8_thread_start,
 	.stop = p8_thread_stop,
 	.sreset = p8_thread_sreset,
+	.poll_status = p8_thread_poll_status,
 	.ram_setup = p8_ram_setup,
 	.ram_instruction = p8_ram_instruction,
 	.ram_destroy = p8_ram_destroy,
@@ -668,13 +806,12 @@ static struct thread p8_thread = {
 };
 DECLARE_HW_UNIT(p8_thread);
 
-static int p8_core_probe(struct pdbg_target *target)
+static int p8_core_spwkup_issue(struct core *core)
 {
 	uint64_t value;
-	struct core *core = target_to_core(target);
 
 	/* Work out if this chip is actually present */
-	if (pib_read(target, SCOM_EX_GP3, &value)) {
+	if (pib_read(&core->target, SCOM_EX_GP3, &value)) {
 		PR_DEBUG("Error reading chip GP3 register\n");
 		return -1;
 	}
@@ -685,6 +822,20 @@ static int p8_core_probe(struct pdbg_target *target)
 	if (assert_special_wakeup(core))
 		return -1;
 
+	return 0;
+}
+
+static int p8_core_probe(struct pdbg_target *target)
+{
+	struct core *core = target_to_core(target);
+
+	/* The wakeup may have already been issued by core_special_wakeup_issue() */
+	if (!core->spwkup_pending && p8_core_spwkup_issue(core))
+		return -1;
+
+	if (p8_core_spwkup_wait(core))
+		return -1;
+
 	/* Child threads will set this to false if they are released while quiesced */
 	core->release_spwkup = true;
 
@@ -717,11 +868,102 @@ static void p8_core_release(struct pdbg_target *target)
 		pdbg_target_release(child);
 	}
 
-	if (!core->release_spwkup)
+	if (!core->release_spwkup || core_special_wakeup_is_sticky())
 		return;
 
+	/* pdbg_target_release() waits for this once all cores have been
+	 * released */
 	deassert_special_wakeup(core);
-	usleep(10000);
+}
+
+/* POWER8 status registers are per thread so there's nothing to share
+ * between threads, just refresh each one */
+static int p8_core_thread_status_fetch(struct core *chip)
+{
+	struct pdbg_target *target;
+
+	pdbg_for_each_target("thread", &chip->target, target) {
+		struct thread *thread;
+
+		if (pdbg_target_status(target) != PDBG_TARGET_ENABLED)
+			continue;
+
+		thread = target_to_thread(target);
+		thread->status = get_thread_status(thread);
+	}
+
+	return 0;
+}
+
+static int p8_ram_session_begin(struct core *chip)
+{
+	int rc;
+
+	if (chip->ram_session++)
+		return 0;
+
+	rc = p8_ram_quiesce_siblings(chip);
+	if (rc)
+		goto out;
+
+	rc = p8_ram_mode(chip, true);
+	if (rc) {
+		p8_ram_unquiesce_siblings(chip);
+		goto out;
+	}
+
+	chip->ram_thread_sel = -1;
+	chip->ram_session_threads = 0;
+
+	return 0;
+
+out:
+	chip->ram_session = 0;
+	return rc;
+}
+
+static int p8_ram_session_end(struct core *chip)
+{
+	struct pdbg_target *target;
+	uint64_t val, active = 0;
+	int rc = 0, mode_rc;
+
+	if (!chip->ram_session)
+		return 1;
+
+	if (--chip->ram_session)
+		return 0;
+
+	/* Mark any inactive threads we rammed as active so their GPRs
+	 * stick. This is done for all threads at once rather than after
+	 * each access. */
+	pdbg_for_each_compatible(&chip->target, target, "ibm,power8-thread") {
+		struct thread *tmp = target_to_thread(target);
+
+		if (pdbg_target_status(target) != PDBG_TARGET_ENABLED)
+			continue;
+
+		if (!(chip->ram_session_threads & (1 << tmp->id)))
+			continue;
+
+		if (!(get_thread_status(tmp).active))
+			active |= PPC_BIT(8) >> tmp->id;
+	}
+
+	/* Errors are reported once the core has been taken back out of
+	 * RAM mode and the siblings restarted */
+	if (active) {
+		rc = pib_read(&chip->target, THREAD_ACTIVE_REG, &val);
+		if (!rc)
+			rc = pib_write(&chip->target, THREAD_ACTIVE_REG, val | active);
+		if (rc)
+			PR_ERROR("Unable to mark rammed threads active\n");
+	}
+
+	mode_rc = p8_ram_mode(chip, false);
+	p8_ram_unquiesce_siblings(chip);
+
+	return rc ? rc : mode_rc;
 }
 
 static struct core p8_core = {
@@ -732,6 +974,11 @@ static struct core p8_core = {
 		.probe = p8_core_probe,
 		.release = p8_core_release,
 	},
+	.spwkup_issue = p8_core_spwkup_issue,
+	.spwkup_wait = p8_core_spwkup_wait,
+	.thread_status_fetch = p8_core_thread_status_fetch,
+	.ram_session_begin = p8_ram_session_begin,
+	.ram_session_end = p8_ram_session_end,
 };
 DECLARE_HW_UNIT(p8_core);
 
@@ -19,11 +19,13 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <inttypes.h>
+#include <ccan/array_size/array_size.h>
 
 #include "hwunit.h"
 #include "operations.h"
 #include "bitutils.h"
 #include "debug.h"
+#include "chip.h"
 
 /*
  * NOTE!
@@ -75,8 +77,12 @@
 #define PPM_SSHFSP	0xf0111
 #define  SPECIAL_WKUP_DONE PPC_BIT(1)
 
-#define RAS_STATUS_TIMEOUT	100 /* 100ms */
-#define SPECIAL_WKUP_TIMEOUT	100 /* 100ms */
+/* Timeouts are in microseconds */
+#define RAS_STATUS_TIMEOUT	100000 /* 100ms */
+#define SPECIAL_WKUP_TIMEOUT	100000 /* 100ms */
+#define SPECIAL_WKUP_CLEAR_TIMEOUT	10000 /* 10ms */
+#define STEP_TIMEOUT		100000 /* 100ms */
+#define RAM_TIMEOUT		100000 /* 100ms */
 
 static uint64_t thread_read(struct thread *thread, uint64_t addr, uint64_t *data)
 {
@@ -92,20 +98,24 @@ static uint64_t thread_write(struct thread *thread, uint64_t addr, uint64_t data
 	return pib_write(chip, addr, data);
 }
 
-static struct thread_state p9_get_thread_status(struct thread *thread)
+static int thread_wait(struct thread *thread, uint64_t addr, uint64_t mask, uint64_t data,
+		       uint64_t timeout, uint64_t *value)
 {
-	uint64_t value;
-	struct thread_state thread_state;
+	struct pdbg_target *chip = require_target_parent(&thread->target);
 
-	thread_read(thread, P9_RAS_STATUS, &value);
+	return pib_wait_timeout(chip, addr, mask, data, timeout, value);
+}
 
-	thread_state.quiesced = (GETFIELD(PPC_BITMASK(8*thread->id, 3 + 8*thread->id), value) == 0xf);
+/* All three status registers hold the state of every thread on the core */
+static struct thread_state p9_decode_thread_status(int id, uint64_t ras_status,
+						   uint64_t thread_info, uint64_t core_state)
+{
+	struct thread_state thread_state;
 
-	thread_read(thread, P9_THREAD_INFO, &value);
-	thread_state.active = !!(value & PPC_BIT(thread->id));
+	thread_state.quiesced = (GETFIELD(PPC_BITMASK(8*id, 3 + 8*id), ras_status) == 0xf);
+	thread_state.active = !!(thread_info & PPC_BIT(id));
 
-	thread_read(thread, P9_CORE_THREAD_STATE, &value);
-	if (value & PPC_BIT(56 + thread->id))
+	if (core_state & PPC_BIT(56 + id))
 		thread_state.sleep_state = PDBG_THREAD_STATE_STOP;
 	else
 		thread_state.sleep_state = PDBG_THREAD_STATE_RUN;
@@ -115,14 +125,82 @@ static struct thread_state p9_get_thread_status(struct thread *thread)
 	return thread_state;
 }
 
+static struct thread_state p9_get_thread_status(struct thread *thread)
+{
+	struct core *core = target_to_core(require_target_parent(&thread->target));
+	uint64_t ras_status, thread_info, core_state;
+
+	/* The state of this thread is about to change so the core's
+	 * snapshot can no longer be trusted */
+	core->thread_status_valid = false;
+
+	thread_read(thread, P9_RAS_STATUS, &ras_status);
+	thread_read(thread, P9_THREAD_INFO, &thread_info);
+	thread_read(thread, P9_CORE_THREAD_STATE, &core_state);
+
+	return p9_decode_thread_status(thread->id, ras_status, thread_info, core_state);
+}
+
+static int p9_core_thread_status_fetch(struct core *core)
+{
+	struct pdbg_target *target;
+	uint64_t ras_status, thread_info, core_state;
+	int i;
+
+	CHECK_ERR(pib_read(&core->target, P9_RAS_STATUS, &ras_status));
+	CHECK_ERR(pib_read(&core->target, P9_THREAD_INFO, &thread_info));
+	CHECK_ERR(pib_read(&core->target, P9_CORE_THREAD_STATE, &core_state));
+
+	for (i = 0; i < ARRAY_SIZE(core->thread_status); i++)
+		core->thread_status[i] = p9_decode_thread_status(i, ras_status,
+								 thread_info, core_state);
+	core->thread_status_valid = true;
+
+	pdbg_for_each_target("thread", &core->target, target) {
+		struct thread *thread;
+
+		if (pdbg_target_status(target) != PDBG_TARGET_ENABLED)
+			continue;
+
+		thread = target_to_thread(target);
+		thread->status = core->thread_status[thread->id];
+	}
+
+	return 0;
+}
+
 static int p9_thread_probe(struct pdbg_target *target)
 {
 	struct thread *thread = target_to_thread(target);
+	struct core *core = target_to_core(require_target_parent(target));
 	uint32_t tid;
 
 	assert(!pdbg_target_u32_property(target, "tid", &tid));
 	thread->id = tid;
-	thread->status = p9_get_thread_status(thread);
+
+	/* The first thread probed on a core reads the status of all of
+	 * them */
+	if (!core->thread_status_valid)
+		p9_core_thread_status_fetch(core);
+
+	if (core->thread_status_valid)
+		thread->status = core->thread_status[thread->id];
+	else
+		thread->status = p9_get_thread_status(thread);
+
+	return 0;
+}
+
+/* Only RAS_STATUS is read so the active state is left as last probed */
+static int p9_thread_poll_status(struct thread *thread)
+{
+	struct core *core = target_to_core(require_target_parent(&thread->target));
+	uint64_t ras_status;
+
+	core->thread_status_valid = false;
+
+	CHECK_ERR(thread_read(thread, P9_RAS_STATUS, &ras_status));
+	thread->status.quiesced = (GETFIELD(PPC_BITMASK(8*thread->id, 3 + 8*thread->id), ras_status) == 0xf);
 
 	return 0;
 }
@@ -134,7 +212,10 @@ static void p9_thread_release(struct pdbg_target *target)
 
 	if (thread->status.quiesced)
 		/* This thread is still quiesced so don't release spwkup */
-		core->release_spwkup = false;}
+		core->release_spwkup = false;
+
+	thread_translate_release(target);
+}
 
 static int p9_thread_start(struct thread *thread)
 {
@@ -157,56 +238,59 @@ static int p9_thread_start(struct thread *thread)
 
 static int p9_thread_stop(struct thread *thread)
 {
-	int i = 0;
+	uint64_t quiesced = PPC_BITMASK(8*thread->id, 3 + 8*thread->id);
 
 	thread_write(thread, P9_DIRECT_CONTROL, PPC_BIT(7 + 8*thread->id));
-	while (!(p9_get_thread_status(thread).quiesced)) {
-		usleep(1000);
-		if (i++ > RAS_STATUS_TIMEOUT) {
-			PR_ERROR("Unable to quiesce thread\n");
-			break;
-		}
-	}
+	if (thread_wait(thread, P9_RAS_STATUS, quiesced, quiesced, RAS_STATUS_TIMEOUT, NULL))
+		PR_ERROR("Unable to quiesce thread\n");
 	thread->status = p9_get_thread_status(thread);
 
 	return 0;
 }
 
-static int p9_thread_step(struct thread *thread, int count)
+static bool p9_thread_can_step(struct thread *thread)
 {
-	uint64_t value;
-	int i;
-
 	/* Can only step if a thread is quiesced */
 	if (!(thread->status.quiesced))
-		return 1;
+		return false;
 
 	/* Core must be active to step */
 	if (!(thread->status.active))
-		return 1;
+		return false;
 
 	/* Stepping a stop instruction doesn't really work */
 	if (thread->status.sleep_state == PDBG_THREAD_STATE_STOP)
+		return false;
+
+	return true;
+}
+
+static int p9_thread_step(struct thread *thread, int count)
+{
+	int i, rc = 0;
+
+	if (!p9_thread_can_step(thread))
 		return 1;
 
 	/* Fence interrupts. */
 	thread_write(thread, P9_RAS_MODEREG, PPC_BIT(57));
 
 	/* Step the core */
-	for (i = 0; i < count; i++) {
+	for (i = 0; i < count && !rc; i++) {
 		/* Step */
 		thread_write(thread, P9_DIRECT_CONTROL, PPC_BIT(5 + 8*thread->id));
 
 		/* Poll PPC complete */
-		do {
-			thread_read(thread, P9_RAS_STATUS, &value);
-		} while (!(value & PPC_BIT(4 + 8*thread->id)));
+		rc = thread_wait(thread, P9_RAS_STATUS, PPC_BIT(4 + 8*thread->id),
+				 PPC_BIT(4 + 8*thread->id), STEP_TIMEOUT, NULL);
+		if (rc)
+			PR_ERROR("Timeout waiting for thread %d to step\n", thread->id);
 	}
 
 	/* Un-fence */
 	thread_write(thread, P9_RAS_MODEREG, 0);
 
-	return 0;
+	return rc;
 }
 
 static int p9_thread_sreset(struct thread *thread)
@@ -222,16 +306,41 @@ static int p9_thread_sreset(struct thread *thread)
 	return 0;
 }
 
+static int p9_ram_mode(struct thread *thread, bool enable)
+{
+	if (enable) {
+		/* Activate thread for ramming */
+		CHECK_ERR(thread_write(thread, P9_THREAD_INFO, PPC_BIT(18 + thread->id)));
+
+		/* Enable ram mode */
+		CHECK_ERR(thread_write(thread, P9_RAM_MODEREG, PPC_BIT(0)));
+	} else {
+		/* Disable ram mode */
+		CHECK_ERR(thread_write(thread, P9_RAM_MODEREG, 0));
+
+		/* Deactivate thread for ramming */
+		CHECK_ERR(thread_write(thread, P9_THREAD_INFO, 0));
+	}
+
+	return 0;
+}
+
 static int p9_ram_setup(struct thread *thread)
 {
 	struct pdbg_target *target;
 	struct core *chip = target_to_core(
 		pdbg_target_require_parent("core", &thread->target));
-	uint64_t value;
 
 	if (thread->ram_is_setup)
 		return 1;
 
+	/* An open session has already quiesced the whole core */
+	if (chip->ram_session) {
+		if (!(thread->status.quiesced))
+			goto out_fail;
+		goto ram_setup;
+	}
+
 	/* We can only ram a thread if all the threads on the core/chip are
 	 * quiesced */
 	pdbg_for_each_target("thread", &chip->target, target) {
@@ -247,23 +356,16 @@ static int p9_ram_setup(struct thread *thread)
 			goto out_fail;
 	}
 
+ram_setup:
 	/* Wait for NEST_ACTIVE to clear */
-	do {
-		thread_read(thread, P9_RAS_STATUS, &value);
-	} while (value & PPC_BIT(32));
+	CHECK_ERR_GOTO(out_fail,
+		thread_wait(thread, P9_RAS_STATUS, PPC_BIT(32), 0, RAM_TIMEOUT, NULL));
 
 	/* Wait for THREAD_ACTION_IN_PROGRESS to clear */
-	do {
-		thread_read(thread, P9_THREAD_INFO, &value);
-	} while (value & PPC_BIT(23));
-
-	/* Activate thread for ramming */
 	CHECK_ERR_GOTO(out_fail,
-		thread_write(thread, P9_THREAD_INFO, PPC_BIT(18 + thread->id)));
+		thread_wait(thread, P9_THREAD_INFO, PPC_BIT(23), 0, RAM_TIMEOUT, NULL));
 
- 	/* Enable ram mode */
-	CHECK_ERR_GOTO(out_fail,
-		thread_write(thread, P9_RAM_MODEREG, PPC_BIT(0)));
+	CHECK_ERR_GOTO(out_fail, p9_ram_mode(thread, true));
 
 	/* Setup SPRC to use SPRD */
 	CHECK_ERR_GOTO(out_fail,
@@ -358,11 +460,9 @@ static int __p9_ram_instruction(struct thread *thread, uint64_t opcode, uint64_t
 	}
 
 out:
-	if ((opcode & OPCODE_MASK) == LD_OPCODE) {
-		while (!(value & PPC_BIT(3))) {
-			CHECK_ERR(thread_read(thread, P9_RAM_STATUS, &value));
-		}
-	}
+	if ((opcode & OPCODE_MASK) == LD_OPCODE && !(value & PPC_BIT(3)))
+		CHECK_ERR(thread_wait(thread, P9_RAM_STATUS, PPC_BIT(3), PPC_BIT(3),
+				      RAM_TIMEOUT, &value));
 
 	if (!rc)
 		CHECK_ERR(thread_read(thread, P9_SCR0_REG, scratch));
@@ -395,11 +495,7 @@ static int p9_ram_destroy(struct thread *thread)
 	if (!thread->ram_is_setup)
 		return 1;
 
-	/* Disable ram mode */
-	CHECK_ERR(thread_write(thread, P9_RAM_MODEREG, 0));
-
-	/* Deactivate thread for ramming */
-	CHECK_ERR(thread_write(thread, P9_THREAD_INFO, 0));
+	CHECK_ERR(p9_ram_mode(thread, false));
 
 	thread->status = p9_get_thread_status(thread);
 
@@ -408,6 +504,62 @@ static int p9_ram_destroy(struct thread *thread)
 	return 0;
 }
 
+/*
+ * Step count instructions recording the NIA after each one. Interrupts
+ * are fenced and the SPRC is set up once for the whole trace so each step
+ * only has to enable RAM mode for as long as it takes to read the NIA.
+ */
+static int p9_thread_step_trace(struct thread *thread, int count, uint64_t *nia)
+{
+	struct core *chip = target_to_core(
+		pdbg_target_require_parent("core", &thread->target));
+	int i, rc = 0;
+
+	if (!p9_thread_can_step(thread))
+		return 1;
+
+	if (chip->ram_session) {
+		PR_ERROR("Unable to step a thread during a RAM session\n");
+		return 1;
+	}
+
+	CHECK_ERR(p9_ram_setup(thread));
+
+	CHECK_ERR_GOTO(out, rc = p9_ram_mode(thread, false));
+
+	/* Fence interrupts. */
+	thread_write(thread, P9_RAS_MODEREG, PPC_BIT(57));
+
+	for (i = 0; i < count; i++) {
+		/* Step */
+		thread_write(thread, P9_DIRECT_CONTROL, PPC_BIT(5 + 8*thread->id));
+
+		/* Poll PPC complete */
+		rc = thread_wait(thread, P9_RAS_STATUS, PPC_BIT(4 + 8*thread->id),
+				 PPC_BIT(4 + 8*thread->id), STEP_TIMEOUT, NULL);
+		if (rc) {
+			PR_ERROR("Timeout waiting for thread %d to step\n", thread->id);
+			break;
+		}
+
+		rc = p9_ram_mode(thread, true);
+		if (!rc)
+			rc = ram_read_nia(thread, &nia[i]);
+		if (p9_ram_mode(thread, false))
+			rc = 1;
+		if (rc)
+			break;
+	}
+
+	/* Un-fence */
+	thread_write(thread, P9_RAS_MODEREG, 0);
+
+out:
+	p9_ram_destroy(thread);
+
+	return rc;
+}
+
 static int p9_ram_getxer(struct pdbg_target *thread, uint64_t *value)
 {
 	CHECK_ERR(thread_getspr(thread, 1, value));
@@ -434,7 +586,9 @@ static struct thread p9_thread = {
 	.start = p9_thread_start,
 	.stop = p9_thread_stop,
 	.step = p9_thread_step,
+	.step_trace = p9_thread_step_trace,
 	.sreset = p9_thread_sreset,
+	.poll_status = p9_thread_poll_status,
 	.ram_setup = p9_ram_setup,
 	.ram_instruction = p9_ram_instruction,
 	.ram_destroy = p9_ram_destroy,
@@ -510,10 +664,9 @@ static int p9_chiplet_getring(struct chiplet *chiplet, uint64_t ring_addr, int64
 	return 0;
 }
 
-static int p9_core_probe(struct pdbg_target *target)
+static int p9_core_spwkup_issue(struct core *core)
 {
-	struct core *core = target_to_core(target);
-	int i = 0;
+	struct pdbg_target *target = &core->target;
 	uint64_t value;
 
 	if (pib_read(target, NET_CTRL0, &value))
@@ -523,16 +676,50 @@ static int p9_core_probe(struct pdbg_target *target)
 		return -1;
 
 	CHECK_ERR(pib_write(target, PPM_SPWKUP_FSP, PPC_BIT(0)));
-	do {
-		usleep(1000);
-		CHECK_ERR(pib_read(target, PPM_SSHFSP, &value));
+	core->spwkup_asserted = true;
+	core->spwkup_pending = true;
 
-		if (i++ > SPECIAL_WKUP_TIMEOUT) {
-			PR_ERROR("Timeout waiting for special wakeup on %s@0x%08" PRIx64 "\n", target->name,
-				 pdbg_target_address(target, NULL));
-			break;
-		}
-	} while (!(value & SPECIAL_WKUP_DONE));
+	return 0;
+}
+
+static int p9_core_spwkup_wait(struct core *core)
+{
+	struct pdbg_target *target = &core->target;
+	int rc;
+
+	if (!core->spwkup_pending)
+		return 0;
+
+	core->spwkup_pending = false;
+
+	if (!core->spwkup_asserted) {
+		/* Other wakeup sources may keep the core awake so a
+		 * timeout here isn't an error */
+		pib_wait_timeout(target, PPM_SSHFSP, SPECIAL_WKUP_DONE, 0,
+				 SPECIAL_WKUP_CLEAR_TIMEOUT, NULL);
+		return 0;
+	}
+
+	rc = pib_wait_timeout(target, PPM_SSHFSP, SPECIAL_WKUP_DONE, SPECIAL_WKUP_DONE,
+			      SPECIAL_WKUP_TIMEOUT, NULL);
+	if (rc == -1) {
+		PR_ERROR("Timeout waiting for special wakeup on %s@0x%08" PRIx64 "\n", target->name,
+			 pdbg_target_address(target, NULL));
+		return 0;
+	}
+
+	return rc;
+}
+
+static int p9_core_probe(struct pdbg_target *target)
+{
+	struct core *core = target_to_core(target);
+
+	/* The wakeup may have already been issued by core_special_wakeup_issue() */
+	if (!core->spwkup_pending)
+		CHECK_ERR(p9_core_spwkup_issue(core));
+
+	CHECK_ERR(p9_core_spwkup_wait(core));
 
 	/* Child threads will set this to false if they are released while quiesced */
 	core->release_spwkup = true;
@@ -566,11 +753,79 @@ static void p9_core_release(struct pdbg_target *target)
 		pdbg_target_release(child);
 	}
 
-	if (!core->release_spwkup)
+	if (!core->release_spwkup || core_special_wakeup_is_sticky())
 		return;
 
+	/* pdbg_target_release() waits for this once all cores have been
+	 * released */
 	pib_write(target, PPM_SPWKUP_FSP, 0);
-	usleep(10000);
+	core->spwkup_asserted = false;
+	core->spwkup_pending = true;
+}
+
+static void p9_ram_unquiesce_siblings(struct core *chip)
+{
+	struct pdbg_target *target;
+
+	pdbg_for_each_target("thread", &chip->target, target) {
+		struct thread *tmp;
+
+		if (pdbg_target_status(target) != PDBG_TARGET_ENABLED)
+			continue;
+
+		tmp = target_to_thread(target);
+		if (!tmp->ram_did_quiesce)
+			continue;
+
+		p9_thread_start(tmp);
+		thread_translate_flush(target);
+
+		tmp->ram_did_quiesce = false;
+	}
+}
+
+static int p9_ram_session_begin(struct core *chip)
+{
+	struct pdbg_target *target;
+
+	if (chip->ram_session++)
+		return 0;
+
+	/* Unlike POWER8 there is no core wide RAM mode to enable, the
+	 * session just keeps the sibling threads quiesced */
+	pdbg_for_each_target("thread", &chip->target, target) {
+		struct thread *tmp;
+
+		if (pdbg_target_probe(target) != PDBG_TARGET_ENABLED)
+			continue;
+
+		tmp = target_to_thread(target);
+		if (tmp->status.quiesced)
+			continue;
+
+		p9_thread_stop(tmp);
+		if (!tmp->status.quiesced) {
+			p9_ram_unquiesce_siblings(chip);
+			chip->ram_session = 0;
+			return 1;
+		}
+		tmp->ram_did_quiesce = true;
+	}
+
+	return 0;
+}
+
+static int p9_ram_session_end(struct core *chip)
+{
+	if (!chip->ram_session)
+		return 1;
+
+	if (--chip->ram_session)
+		return 0;
+
+	p9_ram_unquiesce_siblings(chip);
+
+	return 0;
 }
 
 static struct core p9_core = {
@@ -581,6 +836,11 @@ static struct core p9_core = {
 		.probe = p9_core_probe,
 		.release = p9_core_release,
 	},
+	.spwkup_issue = p9_core_spwkup_issue,
+	.spwkup_wait = p9_core_spwkup_wait,
+	.thread_status_fetch = p9_core_thread_status_fetch,
+	.ram_session_begin = p9_ram_session_begin,
+	.ram_session_end = p9_ram_session_end,
 };
 DECLARE_HW_UNIT(p9_core);
 
@@ -0,0 +1,245 @@
+/* Copyright 2019 IBM Corp.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * 	http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or
+ * implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#define _GNU_SOURCE
+#include <errno.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#include "target.h"
+#include "debug.h"
+
+/*
+ * The probe cache records the targets which were found not to exist so
+ * later runs don't have to wait for them to fail probing again. It only
+ * applies to the device tree and hardware it was written for, identified
+ * by a hash of the fdt, the backend and its option (which selects the
+ * FSI link) and the chip ID of the master processor. It is plain text,
+ * one "key value" pair per line:
+ *
+ *   dtb 0123456789abcdef
+ *   backend 1
+ *   option p9w
+ *   chip c0d1049
+ *   nonexistent /fsi@20000/hmfsi@100000
+ *
+ * Only missing fsi targets (ie. hMFSI ports with nothing attached) are
+ * recorded, as only their presence is fixed by the wiring. Whether a pib
+ * or chiplet probes depends on power and IPL state which the key doesn't
+ * capture, and a core or thread can fail to probe for reasons which don't
+ * outlive the run (eg. special wakeup timing out), so those are always
+ * probed again. Targets which exist are still probed as probing is what
+ * makes them ready to use.
+ *
+ * A cache can hide chips from later runs so one we don't own, or which
+ * others could have written to, is ignored.
+ */
+#define PROBE_CACHE_PATH_MAX	256
+
+struct probe_cache_key {
+	uint64_t dtb;
+	int backend;
+	char option[PROBE_CACHE_PATH_MAX];
+	uint32_t chip;
+};
+
+/* Returns 0 if the hardware could be identified */
+static int probe_cache_key_init(struct probe_cache_key *key)
+{
+	const char *option = pdbg_get_backend_option();
+	struct pdbg_target *fsi;
+
+	memset(key, 0, sizeof(*key));
+	key->dtb = dt_fdt_hash();
+	key->backend = pdbg_get_backend();
+	snprintf(key->option, sizeof(key->option), "%s", option ? option : "-");
+
+	/* The master processor is the first one with its own fsi */
+	pdbg_for_each_class_target("fsi", fsi) {
+		if (fsi->parent_fsi)
+			continue;
+
+		if (pdbg_target_probe(fsi) != PDBG_TARGET_ENABLED)
+			return -1;
+
+		return fsi_read(fsi, 0xc09, &key->chip);
+	}
+
+	return 0;
+}
+
+static bool probe_cache_key_equal(const struct probe_cache_key *a,
+				  const struct probe_cache_key *b)
+{
+	return a->dtb == b->dtb && a->backend == b->backend &&
+		!strcmp(a->option, b->option) && a->chip == b->chip;
+}
+
+static FILE *probe_cache_open(const char *path)
+{
+	struct stat st;
+	FILE *f;
+	int fd;
+
+	fd = open(path, O_RDONLY | O_NOFOLLOW);
+	if (fd < 0)
+		return NULL;
+
+	if (fstat(fd, &st) || !S_ISREG(st.st_mode) ||
+	    st.st_uid != geteuid() || (st.st_mode & (S_IWGRP | S_IWOTH))) {
+		PR_ERROR("Ignoring probe cache %s, it is not private to this user\n", path);
+		close(fd);
+		return NULL;
+	}
+
+	f = fdopen(fd, "r");
+	if (!f)
+		close(fd);
+
+	return f;
+}
+
+int pdbg_probe_cache_load(const char *path)
+{
+	struct probe_cache_key key, cached;
+	struct pdbg_target *target;
+	char name[16], value[PROBE_CACHE_PATH_MAX];
+	char **paths = NULL, **tmp;
+	int i, count = 0, rc = -1;
+	FILE *f;
+
+	f = probe_cache_open(path);
+	if (!f)
+		return -1;
+
+	memset(&cached, 0, sizeof(cached));
+	while (fscanf(f, "%15s %255s", name, value) == 2) {
+		if (!strcmp(name, "dtb"))
+			cached.dtb = strtoull(value, NULL, 16);
+		else if (!strcmp(name, "backend"))
+			cached.backend = atoi(value);
+		else if (!strcmp(name, "option"))
+			strcpy(cached.option, value);
+		else if (!strcmp(name, "chip"))
+			cached.chip = strtoul(value, NULL, 16);
+		else if (!strcmp(name, "nonexistent")) {
+			tmp = realloc(paths, (count + 1) * sizeof(*tmp));
+			if (!tmp)
+				goto out;
+
+			paths = tmp;
+			paths[count] = strdup(value);
+			if (!paths[count])
+				goto out;
+			count++;
+		}
+	}
+
+	if (probe_cache_key_init(&key) || !probe_cache_key_equal(&key, &cached)) {
+		PR_INFO("Probe cache %s is out of date, ignoring it\n", path);
+		goto out;
+	}
+
+	for (i = 0; i < count; i++) {
+		target = pdbg_target_from_path(NULL, paths[i]);
+		if (!target || !pdbg_target_is_class(target, "fsi") ||
+		    pdbg_target_status(target) != PDBG_TARGET_UNKNOWN)
+			continue;
+
+		PR_DEBUG("Probe cache: %s does not exist\n", paths[i]);
+		target->status = PDBG_TARGET_NONEXISTENT;
+	}
+
+	rc = 0;
+
+out:
+	for (i = 0; i < count; i++)
+		free(paths[i]);
+	free(paths);
+	fclose(f);
+	return rc;
+}
+
+/* Children of a target which doesn't exist are known not to exist
+ * without being recorded */
+static void probe_cache_save_target(FILE *f, struct pdbg_target *target)
+{
+	struct pdbg_target *child;
+
+	if (pdbg_target_status(target) == PDBG_TARGET_NONEXISTENT) {
+		if (pdbg_target_is_class(target, "fsi"))
+			fprintf(f, "nonexistent %s\n", pdbg_target_path_const(target));
+		return;
+	}
+
+	/* Children which were never created can't have been probed */
+	list_for_each(&target->children, child, list)
+		probe_cache_save_target(f, child);
+}
+
+int pdbg_probe_cache_save(const char *path)
+{
+	struct probe_cache_key key;
+	char *tmp;
+	FILE *f;
+	int fd, rc;
+
+	if (probe_cache_key_init(&key))
+		return -1;
+
+	if (asprintf(&tmp, "%s.XXXXXX", path) < 0)
+		return -1;
+
+	/* mkstemp() won't follow a link someone else left in our way */
+	fd = mkstemp(tmp);
+	if (fd < 0) {
+		PR_ERROR("Unable to write %s: %s\n", path, strerror(errno));
+		free(tmp);
+		return -1;
+	}
+
+	f = fdopen(fd, "w");
+	if (!f) {
+		close(fd);
+		unlink(tmp);
+		free(tmp);
+		return -1;
+	}
+
+	fprintf(f, "dtb %016" PRIx64 "\n", key.dtb);
+	fprintf(f, "backend %d\n", key.backend);
+	fprintf(f, "option %s\n", key.option);
+	fprintf(f, "chip %" PRIx32 "\n", key.chip);
+	probe_cache_save_target(f, pdbg_target_root());
+
+	rc = ferror(f);
+	if (fclose(f) || rc) {
+		unlink(tmp);
+		free(tmp);
+		return -1;
+	}
+
+	/* Replace the old cache atomically so a concurrent run never
+	 * sees a partially written file */
+	rc = rename(tmp, path);
+	free(tmp);
+
+	return rc;
+}
@@ -3,6 +3,9 @@
 #include <stdint.h>
 #include <inttypes.h>
 #include <assert.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
 #include <ccan/list/list.h>
 #include <libfdt/libfdt.h>
 
@@ -14,6 +17,8 @@
 struct list_head empty_list = LIST_HEAD_INIT(empty_list);
 struct list_head target_classes = LIST_HEAD_INIT(target_classes);
 
+static bool parallel_probe;
+
 /* Work out the address to access based on the current target and
  * final class name */
 static struct pdbg_target *get_class_target_addr(struct pdbg_target *target, const char *name, uint64_t *addr)
@@ -167,26 +172,125 @@ int pib_write_mask(struct pdbg_target *pib_dt, uint64_t addr, uint64_t data, uin
 	return pib_write(pib_dt, addr, value);
 }
 
-/* Wait for a SCOM register addr to match value & mask == data */
-int pib_wait(struct pdbg_target *pib_dt, uint64_t addr, uint64_t mask, uint64_t data)
+/*
+ * Most status bits are already set by the time the first read returns so
+ * spin for a few reads, then back off exponentially between reads so a
+ * slow wait doesn't flood the bus.
+ */
+#define PIB_WAIT_SPIN		8
+#define PIB_WAIT_MAX_DELAY	1000 /* 1ms */
+
+static struct pib_wait_stats wait_stats;
+
+static uint64_t pib_wait_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+static void pib_wait_account(uint64_t polls, uint64_t sleeps, uint64_t elapsed, bool timeout)
+{
+	uint64_t max = __atomic_load_n(&wait_stats.max_us, __ATOMIC_RELAXED);
+
+	__atomic_add_fetch(&wait_stats.waits, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&wait_stats.polls, polls, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&wait_stats.sleeps, sleeps, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&wait_stats.total_us, elapsed, __ATOMIC_RELAXED);
+	if (timeout)
+		__atomic_add_fetch(&wait_stats.timeouts, 1, __ATOMIC_RELAXED);
+
+	while (elapsed > max &&
+	       !__atomic_compare_exchange_n(&wait_stats.max_us, &max, elapsed, false,
+					    __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+/* Poll a SCOM register until cond() returns true for its value or
+ * timeout microseconds have passed. A timeout of zero waits forever.
+ * Returns -1 on timeout, otherwise the result of the last read. The
+ * last value read is returned in *value if it isn't NULL. */
+int pib_wait_cond(struct pdbg_target *pib_dt, uint64_t addr,
+		  bool (*cond)(uint64_t value, void *priv), void *priv,
+		  uint64_t timeout, uint64_t *value)
 {
 	struct pib *pib;
-	uint64_t tmp;
+	uint64_t tmp = 0, start, elapsed, delay = 1, polls = 0, sleeps = 0;
 	int rc;
 
 	pib_dt = get_class_target_addr(pib_dt, "pib", &addr);
 	pib = target_to_pib(pib_dt);
 
-	do {
+	start = pib_wait_now();
+	for (;;) {
 		if (addr & PPC_BIT(0))
 			rc = pib_indirect_read(pib, addr, &tmp);
 		else
 			rc = pib->read(pib, addr, &tmp);
-		if (rc)
-			return rc;
-	} while ((tmp & mask) != data);
+		polls++;
 
-	return 0;
+		elapsed = pib_wait_now() - start;
+		if (rc || cond(tmp, priv))
+			break;
+
+		if (timeout && elapsed >= timeout) {
+			PR_DEBUG("Timeout waiting on addr:0x%08" PRIx64 " data:0x%016" PRIx64 "\n",
+				 addr, tmp);
+			rc = -1;
+			break;
+		}
+
+		if (polls < PIB_WAIT_SPIN)
+			continue;
+
+		usleep(delay);
+		sleeps++;
+		delay = delay*2 > PIB_WAIT_MAX_DELAY ? PIB_WAIT_MAX_DELAY : delay*2;
+	}
+
+	pib_wait_account(polls, sleeps, elapsed, rc == -1);
+
+	if (value)
+		*value = tmp;
+
+	return rc;
+}
+
+struct pib_wait_mask {
+	uint64_t mask;
+	uint64_t data;
+};
+
+static bool pib_wait_mask_cond(uint64_t value, void *priv)
+{
+	struct pib_wait_mask *m = priv;
+
+	return (value & m->mask) == m->data;
+}
+
+/* Wait for a SCOM register addr to match value & mask == data */
+int pib_wait_timeout(struct pdbg_target *pib_dt, uint64_t addr, uint64_t mask,
+		     uint64_t data, uint64_t timeout, uint64_t *value)
+{
+	struct pib_wait_mask m = { .mask = mask, .data = data };
+
+	return pib_wait_cond(pib_dt, addr, pib_wait_mask_cond, &m, timeout, value);
+}
+
+int pib_wait(struct pdbg_target *pib_dt, uint64_t addr, uint64_t mask, uint64_t data)
+{
+	return pib_wait_timeout(pib_dt, addr, mask, data, 0, NULL);
+}
+
+void pib_wait_get_stats(struct pib_wait_stats *stats)
+{
+	stats->waits = __atomic_load_n(&wait_stats.waits, __ATOMIC_RELAXED);
+	stats->polls = __atomic_load_n(&wait_stats.polls, __ATOMIC_RELAXED);
+	stats->sleeps = __atomic_load_n(&wait_stats.sleeps, __ATOMIC_RELAXED);
+	stats->timeouts = __atomic_load_n(&wait_stats.timeouts, __ATOMIC_RELAXED);
+	stats->total_us = __atomic_load_n(&wait_stats.total_us, __ATOMIC_RELAXED);
+	stats->max_us = __atomic_load_n(&wait_stats.max_us, __ATOMIC_RELAXED);
 }
 
 int opb_read(struct pdbg_target *opb_dt, uint32_t addr, uint32_t *data)
@@ -357,11 +461,75 @@ struct pdbg_target_class *get_target_class(struct pdbg_target *target)
 	target_class = calloc(1, sizeof(*target_class));
 	assert(target_class);
 	target_class->name = strdup(target->class);
-	list_head_init(&target_class->targets);
 	list_add_tail(&target_classes, &target_class->class_head_link);
 	return target_class;
 }
 
+/* Adds a target to an array in device tree order and returns its
+ * position. Targets are normally created in that order so this rarely
+ * has to move any others. */
+int target_array_insert(struct target_array *array, struct pdbg_target *target)
+{
+	int i;
+
+	if (array->count == array->alloc) {
+		array->alloc = array->alloc ? array->alloc * 2 : 16;
+		array->targets = realloc(array->targets,
+					 array->alloc * sizeof(*array->targets));
+		assert(array->targets);
+	}
+
+	for (i = array->count; i > 0; i--)
+		if (array->targets[i - 1]->fdt_offset < target->fdt_offset)
+			break;
+
+	memmove(&array->targets[i + 1], &array->targets[i],
+		(array->count - i) * sizeof(*array->targets));
+	array->targets[i] = target;
+	array->count++;
+
+	return i;
+}
+
+void target_array_remove(struct target_array *array, struct pdbg_target *target)
+{
+	int i = target_array_lower_bound(array, target->fdt_offset);
+
+	if (i == array->count || array->targets[i] != target)
+		return;
+
+	array->count--;
+	memmove(&array->targets[i], &array->targets[i + 1],
+		(array->count - i) * sizeof(*array->targets));
+}
+
+/* Returns the position of the first target at or after the given fdt
+ * offset */
+int target_array_lower_bound(const struct target_array *array, int fdt_offset)
+{
+	int lo = 0, hi = array->count, mid;
+
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (array->targets[mid]->fdt_offset < fdt_offset)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return lo;
+}
+
+void target_class_add(struct pdbg_target_class *target_class, struct pdbg_target *target)
+{
+	int i;
+
+	i = target_array_insert(&target_class->targets, target);
+	target->target_class = target_class;
+	for (; i < target_class->targets.count; i++)
+		target_class->targets.targets[i]->class_index = i;
+}
+
 /* We walk the tree root down disabling targets which might/should
  * exist but don't */
 enum pdbg_target_status pdbg_target_probe(struct pdbg_target *target)
@@ -425,15 +593,16 @@ enum pdbg_target_status pdbg_target_probe(struct pdbg_target *target)
 }
 
 /* Releases a target by first recursively releasing all its children */
-void pdbg_target_release(struct pdbg_target *target)
+static void __pdbg_target_release(struct pdbg_target *target)
 {
 	struct pdbg_target *child;
 
 	if (pdbg_target_status(target) != PDBG_TARGET_ENABLED)
 		return;
 
-	pdbg_for_each_child_target(target, child)
-		pdbg_target_release(child);
+	/* Children which were never created can't have been probed */
+	list_for_each(&target->children, child, list)
+		__pdbg_target_release(child);
 
 	/* Release the target */
 	if (target->release)
@@ -441,16 +610,308 @@ void pdbg_target_release(struct pdbg_target *target)
 	target->status = PDBG_TARGET_RELEASED;
 }
 
+void pdbg_target_release(struct pdbg_target *target)
+{
+	struct pdbg_target *core;
+
+	if (pdbg_target_status(target) != PDBG_TARGET_ENABLED)
+		return;
+
+	/* Release all the cores first so their special wakeups are all
+	 * dropped before waiting on any of them */
+	pdbg_for_each_expanded_target("core", target, core)
+		__pdbg_target_release(core);
+
+	pdbg_for_each_expanded_target("core", target, core) {
+		struct core *tmp = target_to_core(core);
+
+		if (tmp->spwkup_wait)
+			tmp->spwkup_wait(tmp);
+	}
+
+	__pdbg_target_release(target);
+}
+
+void pdbg_set_parallel_probe(bool parallel)
+{
+	parallel_probe = parallel;
+}
+
+/*
+ * Targets are probed in parallel in units, one for each fsi (including
+ * hMFSI ports) or pib, as these are where the backends allow concurrent
+ * access. A unit probes its own fsi or pib and the targets under it which
+ * aren't under a nested one. It is started as soon as the unit enclosing
+ * it is done, which also probes the targets between the two, so probing
+ * only ever recurses up into its own unit or into finished ones.
+ */
+struct probe_unit {
+	pthread_t tid;
+	struct probe_units *units;
+	struct pdbg_target *head;
+	struct probe_unit *parent;
+	bool done;
+	struct pdbg_target **targets;
+	int count;
+};
+
+struct probe_units {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct probe_unit *units;
+	int count;
+	int alloc;
+};
+
+static bool probe_unit_head(struct pdbg_target *target)
+{
+	return pdbg_target_is_class(target, "fsi") ||
+		pdbg_target_is_class(target, "pib");
+}
+
+static struct pdbg_target *probe_unit_find_head(struct pdbg_target *target)
+{
+	for (; target; target = target->parent)
+		if (probe_unit_head(target))
+			return target;
+
+	return NULL;
+}
+
+static int probe_unit_add(struct probe_unit *unit, struct pdbg_target *target)
+{
+	struct pdbg_target **tmp;
+
+	tmp = realloc(unit->targets, (unit->count + 1) * sizeof(*tmp));
+	if (!tmp)
+		return -1;
+
+	unit->targets = tmp;
+	unit->targets[unit->count++] = target;
+
+	return 0;
+}
+
+/* Returns the unit for head, creating it and the units enclosing it if
+ * needed. Enclosing units always come first in the list. */
+static struct probe_unit *probe_unit_get(struct probe_units *u,
+					 struct pdbg_target *head)
+{
+	struct probe_unit *parent = NULL, *unit;
+	struct pdbg_target *parent_head;
+	int i;
+
+	for (i = 0; i < u->count; i++)
+		if (u->units[i].head == head)
+			return &u->units[i];
+
+	parent_head = probe_unit_find_head(head->parent);
+	if (parent_head) {
+		parent = probe_unit_get(u, parent_head);
+		if (!parent || probe_unit_add(parent, head->parent))
+			return NULL;
+	}
+
+	/* The list is sized for every head so units never move */
+	assert(u->count < u->alloc);
+	unit = &u->units[u->count++];
+	unit->units = u;
+	unit->head = head;
+	unit->parent = parent;
+
+	return unit;
+}
+
+static void probe_units_free(struct probe_units *u)
+{
+	int i;
+
+	for (i = 0; i < u->count; i++)
+		free(u->units[i].targets);
+	free(u->units);
+}
+
+/* Returns 0 if the units could be allocated */
+static int probe_units_init(struct probe_units *u,
+			    struct pdbg_target **targets, int count)
+{
+	struct pdbg_target *target, *head;
+	struct probe_unit *unit;
+	int i;
+
+	memset(u, 0, sizeof(*u));
+	pthread_mutex_init(&u->lock, NULL);
+	pthread_cond_init(&u->cond, NULL);
+
+	pdbg_for_each_class_target("fsi", target)
+		u->alloc++;
+	pdbg_for_each_class_target("pib", target)
+		u->alloc++;
+
+	u->units = calloc(u->alloc, sizeof(*u->units));
+	if (!u->units)
+		return -1;
+
+	for (i = 0; i < count; i++) {
+		head = probe_unit_find_head(targets[i]);
+		if (!head)
+			continue;
+
+		unit = probe_unit_get(u, head);
+		if (!unit || probe_unit_add(unit, targets[i])) {
+			probe_units_free(u);
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+/* Issue special wakeups to the cores of the targets so probing them
+ * waits for the wakeups together rather than one at a time */
+static void probe_wakeup_issue(struct pdbg_target **targets, int count)
+{
+	struct pdbg_target *core;
+	int i;
+
+	for (i = 0; i < count; i++) {
+		core = pdbg_target_is_class(targets[i], "core") ?
+			targets[i] : targets[i]->parent_core;
+		if (core)
+			core_special_wakeup_issue(core);
+	}
+}
+
+static void *probe_unit_run(void *arg)
+{
+	struct probe_unit *unit = arg;
+	struct probe_units *u = unit->units;
+	int i;
+
+	/* Wait for the unit enclosing this one */
+	pthread_mutex_lock(&u->lock);
+	while (unit->parent && !unit->parent->done)
+		pthread_cond_wait(&u->cond, &u->lock);
+	pthread_mutex_unlock(&u->lock);
+
+	/* The wakeups can only be issued once the chip is known to exist */
+	if (pdbg_target_probe(unit->head) == PDBG_TARGET_ENABLED)
+		probe_wakeup_issue(unit->targets, unit->count);
+
+	for (i = 0; i < unit->count; i++)
+		pdbg_target_probe(unit->targets[i]);
+
+	pthread_mutex_lock(&u->lock);
+	unit->done = true;
+	pthread_cond_broadcast(&u->cond);
+	pthread_mutex_unlock(&u->lock);
+
+	return NULL;
+}
+
+/*
+ * Probe a list of targets. If parallel probing is enabled and the
+ * backend allows it targets on different chips are probed concurrently,
+ * otherwise they are probed in order. Either way each target is only
+ * probed after its parents, and special wakeups are issued to all the
+ * cores on a chip before waiting for any of them.
+ */
+void pdbg_targets_probe(struct pdbg_target **targets, int count)
+{
+	struct probe_units u;
+	int i, started;
+
+	if (!parallel_probe || !pdbg_backend_is_threadsafe() || count < 2) {
+		probe_wakeup_issue(targets, count);
+		for (i = 0; i < count; i++)
+			pdbg_target_probe(targets[i]);
+		return;
+	}
+
+	/* Probes may look at other targets so the tree must not be
+	 * expanded while the units are running */
+	dt_expand_tree(pdbg_target_root());
+
+	if (probe_units_init(&u, targets, count)) {
+		probe_wakeup_issue(targets, count);
+		for (i = 0; i < count; i++)
+			pdbg_target_probe(targets[i]);
+		return;
+	}
+
+	/* Targets outside any unit, and the ancestors shared by the
+	 * outermost units, don't need to wait for one */
+	for (i = 0; i < count; i++)
+		if (!probe_unit_find_head(targets[i]))
+			pdbg_target_probe(targets[i]);
+
+	for (i = 0; i < u.count; i++)
+		if (!u.units[i].parent && u.units[i].head->parent)
+			pdbg_target_probe(u.units[i].head->parent);
+
+	/* Every unit is started at once and waits for its enclosing unit.
+	 * Those come first, so any left to run here never wait on one
+	 * which hasn't been started. */
+	for (started = 0; started < u.count; started++) {
+		if (pthread_create(&u.units[started].tid, NULL, probe_unit_run,
+				   &u.units[started])) {
+			PR_ERROR("Unable to create thread, probing remaining targets serially\n");
+			break;
+		}
+	}
+
+	for (i = started; i < u.count; i++)
+		probe_unit_run(&u.units[i]);
+
+	for (i = 0; i < started; i++)
+		pthread_join(u.units[i].tid, NULL);
+
+	pthread_cond_destroy(&u.cond);
+	pthread_mutex_destroy(&u.lock);
+	probe_units_free(&u);
+}
+
+static int probe_all_collect(struct pdbg_target *parent,
+			     struct pdbg_target ***targets, int *count, int *alloc)
+{
+	struct pdbg_target *child, **tmp;
+
+	pdbg_for_each_child_target(parent, child) {
+		if (probe_all_collect(child, targets, count, alloc))
+			return -1;
+
+		if (*count == *alloc) {
+			*alloc = *alloc ? *alloc * 2 : 64;
+			tmp = realloc(*targets, *alloc * sizeof(*tmp));
+			if (!tmp)
+				return -1;
+			*targets = tmp;
+		}
+		(*targets)[(*count)++] = child;
+	}
+
+	return 0;
+}
+
 /*
  * Probe all targets in the device tree.
  */
 void pdbg_target_probe_all(struct pdbg_target *parent)
 {
-	struct pdbg_target *child;
+	struct pdbg_target *child, **targets = NULL;
+	int count = 0, alloc = 0;
 
 	if (!parent)
 		parent = pdbg_target_root();
 
+	if (parallel_probe && pdbg_backend_is_threadsafe() &&
+	    !probe_all_collect(parent, &targets, &count, &alloc)) {
+		pdbg_targets_probe(targets, count);
+		free(targets);
+		return;
+	}
+	free(targets);
+
 	pdbg_for_each_child_target(parent, child) {
 		pdbg_target_probe_all(child);
 		pdbg_target_probe(child);
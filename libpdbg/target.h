@@ -26,12 +26,22 @@
 
 enum chip_type {CHIP_UNKNOWN, CHIP_P8, CHIP_P8NV, CHIP_P9};
 
+/* A set of targets kept in device tree order */
+struct target_array {
+	struct pdbg_target **targets;
+	int count;
+	int alloc;
+};
+
 struct pdbg_target_class {
 	char *name;
-	struct list_head targets;
+	struct target_array targets;
 	struct list_node class_head_link;
 };
 
+struct dt_prop_index;
+struct dt_child_index;
+
 struct pdbg_target {
 	char *name;
 	char *compatible;
@@ -44,11 +54,27 @@ struct pdbg_target {
 	const char *dn_name;
 	struct list_node list;
 	struct list_head properties;
+	struct dt_prop_index *prop_index;
 	struct list_head children;
+	struct dt_child_index *child_index;
 	struct pdbg_target *parent;
+	/* Worked out once the target is placed in the tree */
+	const char *path;
+	struct pdbg_target *parent_fsi;
+	struct pdbg_target *parent_pib;
+	struct pdbg_target *parent_core;
 	u32 phandle;
+	/* Descendants have fdt offsets in [fdt_offset, fdt_end) */
+	int fdt_offset;
+	int fdt_end;
+	bool expanded;
+	bool subtree_expanded;
 	bool probed;
-	struct list_node class_link;
+	struct pdbg_target_class *target_class;
+	int class_index;
+	/* Bitset of the ids of the target's compatible strings */
+	uint64_t *compat_set;
+	int compat_words;
 	void *priv;
 };
 
@@ -56,11 +82,36 @@ struct pdbg_target *require_target_parent(struct pdbg_target *target);
 struct pdbg_target_class *find_target_class(const char *name);
 struct pdbg_target_class *require_target_class(const char *name);
 struct pdbg_target_class *get_target_class(struct pdbg_target *target);
+void target_class_add(struct pdbg_target_class *target_class, struct pdbg_target *target);
+
+int target_array_insert(struct target_array *array, struct pdbg_target *target);
+void target_array_remove(struct target_array *array, struct pdbg_target *target);
+int target_array_lower_bound(const struct target_array *array, int fdt_offset);
 bool pdbg_target_is_class(struct pdbg_target *target, const char *class);
 
+/* Targets are created from the device tree as they are first needed.
+ * These make sure the children, or all descendants, of a target exist. */
+void dt_expand_children(struct pdbg_target *target);
+void dt_expand_tree(struct pdbg_target *target);
+
+/* Returns a hash of the fdt the targets were created from */
+uint64_t dt_fdt_hash(void);
+
+/* Returns the whole cells of a property in native endian */
+const u32 *dt_property_cells(struct pdbg_target *target, const char *name, size_t *size);
+
+/* As pdbg_for_each_target() but only visits targets which have already
+ * been created, so it never expands any more of the device tree */
+struct pdbg_target *__pdbg_next_expanded_target(const char *class, struct pdbg_target *parent, struct pdbg_target *last);
+#define pdbg_for_each_expanded_target(class, parent, target)		\
+	for (target = __pdbg_next_expanded_target(class, parent, NULL);	\
+	     target;							\
+	     target = __pdbg_next_expanded_target(class, parent, target))
+
 extern struct list_head empty_list;
 extern struct list_head target_classes;
 
+enum pdbg_backend pdbg_get_backend(void);
 const char *pdbg_get_backend_option(void);
 
 struct sbefifo *pib_to_sbefifo(struct pdbg_target *target);
@@ -0,0 +1,496 @@
+/* Copyright 2019 IBM Corp.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * 	http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or
+ * implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Software address translation for stopped threads.
+ *
+ * The translation registers are RAMed out of the thread once and the
+ * page tables are then walked with ordinary physical memory reads, so
+ * virtual memory can be accessed through the ADU/SBE at bulk speed.
+ * Table entries are cached by real address and completed translations
+ * are cached by page. Both caches are dropped whenever the thread may
+ * have run or had its translation registers changed.
+ */
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdlib.h>
+#include <inttypes.h>
+#include <assert.h>
+#include <endian.h>
+#include <ccan/array_size/array_size.h>
+
+#include "hwunit.h"
+#include "operations.h"
+#include "bitutils.h"
+#include "debug.h"
+#include "chip.h"
+
+#define SPR_SDR1	25
+#define SPR_PIDR	48
+#define SPR_HRMOR	313
+#define SPR_LPCR	318
+#define SPR_LPIDR	319
+#define SPR_PTCR	464
+
+#define MSR_HV		PPC_BIT(3)
+#define MSR_PR		PPC_BIT(49)
+#define MSR_DR		PPC_BIT(59)
+
+#define LPCR_HR		PPC_BIT(43)
+
+/* Partition table control register */
+#define PTCR_PATB	PPC_BITMASK(4, 51)
+#define PTCR_PATS	PPC_BITMASK(59, 63)
+
+/* Partition/process table entries and radix page directory entries */
+#define PATE0_HR	PPC_BIT(0)
+#define RADIX_RTS1	PPC_BITMASK(1, 2)
+#define RADIX_RPDB	PPC_BITMASK(4, 55)
+#define RADIX_RTS2	PPC_BITMASK(56, 58)
+#define RADIX_RPDS	PPC_BITMASK(59, 63)
+#define PATE0_HTABORG	PPC_BITMASK(4, 45)
+#define PATE0_HTABSIZE	PPC_BITMASK(59, 63)
+#define PATE1_PRTB	PPC_BITMASK(4, 51)
+#define PATE1_PRTS	PPC_BITMASK(59, 63)
+#define RADIX_V		PPC_BIT(0)
+#define RADIX_L		PPC_BIT(1)
+#define RADIX_NLB	PPC_BITMASK(4, 55)
+#define RADIX_NLS	PPC_BITMASK(59, 63)
+#define RADIX_RPN	PPC_BITMASK(7, 51)
+#define RADIX_MAX_LEVELS 8
+
+/* POWER8 hashed page table */
+#define SDR1_HTABORG	PPC_BITMASK(0, 45)
+#define SDR1_HTABSIZE	PPC_BITMASK(59, 63)
+#define SLB_ESID_V	PPC_BIT(36)
+#define SLB_ESID_256M	PPC_BITMASK(0, 35)
+#define SLB_ESID_1T	PPC_BITMASK(0, 23)
+#define SLB_VSID_B	PPC_BITMASK(0, 1)
+#define SLB_VSID_VSID	PPC_BITMASK(2, 51)
+#define SLB_VSID_L	PPC_BIT(55)
+#define SLB_VSID_LP	PPC_BITMASK(58, 59)
+#define SLB_ENTRIES	32
+#define HPTE_V_B	PPC_BITMASK(0, 1)
+#define HPTE_V_AVPN	PPC_BITMASK(2, 56)
+#define HPTE_V_LARGE	PPC_BIT(61)
+#define HPTE_V_SECONDARY PPC_BIT(62)
+#define HPTE_V_VALID	PPC_BIT(63)
+#define HPTE_R_RPN	PPC_BITMASK(4, 51)
+#define HPTES_PER_GROUP	8
+
+#define SLBMFEE_OPCODE	0x7c000726UL
+#define SLBMFEV_OPCODE	0x7c0006a6UL
+
+/* Size of the memory reads used to fill the table entry cache */
+#define XLATE_LINE_SIZE	64
+#define XLATE_PWC_SIZE	256
+#define XLATE_TLB_SIZE	64
+
+struct xlate_entry {
+	uint64_t tag;
+	uint64_t val;
+};
+
+struct thread_xlate {
+	bool valid;
+	bool radix;
+	uint64_t msr;
+	uint64_t lpidr;
+	uint64_t pidr;
+	uint64_t ptcr;
+	uint64_t hrmor;
+	bool htab_valid;
+	uint64_t htab;
+	uint64_t htabsize;
+	struct {
+		uint64_t esid;
+		uint64_t vsid;
+	} slb[SLB_ENTRIES];
+
+	/* Page table entries indexed by their real address */
+	struct xlate_entry pwc[XLATE_PWC_SIZE];
+
+	/* Completed translations indexed by 4K effective page */
+	struct xlate_entry tlb[XLATE_TLB_SIZE];
+	uint64_t hits, misses;
+};
+
+static uint64_t slbmfee(uint64_t rt, uint64_t rb)
+{
+	return SLBMFEE_OPCODE | (rt << 21) | (rb << 11);
+}
+
+static uint64_t slbmfev(uint64_t rt, uint64_t rb)
+{
+	return SLBMFEV_OPCODE | (rt << 21) | (rb << 11);
+}
+
+static int xlate_read_slb(struct thread *thread, struct thread_xlate *x)
+{
+	uint64_t opcodes[5*SLB_ENTRIES], results[5*SLB_ENTRIES];
+	int i;
+
+	for (i = 0; i < SLB_ENTRIES; i++) {
+		opcodes[5*i] = mfspr(1, 277);
+		results[5*i] = i;
+		opcodes[5*i + 1] = slbmfee(0, 1);
+		results[5*i + 1] = 0;
+		opcodes[5*i + 2] = mtspr(277, 0);
+		results[5*i + 2] = 0;
+		opcodes[5*i + 3] = slbmfev(0, 1);
+		results[5*i + 3] = 0;
+		opcodes[5*i + 4] = mtspr(277, 0);
+		results[5*i + 4] = 0;
+	}
+
+	CHECK_ERR(ram_instructions(&thread->target, opcodes, results, ARRAY_SIZE(opcodes), 0));
+
+	for (i = 0; i < SLB_ENTRIES; i++) {
+		x->slb[i].esid = results[5*i + 2];
+		x->slb[i].vsid = results[5*i + 4];
+	}
+
+	return 0;
+}
+
+/* Read the translation registers from the thread */
+static int xlate_setup(struct thread *thread, struct thread_xlate *x)
+{
+	struct pdbg_target *target = &thread->target;
+	uint64_t lpcr, sdr1;
+	bool did_setup = false;
+	int rc = 0;
+
+	if (!thread->ram_is_setup) {
+		CHECK_ERR(thread->ram_setup(thread));
+		did_setup = true;
+	}
+
+	CHECK_ERR_GOTO(out, rc = thread_getmsr(target, &x->msr));
+	if (!(x->msr & MSR_DR)) {
+		if (x->msr & MSR_HV)
+			CHECK_ERR_GOTO(out, rc = thread_getspr(target, SPR_HRMOR, &x->hrmor));
+		goto out;
+	}
+
+	if (pdbg_target_compatible(target, "ibm,power8-thread")) {
+		CHECK_ERR_GOTO(out, rc = thread_getspr(target, SPR_SDR1, &sdr1));
+		x->radix = false;
+		x->htab = sdr1 & SDR1_HTABORG;
+		x->htabsize = GETFIELD(SDR1_HTABSIZE, sdr1);
+		x->htab_valid = true;
+		CHECK_ERR_GOTO(out, rc = xlate_read_slb(thread, x));
+		goto out;
+	}
+
+	CHECK_ERR_GOTO(out, rc = thread_getspr(target, SPR_LPCR, &lpcr));
+	CHECK_ERR_GOTO(out, rc = thread_getspr(target, SPR_PTCR, &x->ptcr));
+	CHECK_ERR_GOTO(out, rc = thread_getspr(target, SPR_LPIDR, &x->lpidr));
+	CHECK_ERR_GOTO(out, rc = thread_getspr(target, SPR_PIDR, &x->pidr));
+	x->radix = !!(lpcr & LPCR_HR);
+	if (!x->radix)
+		CHECK_ERR_GOTO(out, rc = xlate_read_slb(thread, x));
+
+out:
+	if (did_setup)
+		thread->ram_destroy(thread);
+
+	return rc;
+}
+
+/* Read a big-endian page table entry, filling the cache a line at a time */
+static int xlate_read_entry(struct thread_xlate *x, struct pdbg_target *mem,
+			    uint64_t addr, uint64_t *val)
+{
+	uint64_t line[XLATE_LINE_SIZE/sizeof(uint64_t)];
+	uint64_t base = addr & ~(uint64_t)(XLATE_LINE_SIZE - 1);
+	struct xlate_entry *e;
+	int i;
+
+	e = &x->pwc[(addr / sizeof(uint64_t)) % XLATE_PWC_SIZE];
+	if (e->tag == (addr | 1)) {
+		*val = e->val;
+		return 0;
+	}
+
+	CHECK_ERR(mem_read(mem, base, (uint8_t *) line, sizeof(line), 0, false));
+
+	for (i = 0; i < ARRAY_SIZE(line); i++) {
+		uint64_t entry_addr = base + i*sizeof(uint64_t);
+
+		e = &x->pwc[(entry_addr / sizeof(uint64_t)) % XLATE_PWC_SIZE];
+		e->tag = entry_addr | 1;
+		e->val = be64toh(line[i]);
+	}
+
+	*val = be64toh(line[(addr - base) / sizeof(uint64_t)]);
+
+	return 0;
+}
+
+/*
+ * Walk a radix tree rooted at the given partition or process table
+ * entry. If the tree lives in a guest then each table address and the
+ * final result are further translated through the partition tree.
+ */
+static int radix_walk(struct thread_xlate *x, struct pdbg_target *mem,
+		      uint64_t root, uint64_t *pate0, uint64_t ea, uint64_t *ra)
+{
+	uint64_t base, entry, addr;
+	int bits, shift, nls, level;
+
+	bits = ((GETFIELD(RADIX_RTS1, root) << 3) | GETFIELD(RADIX_RTS2, root)) + 31;
+	if (bits < 62 && (ea & ~PPC_BITMASK(0, 1)) >> bits) {
+		PR_DEBUG("Address 0x%016" PRIx64 " outside of radix tree\n", ea);
+		return 1;
+	}
+
+	base = root & RADIX_RPDB;
+	nls = GETFIELD(RADIX_RPDS, root);
+	shift = bits;
+
+	for (level = 0; level < RADIX_MAX_LEVELS; level++) {
+		if (nls < 5 || nls > shift) {
+			PR_DEBUG("Invalid radix level size %d\n", nls);
+			return 1;
+		}
+
+		shift -= nls;
+		addr = base + ((ea >> shift) & ((1ULL << nls) - 1))*sizeof(uint64_t);
+		if (pate0)
+			CHECK_ERR(radix_walk(x, mem, *pate0, NULL, addr, &addr));
+
+		CHECK_ERR(xlate_read_entry(x, mem, addr, &entry));
+		if (!(entry & RADIX_V))
+			return 1;
+
+		if (entry & RADIX_L) {
+			addr = (entry & RADIX_RPN & ~((1ULL << shift) - 1)) |
+				(ea & ((1ULL << shift) - 1));
+			if (pate0)
+				CHECK_ERR(radix_walk(x, mem, *pate0, NULL, addr, &addr));
+			*ra = addr;
+			return 0;
+		}
+
+		base = entry & RADIX_NLB;
+		nls = GETFIELD(RADIX_NLS, entry);
+	}
+
+	return 1;
+}
+
+static int radix_translate(struct thread_xlate *x, struct pdbg_target *mem,
+			   uint64_t ea, uint64_t *ra)
+{
+	uint64_t lpid, pid, pate0, pate1, prte0, prtb;
+	int quadrant = ea >> 62;
+
+	/* Work out which partition and process the quadrant refers to */
+	if ((x->msr & MSR_HV) && !(x->msr & MSR_PR)) {
+		lpid = (quadrant == 1 || quadrant == 2) ? x->lpidr : 0;
+		pid = (quadrant == 0 || quadrant == 1) ? x->pidr : 0;
+	} else if (quadrant == 0 || quadrant == 3) {
+		lpid = x->lpidr;
+		pid = quadrant == 0 ? x->pidr : 0;
+	} else
+		return 1;
+
+	if (lpid*16 >= 1ULL << (12 + GETFIELD(PTCR_PATS, x->ptcr)))
+		return 1;
+
+	CHECK_ERR(xlate_read_entry(x, mem, (x->ptcr & PTCR_PATB) + lpid*16, &pate0));
+	CHECK_ERR(xlate_read_entry(x, mem, (x->ptcr & PTCR_PATB) + lpid*16 + 8, &pate1));
+	if (!(pate0 & PATE0_HR))
+		return 1;
+
+	if (pid*16 >= 1ULL << (12 + GETFIELD(PATE1_PRTS, pate1)))
+		return 1;
+
+	prtb = (pate1 & PATE1_PRTB) + pid*16;
+	if (lpid)
+		CHECK_ERR(radix_walk(x, mem, pate0, NULL, prtb, &prtb));
+	CHECK_ERR(xlate_read_entry(x, mem, prtb, &prte0));
+
+	return radix_walk(x, mem, prte0, lpid ? &pate0 : NULL, ea, ra);
+}
+
+static int hash_translate(struct thread_xlate *x, struct pdbg_target *mem,
+			  uint64_t ea, uint64_t *ra)
+{
+	uint64_t pteg[2*HPTES_PER_GROUP];
+	uint64_t vsid, hash, avpn, avpn_mask, nptegs, v, r;
+	int i, j, ssize, sshift, pshift;
+
+	for (i = 0; i < SLB_ENTRIES; i++) {
+		uint64_t esid_mask;
+
+		if (!(x->slb[i].esid & SLB_ESID_V))
+			continue;
+
+		ssize = GETFIELD(SLB_VSID_B, x->slb[i].vsid);
+		esid_mask = ssize ? SLB_ESID_1T : SLB_ESID_256M;
+		if ((ea & esid_mask) == (x->slb[i].esid & esid_mask))
+			break;
+	}
+
+	if (!x->htab_valid) {
+		/* POWER9 finds the hash table in the partition table */
+		uint64_t pate0;
+
+		CHECK_ERR(xlate_read_entry(x, mem, (x->ptcr & PTCR_PATB) + x->lpidr*16, &pate0));
+		x->htab = pate0 & PATE0_HTABORG;
+		x->htabsize = GETFIELD(PATE0_HTABSIZE, pate0);
+		x->htab_valid = true;
+	}
+
+	if (i == SLB_ENTRIES) {
+		PR_DEBUG("No SLB entry for 0x%016" PRIx64 "\n", ea);
+		return 1;
+	}
+
+	vsid = GETFIELD(SLB_VSID_VSID, x->slb[i].vsid);
+	sshift = ssize ? 40 : 28;
+	if (!(x->slb[i].vsid & SLB_VSID_L))
+		pshift = 12;
+	else if (GETFIELD(SLB_VSID_LP, x->slb[i].vsid) == 0)
+		pshift = 24;
+	else if (GETFIELD(SLB_VSID_LP, x->slb[i].vsid) == 1)
+		pshift = 16;
+	else
+		return 1;
+
+	ea &= (1ULL << sshift) - 1;
+	if (ssize)
+		hash = vsid ^ (vsid << 25) ^ (ea >> pshift);
+	else
+		hash = vsid ^ (ea >> pshift);
+	hash &= 0x7fffffffffULL;
+
+	/* Abbreviated virtual page number, ignoring bits within the page */
+	avpn = (vsid << (sshift - 23)) | (ea >> 23);
+	avpn_mask = pshift > 23 ? (1ULL << (pshift - 23)) - 1 : 0;
+
+	nptegs = 1ULL << (11 + x->htabsize);
+	for (j = 0; j < 2; j++, hash = ~hash) {
+		uint64_t addr = x->htab + (hash & (nptegs - 1))*sizeof(pteg);
+
+		CHECK_ERR(mem_read(mem, addr, (uint8_t *) pteg, sizeof(pteg), 0, false));
+
+		for (i = 0; i < HPTES_PER_GROUP; i++) {
+			v = be64toh(pteg[2*i]);
+			r = be64toh(pteg[2*i + 1]);
+
+			if (!(v & HPTE_V_VALID))
+				continue;
+			if (!!(v & HPTE_V_SECONDARY) != j)
+				continue;
+			if (!!(v & HPTE_V_LARGE) != (pshift != 12))
+				continue;
+			if (GETFIELD(HPTE_V_B, v) != ssize)
+				continue;
+			if ((GETFIELD(HPTE_V_AVPN, v) & ~avpn_mask) != (avpn & ~avpn_mask))
+				continue;
+
+			*ra = (r & HPTE_R_RPN & ~((1ULL << pshift) - 1)) |
+				(ea & ((1ULL << pshift) - 1));
+			return 0;
+		}
+	}
+
+	return 1;
+}
+
+/*
+ * Translate an effective address as seen by the data side of the given
+ * thread into a real address, reading page tables through mem.
+ */
+int thread_translate(struct pdbg_target *thread_target, struct pdbg_target *mem,
+		     uint64_t ea, uint64_t *ra)
+{
+	struct thread *thread;
+	struct thread_xlate *x;
+	struct xlate_entry *e;
+	uint64_t page = ea & ~0xfffULL;
+
+	assert(!strcmp(thread_target->class, "thread"));
+	thread = target_to_thread(thread_target);
+
+	if (!thread->xlate) {
+		thread->xlate = calloc(1, sizeof(*thread->xlate));
+		if (!thread->xlate)
+			return 1;
+	}
+	x = thread->xlate;
+
+	if (!x->valid) {
+		CHECK_ERR(xlate_setup(thread, x));
+		x->valid = true;
+	}
+
+	if (!(x->msr & MSR_DR)) {
+		/* Real mode ignores the top bits of the address. Hypervisor
+		 * real mode also offsets addresses with the top bit clear by
+		 * HRMOR. */
+		*ra = ea & ~PPC_BITMASK(0, 3);
+		if ((x->msr & MSR_HV) && !(ea & PPC_BIT(0)))
+			*ra |= x->hrmor;
+		return 0;
+	}
+
+	e = &x->tlb[(page >> 12) % XLATE_TLB_SIZE];
+	if (e->tag == (page | 1)) {
+		x->hits++;
+		*ra = e->val | (ea & 0xfff);
+		return 0;
+	}
+	x->misses++;
+
+	if (x->radix)
+		CHECK_ERR(radix_translate(x, mem, ea, ra));
+	else
+		CHECK_ERR(hash_translate(x, mem, ea, ra));
+
+	e->tag = page | 1;
+	e->val = *ra & ~0xfffULL;
+
+	PR_DEBUG("0x%016" PRIx64 " -> 0x%016" PRIx64 " (%" PRIu64 " hits, %" PRIu64 " misses)\n",
+		 ea, *ra, x->hits, x->misses);
+
+	return 0;
+}
+
+/* Drop cached translations for a thread, eg. because it has run */
+void thread_translate_flush(struct pdbg_target *thread_target)
+{
+	struct thread *thread;
+
+	assert(!strcmp(thread_target->class, "thread"));
+	thread = target_to_thread(thread_target);
+
+	if (thread->xlate)
+		memset(thread->xlate, 0, sizeof(*thread->xlate));
+}
+
+/* Free the translation state when the thread is released */
+void thread_translate_release(struct pdbg_target *thread_target)
+{
+	struct thread *thread = target_to_thread(thread_target);
+
+	free(thread->xlate);
+	thread->xlate = NULL;
+}
@@ -14,10 +14,13 @@
 		data = stack;
 		memset(stack, 0, sizeof(stack));
 		crc = 0;
+		packet_len = 0;
 	}
 
 	action crc {
 		crc += *p;
+		if (packet_len < MAX_PACKET_SIZE)
+			packet[packet_len++] = *p;
 	}
 
 	action push {
@@ -37,6 +40,8 @@
 	}
 
 	action end {
+		packet[packet_len] = '\0';
+
 		/* *data should point to the CRC */
 		if (crc != *data) {
 			printf("CRC error\n");
@@ -81,9 +86,11 @@
 
 	# TODO: We don't actually listen to what's supported
 	q_attached = ('qAttached:' xdigit* @{rsp = "1";});
-	q_C = ('qC' @{rsp = "QC1";});
-	q_supported = ('qSupported:' any* @{rsp = "multiprocess+;vContSupported+";});
-	qf_threadinfo = ('qfThreadInfo' @{rsp = "m1l";});
+	q_C = ('qC' @{cmd = CURRENT_THREAD;});
+	q_supported = ('qSupported:' any* @{cmd = QUERY_SUPPORTED;});
+	qf_threadinfo = ('qfThreadInfo' @{cmd = THREAD_INFO;});
+	q_threadextrainfo = ('qThreadExtraInfo,' any* @{cmd = THREAD_EXTRA_INFO;});
+	thread_alive = ('T' any* @{cmd = THREAD_ALIVE;});
 
 	# vCont packet parsing
 	v_contq = ('vCont?' @{rsp = "vCont;c;C;s;S";});
@@ -94,6 +101,7 @@
 
 	commands = (get_mem | get_gprs | get_spr | stop_reason | set_thread |
 		    q_attached | q_C | q_supported | qf_threadinfo | q_C |
+		    q_threadextrainfo | thread_alive |
 		    v_contq | v_contc | v_conts | put_mem | disconnect );
 
 	cmd = ((commands & ^'#'*) | ^'#'*) $crc
@@ -113,6 +121,10 @@ static char *rsp;
 static uint8_t crc;
 static int cs;
 
+/* The raw text of the current packet between the '$' and '#' */
+static char packet[MAX_PACKET_SIZE + 1];
+static size_t packet_len;
+
 command_cb *command_callbacks;
 
 %%write data;
@@ -124,6 +136,14 @@ void parser_init(command_cb *callbacks)
 	command_callbacks = callbacks;
 }
 
+const char *parser_packet(size_t *len)
+{
+	if (len)
+		*len = packet_len;
+
+	return packet;
+}
+
 int parse_buffer(char *buf, size_t len, void *priv)
 {
 	char *p = buf;
@@ -8,7 +8,7 @@
 #include "pdbgproxy.h"
 
 
-#line 105 "src/gdb_parser.rl"
+#line 110 "src/gdb_parser.rl"
 
 
 static enum gdb_command cmd = NONE;
@@ -17,6 +17,10 @@ static char *rsp;
 static uint8_t crc;
 static int cs;
 
+/* The raw text of the current packet between the '$' and '#' */
+static char packet[MAX_PACKET_SIZE + 1];
+static size_t packet_len;
+
 command_cb *command_callbacks;
 
 
@@ -172,7 +176,7 @@ static const int gdb_error = 0;
 static const int gdb_en_main = 58;
 
 
-#line 116 "src/gdb_parser.rl"
+#line 125 "src/gdb_parser.rl"
 
 void parser_init(command_cb *callbacks)
 {
@@ -182,11 +186,19 @@ void parser_init(command_cb *callbacks)
 	cs = gdb_start;
 	}
 
-#line 120 "src/gdb_parser.rl"
+#line 129 "src/gdb_parser.rl"
 
 	command_callbacks = callbacks;
 }
 
+const char *parser_packet(size_t *len)
+{
+	if (len)
+		*len = packet_len;
+
+	return packet;
+}
+
 int parse_buffer(char *buf, size_t len, void *priv)
 {
 	char *p = buf;
@@ -275,23 +287,26 @@ _match:
 		data = stack;
 		memset(stack, 0, sizeof(stack));
 		crc = 0;
+		packet_len = 0;
 	}
 	break;
 	case 1:
-#line 19 "src/gdb_parser.rl"
+#line 20 "src/gdb_parser.rl"
 	{
 		crc += *p;
+		if (packet_len < MAX_PACKET_SIZE)
+			packet[packet_len++] = *p;
 	}
 	break;
 	case 2:
-#line 23 "src/gdb_parser.rl"
+#line 26 "src/gdb_parser.rl"
 	{
 		data++;
 		assert(data < &stack[10]);
 	}
 	break;
 	case 3:
-#line 28 "src/gdb_parser.rl"
+#line 31 "src/gdb_parser.rl"
 	{
 		*data *= 16;
 
@@ -304,8 +319,10 @@ _match:
 	}
 	break;
 	case 4:
-#line 39 "src/gdb_parser.rl"
+#line 42 "src/gdb_parser.rl"
 	{
+		packet[packet_len] = '\0';
+
 		/* *data should point to the CRC */
 		if (crc != *data) {
 			printf("CRC error\n");
@@ -325,59 +342,59 @@ _match:
 	}
 	break;
 	case 5:
-#line 58 "src/gdb_parser.rl"
+#line 63 "src/gdb_parser.rl"
 	{cmd = GET_MEM;}
 	break;
 	case 6:
-#line 63 "src/gdb_parser.rl"
+#line 68 "src/gdb_parser.rl"
 	{cmd = PUT_MEM;}
 	break;
 	case 7:
-#line 70 "src/gdb_parser.rl"
+#line 75 "src/gdb_parser.rl"
 	{cmd = GET_GPRS;}
 	break;
 	case 8:
-#line 72 "src/gdb_parser.rl"
+#line 77 "src/gdb_parser.rl"
 	{cmd = GET_SPR;}
 	break;
 	case 9:
-#line 75 "src/gdb_parser.rl"
+#line 80 "src/gdb_parser.rl"
 	{cmd = STOP_REASON;}
 	break;
 	case 10:
-#line 77 "src/gdb_parser.rl"
+#line 82 "src/gdb_parser.rl"
 	{cmd = SET_THREAD;}
 	break;
 	case 11:
-#line 80 "src/gdb_parser.rl"
+#line 88 "src/gdb_parser.rl"
 	{rsp = "1";}
 	break;
 	case 12:
-#line 81 "src/gdb_parser.rl"
-	{rsp = "QC1";}
+#line 89 "src/gdb_parser.rl"
+	{cmd = CURRENT_THREAD;}
 	break;
 	case 13:
-#line 82 "src/gdb_parser.rl"
-	{rsp = "multiprocess+;vContSupported+";}
+#line 90 "src/gdb_parser.rl"
+	{cmd = QUERY_SUPPORTED;}
 	break;
 	case 14:
-#line 83 "src/gdb_parser.rl"
-	{rsp = "m1l";}
+#line 91 "src/gdb_parser.rl"
+	{cmd = THREAD_INFO;}
 	break;
 	case 15:
-#line 86 "src/gdb_parser.rl"
+#line 94 "src/gdb_parser.rl"
 	{rsp = "vCont;c;C;s;S";}
 	break;
 	case 16:
-#line 87 "src/gdb_parser.rl"
+#line 95 "src/gdb_parser.rl"
 	{cmd = V_CONTC;}
 	break;
 	case 17:
-#line 88 "src/gdb_parser.rl"
+#line 96 "src/gdb_parser.rl"
 	{cmd = V_CONTS;}
 	break;
 	case 18:
-#line 90 "src/gdb_parser.rl"
+#line 98 "src/gdb_parser.rl"
 	{command_callbacks[INTERRUPT](stack, priv);}
 	break;
 #line 384 "src/gdb_parser.c"
@@ -393,7 +410,7 @@ _again:
 	_out: {}
 	}
 
-#line 130 "src/gdb_parser.rl"
+#line 147 "src/gdb_parser.rl"
 
 	return 0;
 }
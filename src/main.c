@@ -38,6 +38,7 @@
 #include "pdbgproxy.h"
 #include "util.h"
 #include "path.h"
+#include "wakeup.h"
 
 #define PR_ERROR(x, args...) \
 	pdbg_log(PDBG_ERROR, x, ##args)
@@ -48,6 +49,10 @@ static enum pdbg_backend backend = PDBG_DEFAULT_BACKEND;
 
 static char const *device_node;
 static int i2c_addr = 0x50;
+static char *backend_arg, *i2c_addr_arg;
+static int keep_wakeup;
+static char *probe_cache;
+static char *release_argv[12];
 
 #define MAX_PROCESSORS 64
 #define MAX_CHIPS 24
@@ -57,6 +62,8 @@ static int i2c_addr = 0x50;
 
 #define MAX_PATH_ARGS	16
 
+#define PROBE_CACHE_FILE	"pdbg-probe-cache"
+
 static const char *pathsel[MAX_PATH_ARGS];
 static int pathsel_count;
 
@@ -73,7 +80,7 @@ extern struct optcmd_cmd
 	optcmd_threadstatus, optcmd_sreset, optcmd_regs, optcmd_probe,
 	optcmd_getmem, optcmd_putmem, optcmd_getmemio, optcmd_putmemio,
 	optcmd_getxer, optcmd_putxer, optcmd_getcr, optcmd_putcr,
-	optcmd_gdbserver, optcmd_istep;
+	optcmd_gdbserver, optcmd_istep, optcmd_profile, optcmd_release;
 
 static struct optcmd_cmd *cmds[] = {
 	&optcmd_getscom, &optcmd_putscom, &optcmd_getcfam, &optcmd_putcfam,
@@ -83,7 +90,7 @@ static struct optcmd_cmd *cmds[] = {
 	&optcmd_threadstatus, &optcmd_sreset, &optcmd_regs, &optcmd_probe,
 	&optcmd_getmem, &optcmd_putmem, &optcmd_getmemio, &optcmd_putmemio,
 	&optcmd_getxer, &optcmd_putxer, &optcmd_getcr, &optcmd_putcr,
-	&optcmd_gdbserver, &optcmd_istep,
+	&optcmd_gdbserver, &optcmd_istep, &optcmd_profile, &optcmd_release,
 };
 
 /* Purely for printing usage text. We could integrate printing argument and flag
@@ -109,8 +116,9 @@ static struct action actions[] = {
 	{ "putxer",  "<value>", "Write Fixed Point Exception Register (XER)" },
 	{ "getring", "<addr> <len>", "Read a ring. Length must be correct" },
 	{ "start",   "", "Start thread" },
-	{ "step",    "<count>", "Set a thread <count> instructions" },
+	{ "step",    "<count> [--trace=<file>]", "Set a thread <count> instructions" },
 	{ "stop",    "", "Stop thread" },
+	{ "profile", "<samples> [--rate=<hz>] [--top=<n>] [--elf=<file>]", "Sample thread NIAs and print a histogram" },
 	{ "htm", "core|nest start|stop|status|dump|record", "Hardware Trace Macro" },
 	{ "probe", "", "" },
 	{ "getcfam", "<address>", "Read system cfam" },
@@ -126,6 +134,7 @@ static struct action actions[] = {
 	{ "regs",  "[--backtrace]", "State (optionally display backtrace)" },
 	{ "gdbserver", "", "Start a gdb server" },
 	{ "istep", "<major> <minor>|0", "Execute istep on SBE" },
+	{ "release", "", "Release special wakeup held by --keep-wakeup" },
 };
 
 static void print_usage(void)
@@ -160,6 +169,14 @@ static void print_usage(void)
 	printf("\t\tand defaults to 0x50 for I2C\n");
 	printf("\t-D, --debug=<debug level>\n");
 	printf("\t\t0:error (default) 1:warning 2:notice 3:info 4:debug\n");
+	printf("\t-k, --keep-wakeup[=<seconds>]\n");
+	printf("\t\tLeave special wakeup asserted on exit so later commands don't\n");
+	printf("\t\thave to wait for it. It is released by the 'release' command\n");
+	printf("\t\tor after <seconds> (default %d) without a pdbg command\n", STICKY_WAKEUP_TIMEOUT);
+	printf("\t-C, --probe-cache[=<file>]\n");
+	printf("\t\tRemember which targets don't exist so later commands on the\n");
+	printf("\t\tsame system don't have to probe them. Defaults to\n");
+	printf("\t\t$XDG_RUNTIME_DIR/%s or /run/%s\n", PROBE_CACHE_FILE, PROBE_CACHE_FILE);
 	printf("\t-S, --shutup\n");
 	printf("\t\tShut up those annoying progress bars\n");
 	printf("\t-V, --version\n");
@@ -282,6 +299,20 @@ static bool list_to_string(int *list, int max, char *str, size_t len)
 	return true;
 }
 
+static char *probe_cache_default(void)
+{
+	const char *dir = getenv("XDG_RUNTIME_DIR");
+	char *path;
+
+	if (!dir)
+		dir = "/run";
+
+	if (asprintf(&path, "%s/%s", dir, PROBE_CACHE_FILE) < 0)
+		return NULL;
+
+	return path;
+}
+
 static bool parse_options(int argc, char *argv[])
 {
 	int c;
@@ -296,8 +327,10 @@ static bool parse_options(int argc, char *argv[])
 		{"all",			no_argument,		NULL,	'a'},
 		{"backend",		required_argument,	NULL,	'b'},
 		{"chip",		required_argument,	NULL,	'c'},
+		{"probe-cache",		optional_argument,	NULL,	'C'},
 		{"device",		required_argument,	NULL,	'd'},
 		{"help",		no_argument,		NULL,	'h'},
+		{"keep-wakeup",		optional_argument,	NULL,	'k'},
 		{"processor",		required_argument,	NULL,	'p'},
 		{"slave-address",	required_argument,	NULL,	's'},
 		{"thread",		required_argument,	NULL,	't'},
@@ -319,7 +352,7 @@ static bool parse_options(int argc, char *argv[])
 	memset(l_list, 0, sizeof(l_list));
 
 	do {
-		c = getopt_long(argc, argv, "+ab:c:d:hp:s:t:D:P:SV" PPC_OPTS,
+		c = getopt_long(argc, argv, "+ab:c:C::d:hk::p:s:t:D:P:SV" PPC_OPTS,
 				long_opts, NULL);
 		if (c == -1)
 			break;
@@ -374,6 +407,7 @@ static bool parse_options(int argc, char *argv[])
 			break;
 
 		case 'b':
+			backend_arg = optarg;
 			if (strcmp(optarg, "fsi") == 0) {
 				backend = PDBG_BACKEND_FSI;
 			} else if (strcmp(optarg, "i2c") == 0) {
@@ -398,7 +432,27 @@ static bool parse_options(int argc, char *argv[])
 			device_node = optarg;
 			break;
 
+		case 'k':
+			keep_wakeup = STICKY_WAKEUP_TIMEOUT;
+			if (optarg) {
+				errno = 0;
+				keep_wakeup = strtol(optarg, &endptr, 0);
+				opt_error = (errno || *endptr != '\0' || keep_wakeup <= 0);
+				if (opt_error)
+					fprintf(stderr, "Invalid wakeup timeout '%s'\n", optarg);
+			}
+			break;
+
+		case 'C':
+			free(probe_cache);
+			if (optarg)
+				probe_cache = strdup(optarg);
+			else
+				probe_cache = probe_cache_default();
+			break;
+
 		case 's':
+			i2c_addr_arg = optarg;
 			errno = 0;
 			i2c_addr = strtoull(optarg, &endptr, 0);
 			opt_error = (errno || *endptr != '\0');
@@ -559,15 +613,29 @@ OPTCMD_DEFINE_CMD(probe, probe);
  */
 static void atexit_release(void)
 {
+	struct pib_wait_stats stats;
+
+	sticky_wakeup_save(release_argv);
+
+	if (probe_cache)
+		pdbg_probe_cache_save(probe_cache);
+
 	pdbg_target_release(pdbg_target_root());
+
+	pib_wait_get_stats(&stats);
+	if (stats.waits)
+		pdbg_log(PDBG_DEBUG, "pib waits: %" PRIu64 " (%" PRIu64 " polls, %" PRIu64
+			 " sleeps, %" PRIu64 " timeouts) %" PRIu64 "us total, %" PRIu64 "us max\n",
+			 stats.waits, stats.polls, stats.sleeps, stats.timeouts,
+			 stats.total_us, stats.max_us);
 }
 
 int main(int argc, char *argv[])
 {
-	int i, rc = 0;
+	int i, count, rc = 0;
 	void **args, **flags;
 	optcmd_cmd_t *cmd;
-	struct pdbg_target *target;
+	struct pdbg_target *target, **targets;
 
 	if (!parse_options(argc, argv))
 		return 1;
@@ -580,8 +648,34 @@ int main(int argc, char *argv[])
 	if (backend)
 		pdbg_set_backend(backend, device_node);
 
+	/* The built in fdt stays valid for the whole run so properties can
+	 * be read from it in place rather than copied. Target selection
+	 * still walks, and so creates, the whole tree. */
+	pdbg_set_lazy_targets(true);
 	pdbg_targets_init(NULL);
 
+	/* Command line used by the sticky wakeup timer to release special
+	 * wakeup with the same backend */
+	i = 0;
+	release_argv[i++] = argv[0];
+	if (backend_arg) {
+		release_argv[i++] = "-b";
+		release_argv[i++] = backend_arg;
+	}
+	if (device_node) {
+		release_argv[i++] = "-d";
+		release_argv[i++] = (char *) device_node;
+	}
+	if (i2c_addr_arg) {
+		release_argv[i++] = "-s";
+		release_argv[i++] = i2c_addr_arg;
+	}
+	release_argv[i++] = "-a";
+	release_argv[i++] = "release";
+	release_argv[i] = NULL;
+
+	sticky_wakeup_init(keep_wakeup);
+
 	if (pathsel_count) {
 		if (!path_target_parse(pathsel, pathsel_count))
 			return 1;
@@ -593,9 +687,28 @@ int main(int argc, char *argv[])
 		return 1;
 	}
 
-	/* Probe all selected targets */
-	for_each_path_target(target) {
-		pdbg_target_probe(target);
+	if (probe_cache)
+		pdbg_probe_cache_load(probe_cache);
+
+	/* Probe all selected targets, with the chips probed concurrently
+	 * when the backend allows it. The special wakeups of the cores on
+	 * each chip are issued together as soon as the chip is probed. */
+	count = 0;
+	for_each_path_target(target)
+		count++;
+
+	targets = calloc(count, sizeof(*targets));
+	if (targets) {
+		i = 0;
+		for_each_path_target(target)
+			targets[i++] = target;
+
+		pdbg_set_parallel_probe(true);
+		pdbg_targets_probe(targets, count);
+		free(targets);
+	} else {
+		for_each_path_target(target)
+			pdbg_target_probe(target);
 	}
 
 	atexit(atexit_release);
@@ -105,7 +105,7 @@ static int _getmem(uint64_t addr, uint64_t size, uint8_t block_size, bool ci, bo
 		progress_end();
 		if (rc) {
 			PR_ERROR("Unable to read memory from %s\n",
-				 pdbg_target_path(target));
+				 pdbg_target_path_const(target));
 			continue;
 		}
 
@@ -163,7 +163,7 @@ static int _putmem(uint64_t addr, uint8_t block_size, bool ci)
 		progress_end();
 		if (rc) {
 			printf("Unable to write memory using %s\n",
-			       pdbg_target_path(target));
+			       pdbg_target_path_const(target));
 			continue;
 		}
 
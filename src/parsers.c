@@ -3,6 +3,7 @@
 #include <stdint.h>
 #include <stdbool.h>
 #include <errno.h>
+#include <string.h>
 
 uint64_t *parse_number64(const char *argv)
 {
@@ -127,3 +128,16 @@ bool *parse_flag_noarg(const char *argv)
 	*result = true;
 	return result;
 }
+
+/* Parse a flag taking a string argument (eg. a filename) */
+char **parse_string(const char *argv)
+{
+	char **result;
+
+	if (!argv)
+		return NULL;
+
+	result = malloc(sizeof(*result));
+	*result = strdup(argv);
+	return result;
+}
@@ -21,5 +21,6 @@ uint8_t *parse_number8_pow2(const char *argv);
 int *parse_gpr(const char *argv);
 int *parse_spr(const char *argv);
 bool *parse_flag_noarg(const char *argv);
+char **parse_string(const char *argv);
 
 #endif
@@ -20,6 +20,7 @@
 #include <ctype.h>
 #include <assert.h>
 #include <limits.h>
+#include <stdint.h>
 
 #include <libpdbg.h>
 
@@ -33,18 +34,47 @@
 /* This is max(MAX_PROCESSORS, MAX_CHIPS, MAX_THREADS) */
 #define MAX_PATH_INDEX		64
 
+/* What a pattern component is compared against */
+enum path_match {
+	PATH_MATCH_ALL,		/* any target */
+	PATH_MATCH_CLASS,	/* the class name */
+	PATH_MATCH_NAME,	/* the full node name */
+};
+
 struct path_pattern {
 	char prefix[MAX_PATH_COMP_LEN];
 	int index[MAX_PATH_INDEX];
-	bool match_full;
+	enum path_match match;
 	bool match_index;
 };
 
-/* Start with max threads, rather than defining arbitrary number */
-#define MAX_TARGETS	(64 * 24 * 8)
+/* Selected targets in the order they were selected */
+struct path_target_list {
+	struct pdbg_target **targets;
+	unsigned int count;
+	unsigned int alloc;
+};
 
-static struct pdbg_target *path_target[MAX_TARGETS];
-static unsigned int path_target_count;
+struct path_class {
+	const char *name;
+	struct path_target_list list;
+};
+
+/* Hash table slot recording where a selected target is in each list */
+struct path_entry {
+	struct pdbg_target *target;
+	struct path_class *klass;
+	unsigned int index;
+	unsigned int class_index;
+};
+
+static struct path_target_list path_targets;
+
+static struct path_class **path_classes;
+static unsigned int path_class_count;
+
+static struct path_entry *path_table;
+static unsigned int path_table_size;
 
 static void safe_strcpy(char *dest, size_t n, const char *src)
 {
@@ -72,7 +102,8 @@ static bool path_pattern_parse(const char *arg, struct path_pattern *pat)
 
 	if (strchr(tmp, '@')) {
 		safe_strcpy(pat->prefix, sizeof(pat->prefix), tmp);
-		pat->match_full = true;
+		pat->match = PATH_MATCH_NAME;
+		return true;
 
 	} else if (strchr(tmp, '*')) {
 		tok = strtok(tmp, "*");
@@ -126,6 +157,11 @@ static bool path_pattern_parse(const char *arg, struct path_pattern *pat)
 	if (!pat->prefix[0])
 		return false;
 
+	if (!strcmp(pat->prefix, "all"))
+		pat->match = PATH_MATCH_ALL;
+	else
+		pat->match = PATH_MATCH_CLASS;
+
 	return true;
 }
 
@@ -164,66 +200,172 @@ static int path_pattern_split(const char *arg, struct path_pattern *pats)
 	return n;
 }
 
-static int path_target_find(struct pdbg_target *prev)
+static unsigned int path_hash(struct pdbg_target *target)
+{
+	uint64_t hash = (uintptr_t) target;
+
+	hash = (hash >> 4) * 0x9e3779b97f4a7c15ULL;
+	return (hash >> 32) & (path_table_size - 1);
+}
+
+static struct path_entry *path_target_find(struct pdbg_target *target)
 {
-	int i;
+	struct path_entry *entry;
+	unsigned int i;
+
+	if (!target || !path_table_size)
+		return NULL;
+
+	for (i = path_hash(target); ; i = (i + 1) & (path_table_size - 1)) {
+		entry = &path_table[i];
+		if (entry->target == target)
+			return entry;
+		if (!entry->target)
+			return NULL;
+	}
+}
+
+/* Keeps the table at most half full */
+static bool path_table_grow(void)
+{
+	struct path_entry *old = path_table, *entry;
+	unsigned int old_size = path_table_size, i;
+
+	if (path_targets.count < path_table_size / 2)
+		return true;
+
+	path_table_size = old_size ? old_size * 2 : 256;
+	path_table = calloc(path_table_size, sizeof(*path_table));
+	if (!path_table) {
+		path_table = old;
+		path_table_size = old_size;
+		return false;
+	}
 
-	if (!prev)
-		return -1;
+	for (i = 0; i < old_size; i++) {
+		if (!old[i].target)
+			continue;
 
-	for (i=0; i<path_target_count; i++) {
-		if (path_target[i] == prev)
-			return i;
+		entry = &path_table[path_hash(old[i].target)];
+		while (entry->target)
+			entry = &path_table[(entry - path_table + 1) & (path_table_size - 1)];
+		*entry = old[i];
 	}
 
-	return -1;
+	free(old);
+	return true;
 }
 
-struct pdbg_target *path_target_find_next(const char *klass, int index)
+static bool path_list_append(struct path_target_list *list, struct pdbg_target *target)
 {
-	struct pdbg_target *target;
-	int i;
+	struct pdbg_target **tmp;
 
-	for (i=index+1; i<path_target_count; i++) {
-		target = path_target[i];
-		if (klass) {
-			const char *classname = pdbg_target_class_name(target);
+	if (list->count == list->alloc) {
+		tmp = realloc(list->targets, (list->alloc ? list->alloc * 2 : 64) * sizeof(*tmp));
+		if (!tmp)
+			return false;
 
-			if (!strcmp(klass, classname))
-				return target;
-		} else {
-			return target;
-		}
+		list->targets = tmp;
+		list->alloc = list->alloc ? list->alloc * 2 : 64;
 	}
 
+	list->targets[list->count++] = target;
+	return true;
+}
+
+static struct path_class *path_class_find(const char *klass)
+{
+	unsigned int i;
+
+	for (i = 0; i < path_class_count; i++)
+		if (!strcmp(path_classes[i]->name, klass))
+			return path_classes[i];
+
 	return NULL;
 }
 
+static struct path_class *path_class_get(const char *klass)
+{
+	struct path_class *cls, **tmp;
+
+	cls = path_class_find(klass);
+	if (cls)
+		return cls;
+
+	tmp = realloc(path_classes, (path_class_count + 1) * sizeof(*tmp));
+	if (!tmp)
+		return NULL;
+	path_classes = tmp;
+
+	cls = calloc(1, sizeof(*cls));
+	if (!cls)
+		return NULL;
+
+	cls->name = klass;
+	path_classes[path_class_count++] = cls;
+
+	return cls;
+}
+
 bool path_target_add(struct pdbg_target *target)
 {
-	int index;
+	struct path_entry *entry;
+	struct path_class *cls = NULL;
+	const char *klass;
 
-	index = path_target_find(target);
-	if (index >= 0)
+	if (path_target_find(target))
 		return true;
 
-	if (path_target_count == MAX_TARGETS)
+	if (!path_table_grow())
 		return false;
 
-	path_target[path_target_count] = target;
-	path_target_count++;
+	/* Nodes without a hw unit have no class */
+	klass = pdbg_target_class_name(target);
+	if (klass) {
+		cls = path_class_get(klass);
+		if (!cls)
+			return false;
+	}
+
+	if (!path_list_append(&path_targets, target))
+		return false;
+
+	if (cls && !path_list_append(&cls->list, target)) {
+		path_targets.count--;
+		return false;
+	}
+
+	entry = &path_table[path_hash(target)];
+	while (entry->target)
+		entry = &path_table[(entry - path_table + 1) & (path_table_size - 1)];
+
+	entry->target = target;
+	entry->klass = cls;
+	entry->index = path_targets.count - 1;
+	entry->class_index = cls ? cls->list.count - 1 : 0;
+
 	return true;
 }
 
+static bool path_index_match(struct path_pattern *pat, struct pdbg_target *target)
+{
+	uint32_t index;
+
+	if (!pat->match_index)
+		return true;
+
+	index = pdbg_target_index(target);
+	return index < MAX_PATH_INDEX && pat->index[index] == 1;
+}
+
 static void path_pattern_match(struct pdbg_target *target,
 			       struct path_pattern *pats,
 			       int max_levels,
 			       int level)
 {
 	struct pdbg_target *child;
-	char comp_name[MAX_PATH_COMP_LEN];
 	const char *classname;
-	char *tok;
+	const char *tok;
 	int next = level;
 	bool found = false;
 
@@ -231,7 +373,7 @@ static void path_pattern_match(struct pdbg_target *target,
 		goto end;
 	}
 
-	if (!strcmp("all", pats[level].prefix)) {
+	if (pats[level].match == PATH_MATCH_ALL) {
 		if (!path_target_add(target))
 			return;
 		goto end;
@@ -241,25 +383,13 @@ static void path_pattern_match(struct pdbg_target *target,
 	if (!classname)
 		goto end;
 
-	if (pats[level].match_full) {
-		const char *dn_name = pdbg_target_dn_name(target);
+	if (pats[level].match == PATH_MATCH_NAME)
+		tok = pdbg_target_dn_name(target);
+	else
+		tok = classname;
 
-		safe_strcpy(comp_name, sizeof(comp_name), dn_name);
-	} else {
-		safe_strcpy(comp_name, sizeof(comp_name), classname);
-	}
-	tok = comp_name;
-
-	if (!strcmp(tok, pats[level].prefix)) {
-		found = true;
-
-		if (pats[level].match_index) {
-			int index = pdbg_target_index(target);
-
-			if (pats[level].index[index] != 1)
-				found = false;
-		}
-	}
+	if (!strcmp(tok, pats[level].prefix))
+		found = path_index_match(&pats[level], target);
 
 	if (found) {
 		if (level == max_levels-1) {
@@ -275,12 +405,8 @@ static void path_pattern_match(struct pdbg_target *target,
 	 * then stop recursion
 	 */
 	if (level > 0 && !strcmp(tok, pats[level-1].prefix)) {
-		if (pats[level-1].match_index) {
-			int index = pdbg_target_index(target);
-
-			if (pats[level-1].index[index] != 1)
-				return;
-		}
+		if (!path_index_match(&pats[level-1], target))
+			return;
 	}
 
 end:
@@ -307,18 +433,12 @@ bool path_target_parse(const char **arg, int arg_count)
 
 bool path_target_present(void)
 {
-	return (path_target_count > 0);
+	return (path_targets.count > 0);
 }
 
 bool path_target_selected(struct pdbg_target *target)
 {
-	int index;
-
-	index = path_target_find(target);
-	if (index >= 0)
-		return true;
-
-	return false;
+	return path_target_find(target) != NULL;
 }
 
 bool path_target_all_selected(const char *classname, struct pdbg_target *parent)
@@ -339,29 +459,58 @@ bool path_target_all_selected(const char *classname, struct pdbg_target *parent)
 void path_target_dump(void)
 {
 	struct pdbg_target *target;
-	char *path;
 
-	for_each_path_target(target) {
-		path = pdbg_target_path(target);
-		assert(path);
-		printf("%s\n", path);
-		free(path);
-	}
+	for_each_path_target(target)
+		printf("%s\n", pdbg_target_path_const(target));
 }
 
 struct pdbg_target *path_target_next(struct pdbg_target *prev)
 {
-	int index;
+	struct path_entry *entry = path_target_find(prev);
+	unsigned int i = entry ? entry->index + 1 : 0;
 
-	index = path_target_find(prev);
-	return path_target_find_next(NULL, index);
+	if (i >= path_targets.count)
+		return NULL;
+
+	return path_targets.targets[i];
 }
 
 struct pdbg_target *path_target_next_class(const char *klass,
 					   struct pdbg_target *prev)
 {
-	int index;
+	struct path_entry *entry = path_target_find(prev), *tmp;
+	struct path_class *cls;
+	unsigned int i, lo, hi, start;
+
+	if (!klass)
+		return path_target_next(prev);
+
+	if (entry && entry->klass && !strcmp(entry->klass->name, klass)) {
+		/* Carry on from the previous target in this class */
+		cls = entry->klass;
+		i = entry->class_index + 1;
+	} else {
+		cls = path_class_find(klass);
+		if (!cls)
+			return NULL;
+
+		/* Find the first target of the class selected after prev */
+		start = entry ? entry->index + 1 : 0;
+		lo = 0;
+		hi = cls->list.count;
+		while (lo < hi) {
+			i = (lo + hi) / 2;
+			tmp = path_target_find(cls->list.targets[i]);
+			if (tmp->index < start)
+				lo = i + 1;
+			else
+				hi = i;
+		}
+		i = lo;
+	}
+
+	if (i >= cls->list.count)
+		return NULL;
 
-	index = path_target_find(prev);
-	return path_target_find_next(klass, index);
+	return cls->list.targets[i];
 }
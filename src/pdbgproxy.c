@@ -8,12 +8,16 @@
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
 #include <netinet/in.h>
 #include <netdb.h>
 #include <inttypes.h>
 #include <assert.h>
 #include <getopt.h>
 #include <errno.h>
+#include <ctype.h>
+#include <pthread.h>
 #include <ccan/array_size/array_size.h>
 
 #include <bitutils.h>
@@ -28,7 +32,7 @@
 #ifndef DISABLE_GDBSERVER
 
 /* Maximum packet size */
-#define BUFFER_SIZE    	8192
+#define BUFFER_SIZE    	MAX_PACKET_SIZE
 
 /* GDB packets */
 #define STR(e) "e"
@@ -38,12 +42,43 @@
 #define TRAP "S05"
 #define ERROR(e) "E"STR(e)
 
-#define TEST_SKIBOOT_ADDR 0x40000000
+/* gdb numbers the threads from 1 in the order they were selected */
+struct gdb_thread {
+	struct pdbg_target *target;
+	int id;
+	bool running;
+	bool regs_requested;
+	unsigned int regs_valid;
+	struct thread_regs regs;
+};
+
+/* Registers gdb reads when it looks at a thread */
+#define GDB_REGS (THREAD_REG_GPRS | THREAD_REG_NIA | THREAD_REG_MSR | \
+		  THREAD_REG_CR | THREAD_REG_LR | THREAD_REG_CTR)
+
+static struct gdb_thread *threads;
+static int nr_threads;
+
+/* Thread selected for register and memory access by Hg */
+static struct gdb_thread *gen_thread;
+
+/* Thread reported in the most recent stop reply */
+static struct gdb_thread *stop_thread;
+
+/* Number of threads gdb has asked for registers since the last resume */
+static int regs_requests;
 
-static struct pdbg_target *thread_target = NULL;
 static struct pdbg_target *adu_target;
-static struct timeval timeout;
-static int poll_interval = 100;
+
+/*
+ * Running threads are polled with a one-shot timer. Polling starts quickly
+ * after a resume to catch short runs and backs off while the threads keep
+ * running so a long run doesn't cost a constant stream of SCOMs.
+ */
+#define POLL_MIN_US	100
+#define POLL_MAX_US	100000
+static int timer_fd = -1;
+static uint64_t poll_us;
 static int fd = -1;
 static int littleendian = 1;
 enum client_state {IDLE, SIGNAL_WAIT};
@@ -51,6 +86,27 @@ static enum client_state state = IDLE;
 
 static void destroy_client(int dead_fd);
 
+/*
+ * Received data which hasn't been parsed yet. Large packets arrive over
+ * several reads but the parser needs a NUL between packets to find the
+ * start of the next one, so only complete packets are passed to it.
+ */
+static char rx_buffer[2*BUFFER_SIZE + 1];
+static size_t rx_len;
+
+/* Schedule the next poll in us microseconds, or stop polling if 0 */
+static void poll_arm(uint64_t us)
+{
+	struct itimerspec its = {};
+
+	poll_us = us;
+	its.it_value.tv_sec = us / 1000000;
+	its.it_value.tv_nsec = (us % 1000000) * 1000;
+
+	if (timerfd_settime(timer_fd, 0, &its, NULL))
+		perror(__FUNCTION__);
+}
+
 static uint8_t gdbcrc(char *data)
 {
 	uint8_t crc = 0;
@@ -85,14 +141,159 @@ void send_ack(void *priv)
 	send(fd, ACK, 1, 0);
 }
 
+/*
+ * Parse a thread-id which may be in the multiprocess p<pid>.<tid> form.
+ * Returns -1 for all threads, 0 for any thread or the thread number.
+ */
+static int parse_thread_id(const char *str, char **end)
+{
+	char *p = (char *) str;
+
+	if (*p == 'p') {
+		strtol(p + 1, &p, 16);
+		if (*p != '.') {
+			/* All threads in the process */
+			*end = p;
+			return -1;
+		}
+		p++;
+	}
+
+	if (!strncmp(p, "-1", 2)) {
+		*end = p + 2;
+		return -1;
+	}
+
+	return strtoul(p, end, 16);
+}
+
+static struct gdb_thread *find_thread(int id)
+{
+	if (id < 1 || id > nr_threads)
+		return NULL;
+
+	return &threads[id - 1];
+}
+
+static void send_stop(struct gdb_thread *thread)
+{
+	char data[32];
+
+	stop_thread = gen_thread = thread;
+	snprintf(data, sizeof(data), "T05thread:p1.%x;", thread->id);
+	send_response(fd, data);
+}
+
 static void set_thread(uint64_t *stack, void *priv)
 {
+	const char *packet = parser_packet(NULL);
+	struct gdb_thread *thread = NULL;
+	char *end;
+	int id;
+
+	id = parse_thread_id(packet + 2, &end);
+	if (id > 0) {
+		thread = find_thread(id);
+		if (!thread) {
+			send_response(fd, ERROR(EINVAL));
+			return;
+		}
+	}
+
+	switch (packet[1]) {
+	case 'g':
+		gen_thread = thread ? thread : stop_thread;
+		break;
+
+	case 'c':
+		/* vCont always names the threads it applies to */
+		break;
+	}
+
 	send_response(fd, OK);
 }
 
+static void thread_info(uint64_t *stack, void *priv)
+{
+	char *data, *p;
+	int i;
+
+	/* "p1.<id>," for every thread */
+	data = malloc(nr_threads * 16 + 2);
+	if (!data) {
+		send_response(fd, ERROR(ENOMEM));
+		return;
+	}
+
+	p = data;
+	*p++ = 'm';
+	for (i = 0; i < nr_threads; i++)
+		p += sprintf(p, "%sp1.%x", i ? "," : "", threads[i].id);
+
+	send_response(fd, data);
+	free(data);
+}
+
+static void current_thread(uint64_t *stack, void *priv)
+{
+	char data[32];
+
+	snprintf(data, sizeof(data), "QCp1.%x", gen_thread->id);
+	send_response(fd, data);
+}
+
+static void thread_info_end(uint64_t *stack, void *priv)
+{
+	/* Every thread was sent in response to qfThreadInfo */
+	send_response(fd, "l");
+}
+
+static void thread_alive(uint64_t *stack, void *priv)
+{
+	const char *packet = parser_packet(NULL);
+	char *end;
+
+	if (find_thread(parse_thread_id(packet + 1, &end)))
+		send_response(fd, OK);
+	else
+		send_response(fd, ERROR(ESRCH));
+}
+
+static void thread_extra_info(uint64_t *stack, void *priv)
+{
+	const char *packet = parser_packet(NULL);
+	struct gdb_thread *thread;
+	char *path, *data, *end;
+	int i;
+
+	thread = find_thread(parse_thread_id(packet + strlen("qThreadExtraInfo,"), &end));
+	if (!thread) {
+		send_response(fd, ERROR(ESRCH));
+		return;
+	}
+
+	path = pdbg_target_path(thread->target);
+	if (!path) {
+		send_response(fd, ERROR(ENOMEM));
+		return;
+	}
+
+	data = malloc(strlen(path) * 2 + 1);
+	if (data) {
+		for (i = 0; path[i]; i++)
+			sprintf(&data[i*2], "%02x", path[i]);
+		data[i*2] = '\0';
+		send_response(fd, data);
+		free(data);
+	} else
+		send_response(fd, ERROR(ENOMEM));
+
+	free(path);
+}
+
 static void stop_reason(uint64_t *stack, void *priv)
 {
-	send_response(fd, TRAP);
+	send_stop(stop_thread);
 }
 
 static void disconnect(uint64_t *stack, void *priv)
@@ -101,20 +302,151 @@ static void disconnect(uint64_t *stack, void *priv)
 	send_response(fd, OK);
 }
 
+/* Registers are fetched by one worker per core */
+struct regs_worker {
+	pthread_t tid;
+	struct pdbg_target *core;
+	int rc;
+};
+
+static int fetch_thread_regs(struct gdb_thread *thread, unsigned int mask)
+{
+	mask &= ~thread->regs_valid;
+	if (!mask)
+		return 0;
+
+	if (thread_getregs_subset(thread->target, mask, &thread->regs))
+		return -1;
+
+	thread->regs_valid |= mask;
+	return 0;
+}
+
+static void *regs_worker(void *arg)
+{
+	struct regs_worker *w = arg;
+	int i;
+
+	for (i = 0; i < nr_threads; i++) {
+		if (threads[i].running)
+			continue;
+
+		if (pdbg_target_parent("core", threads[i].target) != w->core)
+			continue;
+
+		w->rc |= fetch_thread_regs(&threads[i], GDB_REGS);
+	}
+
+	return NULL;
+}
+
+/*
+ * Fetch the registers of every stopped thread. Threads on the same core
+ * share the RAM logic so each core is handled by its own worker, and the
+ * workers run concurrently when the backend allows it.
+ */
+static int fetch_all_regs(void)
+{
+	struct regs_worker *workers;
+	struct pdbg_target *core;
+	int i, j, nworkers = 0, rc = 0;
+
+	workers = calloc(nr_threads, sizeof(*workers));
+	if (!workers)
+		return -1;
+
+	for (i = 0; i < nr_threads; i++) {
+		if (threads[i].running || !(GDB_REGS & ~threads[i].regs_valid))
+			continue;
+
+		core = pdbg_target_parent("core", threads[i].target);
+		for (j = 0; j < nworkers; j++)
+			if (workers[j].core == core)
+				break;
+
+		if (j == nworkers)
+			workers[nworkers++].core = core;
+	}
+
+	if (pdbg_backend_is_threadsafe() && nworkers > 1) {
+		/* The workers mustn't create targets concurrently */
+		pdbg_targets_expand(NULL);
+
+		for (i = 0; i < nworkers; i++) {
+			if (pthread_create(&workers[i].tid, NULL, regs_worker, &workers[i])) {
+				PR_ERROR("Unable to create thread, fetching registers serially\n");
+				break;
+			}
+		}
+
+		for (j = i; j < nworkers; j++)
+			regs_worker(&workers[j]);
+
+		while (i--)
+			pthread_join(workers[i].tid, NULL);
+	} else {
+		for (i = 0; i < nworkers; i++)
+			regs_worker(&workers[i]);
+	}
+
+	for (i = 0; i < nworkers; i++)
+		rc |= workers[i].rc;
+
+	free(workers);
+	return rc;
+}
+
+/*
+ * Make sure the register cache of a thread is valid. Once gdb asks for
+ * the registers of more than one thread it is likely to want them all
+ * (eg. info threads or thread apply all bt), so fetch the rest at the
+ * same time.
+ */
+static int fetch_regs(struct gdb_thread *thread, unsigned int mask)
+{
+	if (!(mask & ~thread->regs_valid))
+		return 0;
+
+	if (!thread->regs_requested) {
+		thread->regs_requested = true;
+		regs_requests++;
+	}
+
+	if (regs_requests > 1)
+		return fetch_all_regs();
+
+	return fetch_thread_regs(thread, mask);
+}
+
+/* Called when a thread is about to run, so its registers will change */
+static void invalidate_regs(struct gdb_thread *thread)
+{
+	int i;
+
+	thread->regs_valid = 0;
+
+	for (i = 0; i < nr_threads; i++)
+		threads[i].regs_requested = false;
+	regs_requests = 0;
+}
+
 /* 32 registers represented as 16 char hex numbers with null-termination */
 #define REG_DATA_SIZE (32*16+1)
 static void get_gprs(uint64_t *stack, void *priv)
 {
 	char data[REG_DATA_SIZE] = "";
-	struct thread_regs regs;
+	struct thread_regs *regs = &gen_thread->regs;
 	int i;
 
-	if(thread_getregs(thread_target, &regs))
+	if (fetch_regs(gen_thread, THREAD_REG_GPRS)) {
 		PR_ERROR("Error reading gprs\n");
+		send_response(fd, ERROR(EIO));
+		return;
+	}
 
 	for (i = 0; i < 32; i++) {
-		PR_INFO("r%d = 0x%016" PRIx64 "\n", i, regs.gprs[i]);
-		snprintf(data + i*16, 17, "%016" PRIx64 , be64toh(regs.gprs[i]));
+		PR_INFO("r%d = 0x%016" PRIx64 "\n", i, regs->gprs[i]);
+		snprintf(data + i*16, 17, "%016" PRIx64 , be64toh(regs->gprs[i]));
 	}
 
 	send_response(fd, data);
@@ -123,45 +455,66 @@ static void get_gprs(uint64_t *stack, void *priv)
 static void get_spr(uint64_t *stack, void *priv)
 {
 	char data[REG_DATA_SIZE];
+	struct thread_regs *regs = &gen_thread->regs;
+	unsigned int mask = 0;
 	uint64_t value;
 
+	switch (stack[0]) {
+	case 0x40:
+		mask = THREAD_REG_NIA;
+		break;
+	case 0x41:
+		mask = THREAD_REG_MSR;
+		break;
+	case 0x42:
+		mask = THREAD_REG_CR;
+		break;
+	case 0x43:
+		mask = THREAD_REG_LR;
+		break;
+	case 0x44:
+		mask = THREAD_REG_CTR;
+		break;
+	}
+
+	if (mask && fetch_regs(gen_thread, mask)) {
+		PR_ERROR("Error reading registers\n");
+		send_response(fd, "xxxxxxxxxxxxxxxx");
+		return;
+	}
+
 	switch (stack[0]) {
 	case 0x40:
 		/* Get PC/NIA */
-		if (thread_getnia(thread_target, &value))
-			PR_ERROR("Error reading NIA\n");
+		value = regs->nia;
 		snprintf(data, REG_DATA_SIZE, "%016" PRIx64 , be64toh(value));
 		send_response(fd, data);
 		break;
 
 	case 0x41:
 		/* Get MSR */
-		if (thread_getmsr(thread_target, &value))
-			PR_ERROR("Error reading MSR\n");
+		value = regs->msr;
 		snprintf(data, REG_DATA_SIZE, "%016" PRIx64 , be64toh(value));
 		send_response(fd, data);
 		break;
 
 	case 0x42:
 		/* Get CR */
-		if (thread_getcr(thread_target, (uint32_t *)&value))
-			PR_ERROR("Error reading CR \n");
+		value = regs->cr;
 		snprintf(data, REG_DATA_SIZE, "%016" PRIx64 , be64toh(value));
 		send_response(fd, data);
 		break;
 
 	case 0x43:
 		/* Get LR */
-		if (thread_getspr(thread_target, 8, &value))
-			PR_ERROR("Error reading LR\n");
+		value = regs->lr;
 		snprintf(data, REG_DATA_SIZE, "%016" PRIx64 , be64toh(value));
 		send_response(fd, data);
 		break;
 
 	case 0x44:
 		/* Get CTR */
-		if (thread_getspr(thread_target, 9, &value))
-			PR_ERROR("Error reading CTR\n");
+		value = regs->ctr;
 		snprintf(data, REG_DATA_SIZE, "%016" PRIx64 , be64toh(value));
 		send_response(fd, data);
 		break;
@@ -180,31 +533,166 @@ static void get_spr(uint64_t *stack, void *priv)
 	}
 }
 
-#define MAX_DATA 0x1000
+/* Largest read which fits in a packet once hex encoded */
+#define MAX_DATA (MAX_PACKET_SIZE / 2)
 
-/* Returns a real address to use with mem_read or -1UL if we
- * couldn't determine a real address. At the moment we only deal with
- * kernel linear mapping but in future we could walk that page
- * tables. */
-static uint64_t get_real_addr(uint64_t addr)
+/*
+ * Access memory using the thread's page tables to find the real address
+ * of each page. Pages which turn out to be physically contiguous are
+ * accessed with a single ADU operation. Returns 1 if any page could not
+ * be translated, 2 if the access failed.
+ */
+static int access_mem_translated(uint64_t addr, uint8_t *data, uint64_t len, bool write)
 {
-	if (GETFIELD(PPC_BITMASK(0, 3), addr) == 0xc)
-		/* Assume all 0xc... addresses are part of the linux linear map */
-		addr &= ~PPC_BITMASK(0, 1);
-	else if (addr < TEST_SKIBOOT_ADDR)
-		return addr;
-	else
-		addr = -1UL;
+	uint64_t real_addr = 0, chunk = 0, run_addr = 0, run_len = 0;
+	uint8_t *run_data = data;
+	int rc;
+
+	while (len || run_len) {
+		if (len) {
+			chunk = 0x1000 - (addr & 0xfff);
+			if (chunk > len)
+				chunk = len;
+
+			if (thread_translate(gen_thread->target, adu_target, addr, &real_addr))
+				return 1;
+
+			if (run_len && real_addr == run_addr + run_len) {
+				run_len += chunk;
+				addr += chunk;
+				len -= chunk;
+				continue;
+			}
+		}
 
-	return addr;
+		if (run_len) {
+			if (write)
+				rc = mem_write(adu_target, run_addr, run_data, run_len, 0, false);
+			else
+				rc = mem_read(adu_target, run_addr, run_data, run_len, 0, false);
+
+			if (rc) {
+				PR_ERROR("Unable to %s memory\n", write ? "write" : "read");
+				return 2;
+			}
+
+			run_data += run_len;
+		}
+
+		run_addr = real_addr;
+		run_len = len ? chunk : 0;
+		addr += run_len;
+		len -= run_len;
+	}
+
+	return 0;
+}
+
+/*
+ * gdb rereads the same stack and code many times while the threads are
+ * stopped, so keep what it has read a cache line at a time until any
+ * thread runs again. Lines are only valid for the thread whose page
+ * tables were used to read them.
+ */
+#define MEM_CACHE_LINE	128
+#define MEM_CACHE_LINES	1024
+
+struct mem_cache_line {
+	struct gdb_thread *thread;
+	uint64_t addr;
+	uint8_t data[MEM_CACHE_LINE];
+};
+
+static struct mem_cache_line mem_cache[MEM_CACHE_LINES];
+
+static struct mem_cache_line *mem_cache_slot(uint64_t addr)
+{
+	return &mem_cache[(addr / MEM_CACHE_LINE) % MEM_CACHE_LINES];
+}
+
+static struct mem_cache_line *mem_cache_lookup(uint64_t addr)
+{
+	struct mem_cache_line *line = mem_cache_slot(addr);
+
+	if (line->thread == gen_thread && line->addr == addr)
+		return line;
+
+	return NULL;
+}
+
+/* addr and len must be multiples of the line size */
+static void mem_cache_fill(uint64_t addr, const uint8_t *data, uint64_t len)
+{
+	struct mem_cache_line *line;
+
+	for (; len; addr += MEM_CACHE_LINE, data += MEM_CACHE_LINE, len -= MEM_CACHE_LINE) {
+		line = mem_cache_slot(addr);
+		line->thread = gen_thread;
+		line->addr = addr;
+		memcpy(line->data, data, MEM_CACHE_LINE);
+	}
+}
+
+/* Apply a write to the cached line it overlaps, or drop the line if the
+ * write failed or it was read through another thread's page tables */
+static void mem_cache_update(uint64_t addr, const uint8_t *data, uint64_t len, bool valid)
+{
+	struct mem_cache_line *line;
+	uint64_t line_addr, offset, chunk;
+
+	while (len) {
+		line_addr = addr & ~(uint64_t) (MEM_CACHE_LINE - 1);
+		offset = addr - line_addr;
+		chunk = MEM_CACHE_LINE - offset;
+		if (chunk > len)
+			chunk = len;
+
+		line = mem_cache_slot(line_addr);
+		if (line->thread && line->addr == line_addr) {
+			if (valid && line->thread == gen_thread)
+				memcpy(&line->data[offset], data, chunk);
+			else
+				line->thread = NULL;
+		}
+
+		addr += chunk;
+		data += chunk;
+		len -= chunk;
+	}
+}
+
+static void mem_cache_flush(void)
+{
+	PR_DEBUG("Flushing memory cache\n");
+	memset(mem_cache, 0, sizeof(mem_cache));
+}
+
+/* Returns 0 on success or a gdb error number */
+static int read_mem(uint64_t addr, uint8_t *data, uint64_t len)
+{
+	int err;
+
+	err = access_mem_translated(addr, data, len, false);
+	if (err == 1) {
+		/* Fall back to having the thread load the data */
+		err = 0;
+		if (thread_getmem_range(gen_thread->target, addr, (uint64_t *) data,
+					(len + sizeof(uint64_t) - 1)/sizeof(uint64_t))) {
+			PR_ERROR("Fault reading memory\n");
+			err = 2;
+		}
+	}
+
+	return err;
 }
 
 static void get_mem(uint64_t *stack, void *priv)
 {
-	uint64_t addr, len, linear_map;
+	uint64_t addr, len, start, end, line, miss_start, miss_end;
+	struct mem_cache_line *cached;
 	int i, err = 0;
-	uint64_t data[MAX_DATA/sizeof(uint64_t)];
-	char result[2*MAX_DATA];
+	uint8_t *data;
+	char *result;
 
 	/* stack[0] is the address and stack[1] is the length */
 	addr = stack[0];
@@ -215,65 +703,78 @@ static void get_mem(uint64_t *stack, void *priv)
 		len = MAX_DATA;
 	}
 
+	/* Whole lines are read so they can be cached. Lines never cross a
+	 * page so this can't fault where the original request wouldn't. */
+	start = addr & ~(uint64_t) (MEM_CACHE_LINE - 1);
+	end = (addr + len + MEM_CACHE_LINE - 1) & ~(uint64_t) (MEM_CACHE_LINE - 1);
+
+	data = malloc(end - start);
+	result = malloc(2*len + 4);
+	if (!data || !result) {
+		free(data);
+		free(result);
+		send_response(fd, ERROR(ENOMEM));
+		return;
+	}
+
 	if (!addr) {
 		err = 2;
 		goto out;
 	}
 
-	linear_map = get_real_addr(addr);
-	if (linear_map != -1UL) {
-		if (mem_read(adu_target, linear_map, (uint8_t *) data, len, 0, false)) {
-			PR_ERROR("Unable to read memory\n");
-			err = 1;
-		}
-	} else {
-		/* Virtual address */
-		for (i = 0; i < len; i += sizeof(uint64_t)) {
-			if (thread_getmem(thread_target, addr, &data[i/sizeof(uint64_t)])) {
-				PR_ERROR("Fault reading memory\n");
-				err = 2;
-				break;
-			}
+	/* Find the span of lines which aren't cached */
+	miss_start = end;
+	miss_end = start;
+	for (line = start; line < end; line += MEM_CACHE_LINE) {
+		cached = mem_cache_lookup(line);
+		if (cached) {
+			memcpy(&data[line - start], cached->data, MEM_CACHE_LINE);
+			continue;
 		}
+
+		if (line < miss_start)
+			miss_start = line;
+		miss_end = line + MEM_CACHE_LINE;
 	}
 
+	if (miss_start < miss_end) {
+		PR_DEBUG("Memory cache miss 0x%016" PRIx64 " len 0x%" PRIx64 "\n",
+			 miss_start, miss_end - miss_start);
+		err = read_mem(miss_start, &data[miss_start - start], miss_end - miss_start);
+		if (!err)
+			mem_cache_fill(miss_start, &data[miss_start - start], miss_end - miss_start);
+	} else
+		PR_DEBUG("Memory cache hit 0x%016" PRIx64 " len 0x%" PRIx64 "\n", addr, len);
+
 out:
 	if (!err)
 		for (i = 0; i < len; i ++) {
-			sprintf(&result[i*2], "%02x", *(((uint8_t *) data) + i));
+			sprintf(&result[i*2], "%02x", data[addr - start + i]);
 		}
 	else
 		sprintf(result, "E%02x", err);
 
 	send_response(fd, result);
+	free(result);
+	free(data);
 }
 
-static void put_mem(uint64_t *stack, void *priv)
+static void write_mem(uint64_t addr, uint8_t *data, uint64_t len)
 {
-	uint64_t addr, len;
-	uint8_t *data;
 	uint8_t attn_opcode[] = {0x00, 0x00, 0x02, 0x00};
-	int err = 0;
-	struct thread *thread = target_to_thread(thread_target);
+	uint8_t trap_opcode[] = {0x7d, 0x82, 0x10, 0x08};
+	int i, err = 0;
 
 	if (littleendian) {
 		attn_opcode[1] = 0x02;
 		attn_opcode[2] = 0x00;
+		trap_opcode[0] = 0x08;
+		trap_opcode[1] = 0x10;
+		trap_opcode[2] = 0x82;
+		trap_opcode[3] = 0x7d;
 	}
 
-	addr = stack[0];
-	len = stack[1];
-	data = (uint8_t *) &stack[2];
-
-	addr = get_real_addr(addr);
-	if (addr == -1UL) {
-		PR_ERROR("TODO: No virtual address support for putmem\n");
-		err = 1;
-		goto out;
-	}
-
-
-	if (len == 4 && stack[2] == 0x0810827d) {
+	if (len == 4 && !memcmp(data, trap_opcode, 4)) {
 		/* According to linux-ppc-low.c gdb only uses this
 		 * op-code for sw break points so we replace it with
 		 * the correct attn opcode which is what we need for
@@ -284,19 +785,30 @@ static void put_mem(uint64_t *stack, void *priv)
 		PR_INFO("Breakpoint opcode detected, replacing with attn\n");
 		data = attn_opcode;
 
-		/* Need to enable the attn instruction in HID0 */
-		if (thread->enable_attn(thread_target))
-			goto out;
-	} else
-		stack[2] = __builtin_bswap64(stack[2]) >> 32;
-
-	PR_INFO("put_mem 0x%016" PRIx64 " = 0x%016" PRIx64 "\n", addr, stack[2]);
+		/* Need to enable the attn instruction in HID0 on every
+		 * thread which might hit the breakpoint */
+		for (i = 0; i < nr_threads; i++) {
+			struct thread *thread = target_to_thread(threads[i].target);
 
-	if (mem_write(adu_target, addr, data, len, 0, false)) {
-		PR_ERROR("Unable to write memory\n");
-		err = 3;
+			if (thread->enable_attn(threads[i].target)) {
+				err = 1;
+				goto out;
+			}
+		}
 	}
 
+	PR_INFO("put_mem 0x%016" PRIx64 " len 0x%" PRIx64 "\n", addr, len);
+
+	err = access_mem_translated(addr, data, len, true);
+	if (err == 1)
+		PR_ERROR("Unable to translate address for putmem\n");
+
+	mem_cache_update(addr, data, len, !err);
+
+	/* The write may have changed a page table */
+	for (i = 0; i < nr_threads; i++)
+		thread_translate_flush(threads[i].target);
+
 out:
 	if (err)
 		send_response(fd, ERROR(EPERM));
@@ -304,25 +816,279 @@ out:
 		send_response(fd, OK);
 }
 
-static void v_conts(uint64_t *stack, void *priv)
+static int hex_digit(char c)
 {
-	thread_step(thread_target, 1);
-	send_response(fd, TRAP);
+	if (c >= '0' && c <= '9')
+		return c - '0';
+	else if (c >= 'a' && c <= 'f')
+		return c - 'a' + 10;
+	else if (c >= 'A' && c <= 'F')
+		return c - 'A' + 10;
+
+	return -1;
 }
 
-#define VCONT_POLL_DELAY 100000
-static void v_contc(uint64_t *stack, void *priv)
+/* Parse the "<addr>,<len>:" header shared by M and X packets */
+static char *parse_mem_header(const char *packet, uint64_t *addr, uint64_t *len)
 {
-	thread_start(thread_target);
+	char *p;
+
+	*addr = strtoull(packet + 1, &p, 16);
+	if (*p != ',')
+		return NULL;
+
+	*len = strtoull(p + 1, &p, 16);
+	if (*p != ':')
+		return NULL;
+
+	return p + 1;
+}
+
+static void put_mem(uint64_t *stack, void *priv)
+{
+	const char *packet = parser_packet(NULL);
+	uint64_t addr, len, i;
+	uint8_t *data;
+	char *hex;
+	int hi, lo;
+
+	/* The parser only keeps the first 8 bytes so decode the hex here */
+	hex = parse_mem_header(packet, &addr, &len);
+	if (!hex || strlen(hex) != 2*len) {
+		send_response(fd, ERROR(EINVAL));
+		return;
+	}
+
+	data = malloc(len);
+	if (!data) {
+		send_response(fd, ERROR(ENOMEM));
+		return;
+	}
+
+	for (i = 0; i < len; i++) {
+		hi = hex_digit(hex[2*i]);
+		lo = hex_digit(hex[2*i + 1]);
+		if (hi < 0 || lo < 0) {
+			send_response(fd, ERROR(EINVAL));
+			goto out;
+		}
+		data[i] = hi << 4 | lo;
+	}
+
+	write_mem(addr, data, len);
+
+out:
+	free(data);
+}
+
+/* X packets carry binary data with '#', '$', '}' and '*' escaped */
+static void put_mem_binary(uint64_t *stack, void *priv)
+{
+	const char *packet, *bin, *end;
+	uint64_t addr, len, i = 0;
+	size_t packet_len;
+	uint8_t *data;
+
+	packet = parser_packet(&packet_len);
+	end = packet + packet_len;
+
+	bin = parse_mem_header(packet, &addr, &len);
+	if (!bin) {
+		send_response(fd, ERROR(EINVAL));
+		return;
+	}
+
+	/* gdb probes for X support with an empty write */
+	if (!len) {
+		send_response(fd, OK);
+		return;
+	}
+
+	data = malloc(len);
+	if (!data) {
+		send_response(fd, ERROR(ENOMEM));
+		return;
+	}
+
+	while (bin < end && i < len) {
+		if (*bin == '}' && bin + 1 < end) {
+			data[i++] = bin[1] ^ 0x20;
+			bin += 2;
+		} else
+			data[i++] = *bin++;
+	}
+
+	if (i != len)
+		send_response(fd, ERROR(EINVAL));
+	else
+		write_mem(addr, data, len);
+
+	free(data);
+}
+
+static bool thread_selected(struct gdb_thread *thread, int id)
+{
+	return id == -1 || id == 0 || id == thread->id;
+}
+
+/*
+ * Work out what each thread should do from a vCont packet such as
+ * "vCont;s:p1.2;c". Each thread takes the leftmost action which applies
+ * to it. Actions without a thread-id apply to every thread.
+ */
+static void parse_vcont(const char *packet, char *actions)
+{
+	char *p = (char *) packet + strlen("vCont");
+	char action;
+	int i, id;
+
+	memset(actions, 0, nr_threads);
+
+	while (*p == ';') {
+		action = p[1];
+		p += 2;
+
+		/* Skip the signal of C and S */
+		if (action == 'C' || action == 'S')
+			strtoul(p, &p, 16);
+
+		if (*p == ':')
+			id = parse_thread_id(p + 1, &p);
+		else
+			id = -1;
+
+		for (i = 0; i < nr_threads; i++)
+			if (!actions[i] && thread_selected(&threads[i], id))
+				actions[i] = tolower(action);
+
+		while (*p && *p != ';')
+			p++;
+	}
+}
+
+static void v_cont(uint64_t *stack, void *priv)
+{
+	char actions[nr_threads];
+	struct gdb_thread *stepped = NULL;
+	int i;
+
+	parse_vcont(parser_packet(NULL), actions);
+	mem_cache_flush();
+
+	/*
+	 * We report a stop as soon as a step completes, at which point any
+	 * threads gdb asked to continue would need to be stopped again so
+	 * don't bother starting them.
+	 */
+	for (i = 0; i < nr_threads; i++) {
+		if (actions[i] != 's')
+			continue;
+
+		invalidate_regs(&threads[i]);
+		thread_step(threads[i].target, 1);
+		if (!stepped)
+			stepped = &threads[i];
+	}
+
+	if (stepped) {
+		send_stop(stepped);
+		return;
+	}
+
+	for (i = 0; i < nr_threads; i++) {
+		if (actions[i] != 'c')
+			continue;
+
+		invalidate_regs(&threads[i]);
+		thread_start(threads[i].target);
+		threads[i].running = true;
+	}
+
 	state = SIGNAL_WAIT;
-	poll_interval = 1;
+	poll_arm(POLL_MIN_US);
+}
+
+static void query_supported(uint64_t *stack, void *priv)
+{
+	char data[128];
+
+	snprintf(data, sizeof(data), "PacketSize=%x;multiprocess+;vContSupported+;"
+		 "qXfer:memory-map:read+", MAX_PACKET_SIZE);
+	send_response(fd, data);
+}
+
+/* Everything is reachable through the ADU so present it all as RAM */
+static const char memory_map[] =
+	"<?xml version=\"1.0\"?>"
+	"<!DOCTYPE memory-map PUBLIC \"+//IDN gnu.org//DTD GDB Memory Map V1.0//EN\""
+	" \"http://sourceware.org/gdb/gdb-memory-map.dtd\">"
+	"<memory-map>"
+	"<memory type=\"ram\" start=\"0x0\" length=\"0xffffffffffffffff\"/>"
+	"</memory-map>";
+
+/* qXfer:memory-map:read::<offset>,<length> */
+static void read_memory_map(uint64_t *stack, void *priv)
+{
+	const char *packet = parser_packet(NULL);
+	uint64_t offset, len, size = strlen(memory_map);
+	char *p, *data;
+
+	offset = strtoull(packet + strlen("qXfer:memory-map:read::"), &p, 16);
+	if (*p != ',') {
+		send_response(fd, ERROR(EINVAL));
+		return;
+	}
+	len = strtoull(p + 1, NULL, 16);
+
+	if (offset >= size) {
+		send_response(fd, "l");
+		return;
+	}
+
+	if (len > size - offset)
+		len = size - offset;
+
+	data = malloc(len + 2);
+	if (!data) {
+		send_response(fd, ERROR(ENOMEM));
+		return;
+	}
+
+	/* The map doesn't contain any characters which need escaping */
+	data[0] = offset + len < size ? 'm' : 'l';
+	memcpy(&data[1], &memory_map[offset], len);
+	data[len + 1] = '\0';
+	send_response(fd, data);
+	free(data);
+}
+
+static void v_cont_query(uint64_t *stack, void *priv)
+{
+	send_response(fd, "vCont;c;C;s;S");
+}
+
+/* In all-stop mode every thread is stopped when one of them stops */
+static void stop_all(void)
+{
+	int i;
+
+	for (i = 0; i < nr_threads; i++) {
+		if (!threads[i].running)
+			continue;
+
+		thread_stop(threads[i].target);
+		threads[i].running = false;
+	}
 }
 
 static void interrupt(uint64_t *stack, void *priv)
 {
 	PR_INFO("Interrupt\n");
-	thread_stop(thread_target);
-	send_response(fd, TRAP);
+	stop_all();
+	mem_cache_flush();
+	state = IDLE;
+	poll_arm(0);
+	send_stop(gen_thread);
 
 	return;
 }
@@ -331,20 +1097,34 @@ static void poll(void)
 {
 	uint64_t nia;
 	struct thread_state status;
-
-	thread_target->probe(thread_target);
-	status = thread_status(thread_target);
+	struct gdb_thread *thread = NULL;
+	int i;
 
 	switch (state) {
 	case IDLE:
 		break;
 
 	case SIGNAL_WAIT:
-		if (!(status.quiesced))
+		for (i = 0; i < nr_threads; i++) {
+			if (!threads[i].running)
+				continue;
+
+			status = thread_status_poll(threads[i].target);
+			if (status.quiesced) {
+				thread = &threads[i];
+				break;
+			}
+		}
+
+		if (!thread) {
+			poll_arm(poll_us * 2 < POLL_MAX_US ? poll_us * 2 : POLL_MAX_US);
 			break;
+		}
+
+		thread->running = false;
+		stop_all();
 
 		state = IDLE;
-		poll_interval = VCONT_POLL_DELAY;
 		if (!(status.active)) {
 			PR_ERROR("Thread inactive after trap\n");
 			send_response(fd, ERROR(EPERM));
@@ -352,22 +1132,55 @@ static void poll(void)
 		}
 
 		/* Restore NIA */
-		if (thread_getnia(thread_target, &nia))
+		if (thread_getnia(thread->target, &nia))
 			PR_ERROR("Error during getnia\n");
-		if (thread_putnia(thread_target, nia - 4))
+		if (thread_putnia(thread->target, nia - 4))
 			PR_ERROR("Error during putnia\n");
-		send_response(fd, TRAP);
+		send_stop(thread);
 		break;
 	}
 }
 
+/*
+ * Packets the parser passes through without a command, either because
+ * the grammar doesn't know them or because the tables in
+ * gdb_parser_precompile.c predate them.
+ */
+static const struct {
+	const char *prefix;
+	command_cb cb;
+} packet_handlers[] = {
+	{ "qSupported", query_supported },
+	{ "qXfer:memory-map:read::", read_memory_map },
+	{ "qfThreadInfo", thread_info },
+	{ "qsThreadInfo", thread_info_end },
+	{ "qThreadExtraInfo,", thread_extra_info },
+	{ "vCont?", v_cont_query },
+	{ "vCont;", v_cont },
+	{ "T", thread_alive },
+	{ "X", put_mem_binary },
+};
+
 static void cmd_default(uint64_t *stack, void *priv)
 {
 	uintptr_t tmp = stack[0];
+	const char *packet = parser_packet(NULL);
+	int i;
+
 	if (stack[0]) {
 		send_response(fd, (char *) tmp);
-	} else
-		send_response(fd, "");
+		return;
+	}
+
+	for (i = 0; i < ARRAY_SIZE(packet_handlers); i++) {
+		if (!strncmp(packet, packet_handlers[i].prefix,
+			     strlen(packet_handlers[i].prefix))) {
+			packet_handlers[i].cb(stack, priv);
+			return;
+		}
+	}
+
+	send_response(fd, "");
 }
 
 static void create_client(int new_fd)
@@ -381,14 +1194,35 @@ static void destroy_client(int dead_fd)
 	PR_INFO("Client disconnected\n");
 	close(dead_fd);
 	fd = -1;
+	rx_len = 0;
+}
+
+/* Returns the length of the data up to the start of any partial packet */
+static size_t complete_packets(char *buf, size_t len)
+{
+	char *start = memrchr(buf, '$', len);
+	char *end;
+
+	if (!start)
+		return len;
+
+	end = memchr(start, '#', len - (start - buf));
+	if (end && end + 2 < buf + len)
+		return len;
+
+	/* Don't wait forever for a packet too big to ever fit */
+	if (len - (start - buf) > BUFFER_SIZE)
+		return len;
+
+	return start - buf;
 }
 
 static int read_from_client(int fd)
 {
-	char buffer[BUFFER_SIZE + 1];
+	size_t len;
 	int nbytes;
 
-	nbytes = read(fd, buffer, sizeof(buffer));
+	nbytes = read(fd, rx_buffer + rx_len, sizeof(rx_buffer) - rx_len - 1);
 	if (nbytes < 0) {
 		perror(__FUNCTION__);
 		return -1;
@@ -396,10 +1230,20 @@ static int read_from_client(int fd)
 		PR_INFO("0 bytes\n");
 		return -1;
 	} else {
-		buffer[nbytes] = '\0';
-		PR_INFO("%x\n", buffer[0]);
-		PR_INFO("Recv: %s\n", buffer);
-		parse_buffer(buffer, nbytes, &fd);
+		PR_INFO("%x\n", rx_buffer[rx_len]);
+		rx_len += nbytes;
+
+		len = complete_packets(rx_buffer, rx_len);
+		if (!len)
+			return 0;
+
+		memmove(rx_buffer + len + 1, rx_buffer + len, rx_len - len);
+		rx_buffer[len] = '\0';
+		PR_INFO("Recv: %s\n", rx_buffer);
+		parse_buffer(rx_buffer, len, &fd);
+
+		rx_len -= len;
+		memmove(rx_buffer, rx_buffer + len + 1, rx_len);
 	}
 
 	return 0;
@@ -412,21 +1256,36 @@ command_cb callbacks[LAST_CMD + 1] = {
 	get_mem,
 	stop_reason,
 	set_thread,
-	v_contc,
-	v_conts,
+	v_cont,
+	v_cont,
 	put_mem,
 	interrupt,
 	disconnect,
+	thread_info,
+	current_thread,
+	query_supported,
+	thread_alive,
+	thread_extra_info,
 	NULL};
 
-int gdbserver_start(struct pdbg_target *thread, struct pdbg_target *adu, uint16_t port)
+static int epoll_add(int epfd, int new_fd)
 {
-	int sock, i;
+	struct epoll_event event = {
+		.events = EPOLLIN,
+		.data.fd = new_fd,
+	};
+
+	return epoll_ctl(epfd, EPOLL_CTL_ADD, new_fd, &event);
+}
+
+int gdbserver_start(struct pdbg_target *adu, uint16_t port)
+{
+	int sock, epfd, i, n;
 	struct sockaddr_in name;
-	fd_set active_fd_set, read_fd_set;
+	struct epoll_event events[4];
+	uint64_t expirations;
 
 	parser_init(callbacks);
-	thread_target = thread;
 	adu_target = adu;
 
 	sock = socket(PF_INET, SOCK_STREAM, 0);
@@ -448,45 +1307,55 @@ int gdbserver_start(struct pdbg_target *thread, struct pdbg_target *adu, uint16_
 		return -1;
 	}
 
-	FD_ZERO(&active_fd_set);
-	FD_SET(sock, &active_fd_set);
+	timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+	if (timer_fd < 0) {
+		perror(__FUNCTION__);
+		return -1;
+	}
+
+	epfd = epoll_create1(0);
+	if (epfd < 0 || epoll_add(epfd, sock) || epoll_add(epfd, timer_fd)) {
+		perror(__FUNCTION__);
+		return -1;
+	}
 
 	while (1) {
-		read_fd_set = active_fd_set;
-		timeout.tv_sec = 0;
-		timeout.tv_usec = poll_interval;
-		if (select(FD_SETSIZE, &read_fd_set, NULL, NULL, &timeout) < 0) {
+		n = epoll_wait(epfd, events, ARRAY_SIZE(events), -1);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+
 			perror(__FUNCTION__);
 			return -1;
 		}
 
-		for (i = 0; i < FD_SETSIZE; i++) {
-			if (FD_ISSET(i, &read_fd_set)) {
-				if (i == sock) {
-					int new;
-					new = accept(sock, NULL, NULL);
-					if (new < 0) {
-						perror(__FUNCTION__);
-						return -1;
-					}
-
-					if (fd > 0)
-						/* It only makes sense to accept a single client */
-						close(new);
-					else {
-						create_client(new);
-						FD_SET(new, &active_fd_set);
-					}
-				} else {
-					if (read_from_client(i) < 0) {
-						destroy_client(i);
-						FD_CLR(i, &active_fd_set);
-					}
+		for (i = 0; i < n; i++) {
+			if (events[i].data.fd == sock) {
+				int new;
+				new = accept(sock, NULL, NULL);
+				if (new < 0) {
+					perror(__FUNCTION__);
+					return -1;
+				}
+
+				if (fd > 0)
+					/* It only makes sense to accept a single client */
+					close(new);
+				else if (epoll_add(epfd, new)) {
+					perror(__FUNCTION__);
+					close(new);
+				} else
+					create_client(new);
+			} else if (events[i].data.fd == timer_fd) {
+				if (read(timer_fd, &expirations, sizeof(expirations)) > 0)
+					poll();
+			} else {
+				if (read_from_client(events[i].data.fd) < 0) {
+					epoll_ctl(epfd, EPOLL_CTL_DEL, events[i].data.fd, NULL);
+					destroy_client(events[i].data.fd);
 				}
 			}
 		}
-
-		poll();
 	}
 
 	return 1;
@@ -494,36 +1363,46 @@ int gdbserver_start(struct pdbg_target *thread, struct pdbg_target *adu, uint16_
 
 static int gdbserver(uint16_t port)
 {
-	struct pdbg_target *target, *adu, *thread = NULL;
+	struct pdbg_target *target, *adu;
 	uint64_t msr;
-	int rc;
+	int i = 0, rc;
 
 	for_each_path_target_class("thread", target) {
 		if (pdbg_target_probe(target) != PDBG_TARGET_ENABLED)
 			continue;
 
-		if (!thread) {
-			thread = target;
-		} else {
-			fprintf(stderr, "GDB server cannot be run on multiple threads at once.\n");
-			return 0;
+		//
+		// Temporary until I can get this working a bit smoother on p9
+		if (strcmp(target->compatible, "ibm,power8-thread")) {
+			PR_ERROR("GDBSERVER is only tested on POWER8\n");
+			return -1;
 		}
+
+		nr_threads++;
 	}
 
-	if (!thread) {
+	if (!nr_threads) {
 		fprintf(stderr, "No thread selected\n");
 		return 0;
 	}
 
-	//
-	// Temporary until I can get this working a bit smoother on p9
-	if (strcmp(thread->compatible, "ibm,power8-thread")) {
-		PR_ERROR("GDBSERVER is only tested on POWER8\n");
+	threads = calloc(nr_threads, sizeof(*threads));
+	if (!threads)
 		return -1;
+
+	for_each_path_target_class("thread", target) {
+		if (pdbg_target_status(target) != PDBG_TARGET_ENABLED)
+			continue;
+
+		threads[i].target = target;
+		threads[i].id = i + 1;
+		i++;
 	}
 
+	gen_thread = stop_thread = &threads[0];
+
 	/* Check endianess in MSR */
-	rc = thread_getmsr(thread, &msr);
+	rc = thread_getmsr(gen_thread->target, &msr);
 	if (rc) {
 		PR_ERROR("Couldn't read the MSR. Are all threads on this chiplet quiesced?\n");
 		return 1;
@@ -541,7 +1420,8 @@ static int gdbserver(uint16_t port)
 		return 0;
 	}
 
-	gdbserver_start(thread, adu, port);
+	gdbserver_start(adu, port);
+	free(threads);
 	return 0;
 }
 #else
@@ -1,13 +1,19 @@
 #ifndef __PDBGPROXY_H
 #define __PDBGPROXY_H
 
+/* Largest packet the parser keeps the raw text of */
+#define MAX_PACKET_SIZE 0x10000
+
 enum gdb_command {NONE, GET_GPRS, GET_SPR, GET_MEM,
                  STOP_REASON, SET_THREAD, V_CONTC, V_CONTS,
-                 PUT_MEM, INTERRUPT, DISCONNECT, LAST_CMD};
+                 PUT_MEM, INTERRUPT, DISCONNECT, THREAD_INFO,
+                 CURRENT_THREAD, QUERY_SUPPORTED, THREAD_ALIVE,
+                 THREAD_EXTRA_INFO, LAST_CMD};
 typedef void (*command_cb)(uint64_t *stack, void *priv);
 
 void parser_init(command_cb *callbacks);
 int parse_buffer(char *buf, size_t len, void *priv);
+const char *parser_packet(size_t *len);
 void send_nack(void *priv);
 void send_ack(void *priv);
 #endif
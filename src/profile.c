@@ -0,0 +1,531 @@
+/* Copyright 2019 IBM Corp.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * 	http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or
+ * implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include <errno.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <endian.h>
+#include <elf.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <libpdbg.h>
+
+#include "main.h"
+#include "optcmd.h"
+#include "parsers.h"
+#include "path.h"
+
+#define NSEC_PER_SEC 1000000000ULL
+
+struct profile_thread {
+	struct pdbg_target *target;
+	uint64_t *nia;
+	uint64_t count;
+	uint64_t errors;
+};
+
+/* Each worker samples the threads under a single pib, or every thread
+ * if the backend can't be used from more than one thread at a time */
+struct profile_worker {
+	pthread_t tid;
+	struct profile_thread *threads;
+	int nthreads;
+	uint64_t samples;
+	uint64_t period;
+};
+
+struct profile_entry {
+	uint64_t addr;
+	uint64_t count;
+};
+
+struct profile_sym {
+	uint64_t addr;
+	uint64_t size;
+	const char *name;
+};
+
+static struct profile_sym *syms;
+static int nsyms;
+
+/*
+ * Stop each core once per sample. Opening a RAM session quiesces every
+ * thread on the core, so all the selected threads on it are sampled
+ * with a single stop/start rather than one per thread.
+ */
+static void profile_sample(struct profile_thread *threads, int nthreads)
+{
+	struct pdbg_target *core = NULL, *session = NULL;
+	int i;
+
+	for (i = 0; i < nthreads; i++) {
+		struct profile_thread *t = &threads[i];
+		struct pdbg_target *parent = pdbg_target_parent("core", t->target);
+		uint64_t nia;
+
+		if (parent != core) {
+			if (session)
+				core_ram_session_end(session);
+
+			core = parent;
+			session = core_ram_session_begin(core) ? NULL : core;
+		}
+
+		if (!session || thread_getnia(t->target, &nia))
+			t->errors++;
+		else
+			t->nia[t->count++] = nia;
+	}
+
+	if (session)
+		core_ram_session_end(session);
+}
+
+static void *profile_worker(void *arg)
+{
+	struct profile_worker *w = arg;
+	struct timespec next;
+	uint64_t i;
+
+	clock_gettime(CLOCK_MONOTONIC, &next);
+	for (i = 0; i < w->samples; i++) {
+		profile_sample(w->threads, w->nthreads);
+
+		next.tv_nsec += w->period;
+		next.tv_sec += next.tv_nsec / NSEC_PER_SEC;
+		next.tv_nsec %= NSEC_PER_SEC;
+		clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+	}
+
+	return NULL;
+}
+
+static uint16_t elf16(unsigned char *ident, uint16_t v)
+{
+	return ident[EI_DATA] == ELFDATA2MSB ? be16toh(v) : le16toh(v);
+}
+
+static uint32_t elf32(unsigned char *ident, uint32_t v)
+{
+	return ident[EI_DATA] == ELFDATA2MSB ? be32toh(v) : le32toh(v);
+}
+
+static uint64_t elf64(unsigned char *ident, uint64_t v)
+{
+	return ident[EI_DATA] == ELFDATA2MSB ? be64toh(v) : le64toh(v);
+}
+
+static int sym_cmp(const void *a, const void *b)
+{
+	const struct profile_sym *x = a, *y = b;
+
+	if (x->addr == y->addr)
+		return 0;
+
+	return x->addr < y->addr ? -1 : 1;
+}
+
+/* Load the function symbols from an ELF64 image of either endian. The
+ * names point into the mapping which is never unmapped. */
+static int load_symbols(const char *file)
+{
+	Elf64_Ehdr *ehdr;
+	Elf64_Shdr *shdr;
+	unsigned char *ident;
+	struct stat st;
+	char *elf;
+	int fd, i, shnum;
+
+	fd = open(file, O_RDONLY);
+	if (fd < 0) {
+		fprintf(stderr, "Unable to open %s: %s\n", file, strerror(errno));
+		return 1;
+	}
+
+	if (fstat(fd, &st) || st.st_size < sizeof(*ehdr)) {
+		fprintf(stderr, "Unable to read %s\n", file);
+		close(fd);
+		return 1;
+	}
+
+	elf = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (elf == MAP_FAILED) {
+		fprintf(stderr, "Unable to map %s: %s\n", file, strerror(errno));
+		return 1;
+	}
+
+	ehdr = (Elf64_Ehdr *) elf;
+	ident = ehdr->e_ident;
+	if (memcmp(ident, ELFMAG, SELFMAG) || ident[EI_CLASS] != ELFCLASS64) {
+		fprintf(stderr, "%s is not a 64-bit ELF file\n", file);
+		goto err;
+	}
+
+	shnum = elf16(ident, ehdr->e_shnum);
+	if (elf64(ident, ehdr->e_shoff) + shnum * sizeof(*shdr) > st.st_size)
+		goto err_corrupt;
+	shdr = (Elf64_Shdr *) (elf + elf64(ident, ehdr->e_shoff));
+
+	for (i = 0; i < shnum; i++) {
+		Elf64_Sym *sym;
+		char *strtab;
+		uint64_t j, count, strsize;
+		uint32_t link;
+
+		if (elf32(ident, shdr[i].sh_type) != SHT_SYMTAB)
+			continue;
+
+		link = elf32(ident, shdr[i].sh_link);
+		if (link >= shnum)
+			goto err_corrupt;
+
+		if (elf64(ident, shdr[i].sh_offset) + elf64(ident, shdr[i].sh_size) > st.st_size ||
+		    elf64(ident, shdr[link].sh_offset) + elf64(ident, shdr[link].sh_size) > st.st_size)
+			goto err_corrupt;
+
+		sym = (Elf64_Sym *) (elf + elf64(ident, shdr[i].sh_offset));
+		count = elf64(ident, shdr[i].sh_size) / sizeof(*sym);
+		strtab = elf + elf64(ident, shdr[link].sh_offset);
+		strsize = elf64(ident, shdr[link].sh_size);
+
+		syms = realloc(syms, (nsyms + count) * sizeof(*syms));
+		if (!syms) {
+			fprintf(stderr, "Unable to allocate symbol table\n");
+			goto err;
+		}
+
+		for (j = 0; j < count; j++) {
+			int type = ELF64_ST_TYPE(sym[j].st_info);
+			uint32_t name = elf32(ident, sym[j].st_name);
+
+			if (type != STT_FUNC && type != STT_NOTYPE)
+				continue;
+
+			if (elf16(ident, sym[j].st_shndx) == SHN_UNDEF)
+				continue;
+
+			if (!name || name >= strsize)
+				continue;
+
+			syms[nsyms].addr = elf64(ident, sym[j].st_value);
+			syms[nsyms].size = elf64(ident, sym[j].st_size);
+			syms[nsyms].name = strtab + name;
+			nsyms++;
+		}
+	}
+
+	if (!nsyms) {
+		fprintf(stderr, "No symbols found in %s\n", file);
+		goto err;
+	}
+
+	qsort(syms, nsyms, sizeof(*syms), sym_cmp);
+
+	return 0;
+
+err_corrupt:
+	fprintf(stderr, "%s is corrupt\n", file);
+err:
+	munmap(elf, st.st_size);
+	free(syms);
+	syms = NULL;
+	nsyms = 0;
+	return 1;
+}
+
+static struct profile_sym *lookup_symbol(uint64_t addr)
+{
+	int lo = 0, hi = nsyms - 1, mid;
+	struct profile_sym *sym = NULL;
+
+	while (lo <= hi) {
+		mid = (lo + hi) / 2;
+		if (syms[mid].addr <= addr) {
+			sym = &syms[mid];
+			lo = mid + 1;
+		} else
+			hi = mid - 1;
+	}
+
+	if (sym && sym->size && addr >= sym->addr + sym->size)
+		return NULL;
+
+	return sym;
+}
+
+static int addr_cmp(const void *a, const void *b)
+{
+	const uint64_t *x = a, *y = b;
+
+	if (*x == *y)
+		return 0;
+
+	return *x < *y ? -1 : 1;
+}
+
+static int count_cmp(const void *a, const void *b)
+{
+	const struct profile_entry *x = a, *y = b;
+
+	if (x->count != y->count)
+		return x->count > y->count ? -1 : 1;
+
+	return addr_cmp(&x->addr, &y->addr);
+}
+
+static void print_histogram(struct profile_thread *threads, int nthreads, uint64_t total, int top)
+{
+	struct profile_entry *hist, *funcs = NULL;
+	uint64_t *all;
+	int i, nhist = 0, nfuncs = 0;
+	uint64_t j, n = 0;
+
+	all = malloc(total * sizeof(*all));
+	hist = malloc(total * sizeof(*hist));
+	if (!all || !hist) {
+		fprintf(stderr, "Unable to allocate histogram\n");
+		goto out;
+	}
+
+	for (i = 0; i < nthreads; i++) {
+		memcpy(&all[n], threads[i].nia, threads[i].count * sizeof(*all));
+		n += threads[i].count;
+	}
+
+	qsort(all, total, sizeof(*all), addr_cmp);
+	for (j = 0; j < total; j++) {
+		if (nhist && hist[nhist - 1].addr == all[j]) {
+			hist[nhist - 1].count++;
+		} else {
+			hist[nhist].addr = all[j];
+			hist[nhist].count = 1;
+			nhist++;
+		}
+	}
+
+	/* Addresses are sorted so samples in the same symbol are adjacent.
+	 * Functions are keyed by the symbol address, with samples outside
+	 * any symbol collected under address zero. */
+	if (nsyms) {
+		funcs = calloc(nhist + 1, sizeof(*funcs));
+		if (!funcs) {
+			fprintf(stderr, "Unable to allocate histogram\n");
+			goto out;
+		}
+
+		for (i = 0; i < nhist; i++) {
+			struct profile_sym *sym = lookup_symbol(hist[i].addr);
+			uint64_t addr = sym ? sym->addr : 0;
+
+			if (!nfuncs || funcs[nfuncs - 1].addr != addr) {
+				funcs[nfuncs].addr = addr;
+				nfuncs++;
+			}
+			funcs[nfuncs - 1].count += hist[i].count;
+		}
+	}
+
+	qsort(hist, nhist, sizeof(*hist), count_cmp);
+
+	printf("\n%-18s %10s %7s\n", "NIA", "SAMPLES", "%");
+	for (i = 0; i < nhist && i < top; i++) {
+		struct profile_sym *sym = nsyms ? lookup_symbol(hist[i].addr) : NULL;
+
+		printf("0x%016" PRIx64 " %10" PRIu64 " %6.2f%%", hist[i].addr,
+		       hist[i].count, 100.0 * hist[i].count / total);
+		if (sym)
+			printf("  %s+0x%" PRIx64, sym->name, hist[i].addr - sym->addr);
+		printf("\n");
+	}
+
+	if (!nfuncs)
+		goto out;
+
+	qsort(funcs, nfuncs, sizeof(*funcs), count_cmp);
+
+	printf("\n%-40s %10s %7s\n", "FUNCTION", "SAMPLES", "%");
+	for (i = 0; i < nfuncs && i < top; i++) {
+		struct profile_sym *sym = funcs[i].addr ? lookup_symbol(funcs[i].addr) : NULL;
+
+		printf("%-40s %10" PRIu64 " %6.2f%%\n", sym ? sym->name : "[unknown]",
+		       funcs[i].count, 100.0 * funcs[i].count / total);
+	}
+
+out:
+	free(funcs);
+	free(hist);
+	free(all);
+}
+
+struct profile_flags {
+	uint32_t rate;
+	uint32_t top;
+	char *elf;
+};
+
+#define PROFILE_RATE_FLAG ("--rate", rate, parse_number32, 100)
+#define PROFILE_TOP_FLAG ("--top", top, parse_number32, 20)
+#define PROFILE_ELF_FLAG ("--elf", elf, parse_string, NULL)
+
+static int profile(uint64_t samples, struct profile_flags flags)
+{
+	struct profile_thread *threads = NULL;
+	struct profile_worker *workers = NULL;
+	struct pdbg_target **targets = NULL, *target, *pib;
+	struct timespec start, end;
+	uint64_t total = 0, errors = 0;
+	int i, j, k, n, nthreads = 0, nworkers = 0, count = 0;
+	bool threadsafe = pdbg_backend_is_threadsafe();
+	double elapsed;
+
+	if (!flags.rate || flags.rate > NSEC_PER_SEC) {
+		fprintf(stderr, "Invalid sample rate %" PRIu32 "\n", flags.rate);
+		return 0;
+	}
+
+	if (flags.elf && load_symbols(flags.elf))
+		return 0;
+
+	for_each_path_target_class("thread", target) {
+		if (pdbg_target_status(target) == PDBG_TARGET_ENABLED)
+			nthreads++;
+	}
+
+	if (!nthreads)
+		return 0;
+
+	targets = calloc(nthreads, sizeof(*targets));
+	threads = calloc(nthreads, sizeof(*threads));
+	workers = calloc(nthreads, sizeof(*workers));
+	if (!targets || !threads || !workers) {
+		fprintf(stderr, "Unable to allocate sample buffers\n");
+		goto out;
+	}
+
+	i = 0;
+	for_each_path_target_class("thread", target) {
+		if (pdbg_target_status(target) == PDBG_TARGET_ENABLED)
+			targets[i++] = target;
+	}
+
+	/*
+	 * Several path patterns select threads in pattern order rather than
+	 * tree order. Each pib gets its own worker when the backend allows
+	 * it, and within a worker the threads of each core are kept together
+	 * so profile_sample() opens a single RAM session per core.
+	 */
+	n = 0;
+	for (i = 0; i < nthreads; i++) {
+		struct profile_worker *w;
+
+		if (!targets[i])
+			continue;
+
+		pib = pdbg_target_parent("pib", targets[i]);
+		w = &workers[nworkers++];
+		w->threads = &threads[n];
+		w->samples = samples;
+		w->period = NSEC_PER_SEC / flags.rate;
+
+		for (j = i; j < nthreads; j++) {
+			struct pdbg_target *core;
+
+			if (!targets[j] ||
+			    (threadsafe && pdbg_target_parent("pib", targets[j]) != pib))
+				continue;
+
+			core = pdbg_target_parent("core", targets[j]);
+			for (k = j; k < nthreads; k++) {
+				if (!targets[k] || pdbg_target_parent("core", targets[k]) != core)
+					continue;
+
+				threads[n++].target = targets[k];
+				w->nthreads++;
+				targets[k] = NULL;
+			}
+		}
+	}
+
+	for (i = 0; i < nthreads; i++) {
+		threads[i].nia = malloc(samples * sizeof(uint64_t));
+		if (!threads[i].nia) {
+			fprintf(stderr, "Unable to allocate sample buffers\n");
+			goto out;
+		}
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	if (nworkers == 1) {
+		profile_worker(&workers[0]);
+	} else {
+		/* The workers mustn't create targets concurrently */
+		pdbg_targets_expand(NULL);
+
+		for (i = 0; i < nworkers; i++) {
+			if (pthread_create(&workers[i].tid, NULL, profile_worker, &workers[i])) {
+				fprintf(stderr, "Unable to create sampling thread\n");
+				nworkers = i;
+				break;
+			}
+		}
+
+		for (i = 0; i < nworkers; i++)
+			pthread_join(workers[i].tid, NULL);
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	elapsed = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+
+	for (i = 0; i < nthreads; i++) {
+		total += threads[i].count;
+		errors += threads[i].errors;
+		if (threads[i].errors)
+			fprintf(stderr, "p%d:c%d:t%d: %" PRIu64 " of %" PRIu64 " samples failed\n",
+				pdbg_parent_index(threads[i].target, "pib"),
+				pdbg_parent_index(threads[i].target, "core"),
+				pdbg_target_index(threads[i].target),
+				threads[i].errors, samples);
+		if (threads[i].count)
+			count++;
+	}
+
+	printf("%" PRIu64 " samples from %d threads in %.2fs (%.1f Hz per thread, %" PRIu64 " failed)\n",
+	       total, nthreads, elapsed, elapsed > 0 ? samples / elapsed : 0.0, errors);
+
+	if (total)
+		print_histogram(threads, nthreads, total, flags.top);
+
+out:
+	if (threads) {
+		for (i = 0; i < nthreads; i++)
+			free(threads[i].nia);
+	}
+	free(threads);
+	free(workers);
+	free(targets);
+
+	return count;
+}
+OPTCMD_DEFINE_CMD_WITH_FLAGS(profile, profile, (DATA), profile_flags,
+			     (PROFILE_RATE_FLAG, PROFILE_TOP_FLAG, PROFILE_ELF_FLAG));
@@ -111,9 +111,53 @@ static int getprocreg(struct pdbg_target *target, uint32_t reg, uint64_t *value)
 	return rc;
 }
 
+/* RAMing needs every thread on the core to be quiesced */
+static bool ram_session_core_quiesced(struct pdbg_target *core)
+{
+	struct pdbg_target *thread;
+
+	pdbg_for_each_target("thread", core, thread) {
+		if (pdbg_target_probe(thread) != PDBG_TARGET_ENABLED)
+			return false;
+
+		if (!thread_status(thread).quiesced)
+			return false;
+	}
+
+	return true;
+}
+
+/*
+ * Threads are visited in tree order so all the threads of a core are
+ * accessed together. Keep a RAM session open on the core while that
+ * happens so RAM mode is only set up and torn down once. A session is
+ * only opened if every thread on the core is already quiesced, so the
+ * session never stops a thread and running threads still report an
+ * error as each is accessed.
+ */
+static struct pdbg_target *ram_session_switch(struct pdbg_target *session,
+					      struct pdbg_target *thread)
+{
+	struct pdbg_target *core = thread ? pdbg_target_parent("core", thread) : NULL;
+
+	if (core == session)
+		return session;
+
+	if (session)
+		core_ram_session_end(session);
+
+	if (!core || !ram_session_core_quiesced(core))
+		return NULL;
+
+	if (core_ram_session_begin(core))
+		return NULL;
+
+	return core;
+}
+
 static int getreg(int reg)
 {
-	struct pdbg_target *target;
+	struct pdbg_target *target, *session = NULL;
 	int count = 0;
 
 	for_each_path_target_class("thread", target) {
@@ -123,19 +167,21 @@ static int getreg(int reg)
 		if (pdbg_target_status(target) != PDBG_TARGET_ENABLED)
 			continue;
 
+		session = ram_session_switch(session, target);
 		rc = getprocreg(target, reg, &value);
 		print_proc_reg(target, reg, &value, rc);
 
 		if (!rc)
 			count++;
 	}
+	ram_session_switch(session, NULL);
 
 	return count;
 }
 
 static int putreg(int reg, uint64_t *value)
 {
-	struct pdbg_target *target;
+	struct pdbg_target *target, *session = NULL;
 	int count = 0;
 
 	for_each_path_target_class("thread", target) {
@@ -144,12 +190,14 @@ static int putreg(int reg, uint64_t *value)
 		if (pdbg_target_status(target) != PDBG_TARGET_ENABLED)
 			continue;
 
+		session = ram_session_switch(session, target);
 		rc = putprocreg(target, reg, value);
 		print_proc_reg(target, reg, value, rc);
 
 		if (!rc)
 			count++;
 	}
+	ram_session_switch(session, NULL);
 
 	return count;
 }
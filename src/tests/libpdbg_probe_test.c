@@ -15,8 +15,12 @@
  */
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <inttypes.h>
 #include <assert.h>
+#include <unistd.h>
+#include <sys/stat.h>
 
 #include <libpdbg.h>
 
@@ -237,6 +241,125 @@ static void test3(void)
 	}
 }
 
+static void test4(void)
+{
+	struct pdbg_target *root, *target, *targets[64];
+	int count = 0;
+
+	pdbg_set_backend(PDBG_BACKEND_FAKE, NULL);
+	pdbg_set_parallel_probe(true);
+	pdbg_targets_init(NULL);
+
+	root = pdbg_target_root();
+	assert(root);
+
+	pdbg_for_each_class_target("core", target) {
+		if (pdbg_target_index(target) % 2)
+			pdbg_target_status_set(target, PDBG_TARGET_DISABLED);
+	}
+
+	pdbg_for_each_class_target("thread", target) {
+		targets[count++] = target;
+	}
+	assert(count == 64);
+
+	/* Threads on different pibs are probed concurrently */
+	pdbg_targets_probe(targets, count);
+
+	pdbg_for_each_class_target("thread", target) {
+		struct pdbg_target *core = pdbg_target_parent("core", target);
+
+		if (pdbg_target_index(core) % 2) {
+			check_status(core, PDBG_TARGET_DISABLED);
+			check_status(target, PDBG_TARGET_UNKNOWN);
+		} else {
+			for_target_to_root(target, check_status, PDBG_TARGET_ENABLED);
+		}
+	}
+
+	pdbg_target_probe_all(root);
+	pdbg_for_each_class_target("pib", target) {
+		for_target_to_root(target, check_status, PDBG_TARGET_ENABLED);
+	}
+
+	pdbg_target_release(root);
+	pdbg_for_each_class_target("pib", target) {
+		for_target_to_root(target, check_status, PDBG_TARGET_RELEASED);
+	}
+}
+
+static void test5(void)
+{
+	struct pdbg_target *root, *target, *pib, *core = NULL;
+	const char *cache = "libpdbg_probe_test5.cache";
+	char name[16], value[256], *core_path;
+	int count = 0;
+	FILE *f;
+
+	pdbg_set_backend(PDBG_BACKEND_FAKE, NULL);
+	pdbg_targets_init(NULL);
+
+	root = pdbg_target_root();
+	assert(root);
+
+	pib = pdbg_target_from_path(NULL, "/fsi@0/pib@11000");
+	assert(pib);
+
+	pdbg_for_each_class_target("core", target) {
+		if (pdbg_target_parent("pib", target) != pib) {
+			core = target;
+			break;
+		}
+	}
+	assert(core);
+	core_path = pdbg_target_path(core);
+	assert(core_path);
+
+	/* A cache for some other device tree is ignored */
+	f = fopen(cache, "w");
+	assert(f);
+	fprintf(f, "dtb 0\nnonexistent /fsi@0/pib@11000\n");
+	fclose(f);
+	assert(pdbg_probe_cache_load(cache));
+	check_status(pib, PDBG_TARGET_UNKNOWN);
+
+	/* As if written before the host was powered on */
+	assert(!pdbg_probe_cache_save(cache));
+	f = fopen(cache, "a");
+	assert(f);
+	fprintf(f, "nonexistent /fsi@0/pib@11000\n");
+	fprintf(f, "nonexistent %s\n", core_path);
+	fclose(f);
+
+	/* A cache others could have written is ignored */
+	assert(!chmod(cache, 0666));
+	assert(pdbg_probe_cache_load(cache));
+	assert(!chmod(cache, 0600));
+
+	/* Whether a pib or core probes depends on the state of the host, so
+	 * they are probed again even if the cache says they were missing */
+	assert(!pdbg_probe_cache_load(cache));
+	check_status(pib, PDBG_TARGET_UNKNOWN);
+	check_status(core, PDBG_TARGET_UNKNOWN);
+
+	pdbg_target_probe_all(root);
+	pdbg_for_each_class_target("pib", target)
+		for_each_target(target, check_status, PDBG_TARGET_ENABLED);
+
+	/* Nor are they recorded */
+	assert(!pdbg_probe_cache_save(cache));
+	f = fopen(cache, "r");
+	assert(f);
+	while (fscanf(f, "%15s %255s", name, value) == 2) {
+		if (!strcmp(name, "nonexistent"))
+			count++;
+	}
+	fclose(f);
+	assert(count == 0);
+	unlink(cache);
+	free(core_path);
+}
+
 int main(void)
 {
 	int test_id = TEST_ID;
@@ -247,6 +370,10 @@ int main(void)
 		test2();
 	} else if (test_id == 3) {
 		test3();
+	} else if (test_id == 4) {
+		test4();
+	} else if (test_id == 5) {
+		test5();
 	} else {
 		printf("No test for TEST_ID=%d\n", test_id);
 		return 1;
@@ -15,9 +15,11 @@
  */
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <inttypes.h>
 #include <assert.h>
+#include <endian.h>
 
 #include <libpdbg.h>
 
@@ -47,6 +49,19 @@ static int count_class_target(const char *classname)
 	return n;
 }
 
+static int count_compatible(struct pdbg_target *parent, const char *compat)
+{
+	struct pdbg_target *target;
+	int n = 0;
+
+	pdbg_for_each_compatible(parent, target, compat) {
+		assert(pdbg_target_compatible(target, compat));
+		n++;
+	}
+
+	return n;
+}
+
 static int count_child_target(struct pdbg_target *parent)
 {
 	struct pdbg_target *child;
@@ -63,7 +78,19 @@ int main(void)
 {
 	struct pdbg_target *root, *target, *parent, *parent2;
 	const char *name;
+	char *path;
+	uint32_t index, reg[2];
 	int count, i;
+	int test_id = TEST_ID;
+
+	/* Test 1 copies the whole tree up front, test 2 creates targets from
+	 * the fdt as they are first used like pdbg does */
+	if (test_id == 2) {
+		pdbg_set_lazy_targets(true);
+	} else if (test_id != 1) {
+		printf("No test for TEST_ID=%d\n", test_id);
+		return 1;
+	}
 
 	pdbg_set_backend(PDBG_BACKEND_FAKE, NULL);
 	pdbg_targets_init(NULL);
@@ -71,9 +98,42 @@ int main(void)
 	root = pdbg_target_root();
 	assert(root);
 
+	/* When targets are created lazily looking up a path only creates
+	 * those along it but class iteration must still visit all targets
+	 * in device tree order */
+	target = pdbg_target_from_path(NULL, "/fsi@0/pib@17000/core@10040/thread@1");
+	assert(target);
+	assert(!pdbg_target_u32_property(target, "index", &index));
+	assert(index == 1);
+	assert(pdbg_target_address(target, NULL) == 1);
+	assert(!strcmp(pdbg_target_path_const(target), "/fsi@0/pib@17000/core@10040/thread@1"));
+
+	/* Setting a property replaces any value already decoded from it */
+	reg[0] = htobe32(3);
+	reg[1] = 0;
+	pdbg_target_set_property(target, "reg", reg, sizeof(reg));
+	assert(pdbg_target_address(target, NULL) == 3);
+
+	i = 0;
+	pdbg_for_each_class_target("thread", target) {
+		index = pdbg_parent_index(target, "pib");
+		assert(index >= i);
+		i = index;
+	}
+	assert(i == 7);
+
 	count = count_class_target("fsi");
 	assert(count == 1);
 
+	count = count_compatible(root, "ibm,fake-thread");
+	assert(count == 64);
+
+	count = count_compatible(root, "IBM,Fake-Core");
+	assert(count == 32);
+
+	count = count_compatible(root, "ibm,no-such-unit");
+	assert(count == 0);
+
 	count = count_class_target("pib");
 	assert(count == 8);
 
@@ -164,7 +224,6 @@ int main(void)
 
 	pdbg_for_each_class_target("core", target) {
 		uint64_t addr, size;
-		uint32_t index;
 
 		parent = pdbg_target_parent("fsi", target);
 		assert(parent);
@@ -199,6 +258,9 @@ int main(void)
 		count = count_target(target, "thread");
 		assert(count == 2);
 
+		count = count_compatible(target, "ibm,fake-thread");
+		assert(count == 2);
+
 		name = pdbg_target_name(target);
 		assert(!strcmp(name, "Fake Core"));
 
@@ -259,6 +321,10 @@ int main(void)
 
 		name = pdbg_target_dn_name(target);
 		assert(!strncmp(name, "thread", 6));
+
+		path = pdbg_target_path(target);
+		assert(!strcmp(path, pdbg_target_path_const(target)));
+		free(path);
 	}
 
 	return 0;
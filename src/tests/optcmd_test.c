@@ -14,17 +14,20 @@
 struct flags {
 	bool test_bool;
 	int test_num;
+	char *test_str;
 };
 #else
 struct flags {
 	bool test_bool;
 	uint64_t test_num;
+	char *test_str;
 };
 #endif
 
 /* Format: (<flag>, <field>, <parser>, <default value>) */
 #define FLAG_TEST_BOOL ("--test-bool", test_bool, parse_flag_noarg, false)
 #define FLAG_TEST_NUM ("--test-num", test_num, parse_number64, 10)
+#define FLAG_TEST_STR ("--test-str", test_str, parse_string, NULL)
 
 /* Format: (<parser>, <default value>)
  *
@@ -35,6 +38,7 @@ struct flags {
 
 static uint64_t num, opt, flag;
 static bool bool_flag;
+static char *str_flag;
 
 static int test(void)
 {
@@ -76,11 +80,12 @@ static int test_only_flags(struct flags flags)
 {
 	flag = flags.test_num;
 	bool_flag = flags.test_bool;
+	str_flag = flags.test_str;
 
 	return 0;
 }
 OPTCMD_DEFINE_CMD_ONLY_FLAGS(test_only_flags, test_only_flags, flags,
-			     (FLAG_TEST_BOOL, FLAG_TEST_NUM));
+			     (FLAG_TEST_BOOL, FLAG_TEST_NUM, FLAG_TEST_STR));
 
 int parse_argv(const char *argv[], int argc)
 {
@@ -182,5 +187,17 @@ int main(void)
 	const char *test13_argv[] = { "test_only_flags", "--test-num=12", "13" };
 	assert(parse_argv(test13_argv, ARRAY_SIZE(test13_argv)));
 
+	const char *test14_argv[] = { "test_only_flags", "--test-str=trace.bin" };
+	assert(!parse_argv(test14_argv, ARRAY_SIZE(test14_argv)));
+	assert(str_flag && !strcmp(str_flag, "trace.bin"));
+
+	const char *test15_argv[] = { "test_only_flags" };
+	assert(!parse_argv(test15_argv, ARRAY_SIZE(test15_argv)));
+	assert(!str_flag);
+
+	/* Should fail because the string flag needs an argument */
+	const char *test16_argv[] = { "test_only_flags", "--test-str" };
+	assert(parse_argv(test16_argv, ARRAY_SIZE(test16_argv)));
+
 	return 0;
 }
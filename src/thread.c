@@ -17,6 +17,7 @@
 #include <inttypes.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <assert.h>
 #include <endian.h>
 
@@ -172,15 +173,77 @@ static int thr_start(void)
 }
 OPTCMD_DEFINE_CMD(start, thr_start);
 
-static int thr_step(uint64_t steps)
+/*
+ * Step traces are written as a sequence of records, one per thread,
+ * following an 8 byte "PDBGSTEP" magic. Each record holds the pib, core
+ * and thread indices, the number of steps, and the NIA after each step.
+ * All values are unsigned LEB128 varints. Each NIA is stored as the
+ * zigzag encoded difference from the previous one (starting from zero),
+ * so straight-line code costs a single byte per instruction.
+ */
+#define STEP_TRACE_MAGIC "PDBGSTEP"
+
+static void trace_put_varint(FILE *f, uint64_t value)
+{
+	do {
+		uint8_t byte = value & 0x7f;
+
+		value >>= 7;
+		if (value)
+			byte |= 0x80;
+		fputc(byte, f);
+	} while (value);
+}
+
+static int trace_put_thread(FILE *f, struct pdbg_target *target, uint64_t *nia, uint64_t steps)
+{
+	uint64_t i, prev = 0;
+
+	trace_put_varint(f, pdbg_parent_index(target, "pib"));
+	trace_put_varint(f, pdbg_parent_index(target, "core"));
+	trace_put_varint(f, pdbg_target_index(target));
+	trace_put_varint(f, steps);
+	for (i = 0; i < steps; i++) {
+		int64_t delta = nia[i] - prev;
+
+		trace_put_varint(f, ((uint64_t) delta << 1) ^ (delta >> 63));
+		prev = nia[i];
+	}
+
+	return ferror(f);
+}
+
+struct step_flags {
+	char *trace;
+};
+
+#define STEP_TRACE_FLAG ("--trace", trace, parse_string, NULL)
+
+static int thr_step(uint64_t steps, struct step_flags flags)
 {
 	struct pdbg_target *target;
+	uint64_t *nia = NULL;
+	FILE *trace = NULL;
 	int count = 0;
 
-	if (path_target_all_selected("thread", NULL)) {
+	if (flags.trace) {
+		nia = malloc(steps * sizeof(*nia));
+		if (!nia) {
+			fprintf(stderr, "Unable to allocate trace buffer\n");
+			return 0;
+		}
+
+		trace = fopen(flags.trace, "w");
+		if (!trace) {
+			fprintf(stderr, "Unable to open %s: %s\n", flags.trace, strerror(errno));
+			free(nia);
+			return 0;
+		}
+		fwrite(STEP_TRACE_MAGIC, 1, strlen(STEP_TRACE_MAGIC), trace);
+	} else if (path_target_all_selected("thread", NULL)) {
 		int i;
 
-		for (i=0; i<count; i++)
+		for (i=0; i<steps; i++)
 			thread_step_all();
 
 		return 1;
@@ -190,13 +253,32 @@ static int thr_step(uint64_t steps)
 		if (pdbg_target_status(target) != PDBG_TARGET_ENABLED)
 			continue;
 
-		thread_step(target, (int)steps);
+		if (trace) {
+			if (thread_step_trace(target, (int)steps, nia)) {
+				fprintf(stderr, "Unable to trace p%d:c%d:t%d\n",
+					pdbg_parent_index(target, "pib"),
+					pdbg_parent_index(target, "core"),
+					pdbg_target_index(target));
+				continue;
+			}
+
+			if (trace_put_thread(trace, target, nia, steps)) {
+				fprintf(stderr, "Unable to write %s\n", flags.trace);
+				break;
+			}
+		} else
+			thread_step(target, (int)steps);
 		count++;
 	}
 
+	if (trace) {
+		fclose(trace);
+		free(nia);
+	}
+
 	return count;
 }
-OPTCMD_DEFINE_CMD_WITH_ARGS(step, thr_step, (DATA));
+OPTCMD_DEFINE_CMD_WITH_FLAGS(step, thr_step, (DATA), step_flags, (STEP_TRACE_FLAG));
 
 static int thr_stop(void)
 {
@@ -292,6 +374,9 @@ static int thread_status_print(void)
 		if (pdbg_target_status(pib) != PDBG_TARGET_ENABLED)
 			continue;
 
+		/* Read the status of every thread on the chip up front */
+		chip_thread_status_fetch(pib);
+
 		printf("\np%01dt:", pdbg_target_index(pib));
 		for (i = 0; i < threads_per_core; i++)
 			printf("   %d", i);
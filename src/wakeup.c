@@ -0,0 +1,354 @@
+/* Copyright 2019 IBM Corp.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * 	http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or
+ * implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include <libpdbg.h>
+
+#include "optcmd.h"
+#include "wakeup.h"
+
+/*
+ * The state file records the cores left with special wakeup asserted,
+ * when they should be released, and the pid of the timer process which
+ * will release them. It is plain text, one "key value" pair per line:
+ *
+ *   pid 1234
+ *   timeout 60
+ *   expires 1540000000
+ *   core /proc0/pib/core@10010
+ *
+ * The timer runs the release command on whatever cores the file names,
+ * so it lives in a directory only its owner can write to and is ignored
+ * unless we own it.
+ */
+#define STICKY_WAKEUP_STATE "pdbg-wakeup"
+
+static bool sticky;
+static int sticky_timeout = STICKY_WAKEUP_TIMEOUT;
+static time_t sticky_expires;
+static pid_t sticky_timer;
+static char **sticky_cores;
+static int sticky_core_count;
+
+static char *state_path(void)
+{
+	const char *dir = getenv("XDG_RUNTIME_DIR");
+	char *path;
+
+	if (!dir)
+		dir = "/run";
+
+	if (asprintf(&path, "%s/%s", dir, STICKY_WAKEUP_STATE) < 0)
+		return NULL;
+
+	return path;
+}
+
+/* Open the state file for reading if nobody else could have written it */
+static FILE *state_open(const char *path)
+{
+	struct stat st;
+	FILE *f;
+	int fd;
+
+	fd = open(path, O_RDONLY | O_NOFOLLOW);
+	if (fd < 0)
+		return NULL;
+
+	if (fstat(fd, &st) || !S_ISREG(st.st_mode) ||
+	    st.st_uid != geteuid() || (st.st_mode & (S_IWGRP | S_IWOTH))) {
+		fprintf(stderr, "Ignoring %s, it is not private to this user\n", path);
+		close(fd);
+		return NULL;
+	}
+
+	f = fdopen(fd, "r");
+	if (!f)
+		close(fd);
+
+	return f;
+}
+
+static bool state_has_core(const char *path)
+{
+	int i;
+
+	for (i = 0; i < sticky_core_count; i++)
+		if (!strcmp(sticky_cores[i], path))
+			return true;
+
+	return false;
+}
+
+static void state_add_core(char *path)
+{
+	char **tmp;
+
+	if (state_has_core(path)) {
+		free(path);
+		return;
+	}
+
+	tmp = realloc(sticky_cores, (sticky_core_count + 1) * sizeof(*tmp));
+	if (!tmp) {
+		free(path);
+		return;
+	}
+
+	sticky_cores = tmp;
+	sticky_cores[sticky_core_count++] = path;
+}
+
+/* Returns 0 if a state file was found and loaded */
+static int state_load(void)
+{
+	char *path, key[16], value[256];
+	FILE *f;
+
+	path = state_path();
+	if (!path)
+		return -1;
+
+	f = state_open(path);
+	free(path);
+	if (!f)
+		return -1;
+
+	while (fscanf(f, "%15s %255s", key, value) == 2) {
+		if (!strcmp(key, "pid"))
+			sticky_timer = atoi(value);
+		else if (!strcmp(key, "timeout"))
+			sticky_timeout = atoi(value);
+		else if (!strcmp(key, "expires"))
+			sticky_expires = strtoll(value, NULL, 10);
+		else if (!strcmp(key, "core"))
+			state_add_core(strdup(value));
+	}
+
+	fclose(f);
+
+	return 0;
+}
+
+static int state_save(void)
+{
+	char *path, *tmp;
+	FILE *f;
+	int fd, i, rc;
+
+	path = state_path();
+	if (!path)
+		return -1;
+
+	if (asprintf(&tmp, "%s.XXXXXX", path) < 0) {
+		free(path);
+		return -1;
+	}
+
+	/* mkstemp() won't follow a link someone else left in our way */
+	fd = mkstemp(tmp);
+	if (fd < 0) {
+		fprintf(stderr, "Unable to write %s: %s\n", path, strerror(errno));
+		rc = -1;
+		goto out;
+	}
+
+	f = fdopen(fd, "w");
+	if (!f) {
+		close(fd);
+		unlink(tmp);
+		rc = -1;
+		goto out;
+	}
+
+	fprintf(f, "pid %d\n", (int) sticky_timer);
+	fprintf(f, "timeout %d\n", sticky_timeout);
+	fprintf(f, "expires %lld\n", (long long) sticky_expires);
+	for (i = 0; i < sticky_core_count; i++)
+		fprintf(f, "core %s\n", sticky_cores[i]);
+
+	rc = ferror(f);
+	if (fclose(f) || rc) {
+		unlink(tmp);
+		rc = -1;
+		goto out;
+	}
+
+	/* Replace the old state atomically so the timer never sees a
+	 * partially written file */
+	rc = rename(tmp, path);
+
+out:
+	free(tmp);
+	free(path);
+	return rc;
+}
+
+static void state_remove(void)
+{
+	char *path = state_path();
+
+	if (path) {
+		unlink(path);
+		free(path);
+	}
+}
+
+/*
+ * The timer sleeps until the state expires then runs the release
+ * command. Every sticky invocation pushes the expiry back so the timer
+ * keeps sleeping while pdbg is in use. It exits without releasing if
+ * the state file is removed or taken over by another timer.
+ */
+static void sticky_timer_run(char *const release_argv[])
+{
+	int fd;
+	time_t now;
+
+	setsid();
+	fd = open("/dev/null", O_RDWR);
+	if (fd >= 0) {
+		dup2(fd, STDIN_FILENO);
+		dup2(fd, STDOUT_FILENO);
+		dup2(fd, STDERR_FILENO);
+		if (fd > STDERR_FILENO)
+			close(fd);
+	}
+
+	for (;;) {
+		now = time(NULL);
+		if (now < sticky_expires) {
+			sleep(sticky_expires - now);
+			continue;
+		}
+
+		if (state_load() || sticky_timer != getpid())
+			_exit(0);
+
+		if (sticky_expires <= time(NULL))
+			break;
+	}
+
+	execv("/proc/self/exe", release_argv);
+	_exit(1);
+}
+
+/* Probe the recorded cores so they are released on exit and forget
+ * about them. Returns the number of cores found. */
+static int sticky_wakeup_release(void)
+{
+	struct pdbg_target *target;
+	int i, count = 0;
+
+	sticky = false;
+	core_special_wakeup_set_sticky(false);
+
+	for (i = 0; i < sticky_core_count; i++) {
+		target = pdbg_target_from_path(NULL, sticky_cores[i]);
+		if (!target)
+			continue;
+
+		if (pdbg_target_status(target) != PDBG_TARGET_RELEASED)
+			pdbg_target_probe(target);
+		count++;
+	}
+
+	state_remove();
+
+	return count;
+}
+
+bool sticky_wakeup_init(int timeout)
+{
+	bool loaded = !state_load();
+
+	if (timeout > 0) {
+		sticky_timeout = timeout;
+	} else if (!loaded) {
+		return false;
+	} else if (sticky_expires <= time(NULL)) {
+		/* The timer should have released these already but may
+		 * have been killed */
+		sticky_wakeup_release();
+		return false;
+	}
+
+	sticky = true;
+	core_special_wakeup_set_sticky(true);
+
+	return true;
+}
+
+void sticky_wakeup_save(char *const release_argv[])
+{
+	struct pdbg_target *target;
+	pid_t pid;
+
+	if (!sticky)
+		return;
+
+	pdbg_for_each_class_target("core", target) {
+		char *path;
+
+		if (pdbg_target_status(target) != PDBG_TARGET_ENABLED)
+			continue;
+
+		path = pdbg_target_path(target);
+		if (path)
+			state_add_core(path);
+	}
+
+	sticky_expires = time(NULL) + sticky_timeout;
+
+	/* Start a new timer unless the previous one is still waiting */
+	if (!sticky_timer || kill(sticky_timer, 0)) {
+		fflush(NULL);
+		pid = fork();
+		if (pid == 0)
+			sticky_timer_run(release_argv);
+
+		if (pid < 0) {
+			fprintf(stderr, "Unable to start special wakeup timer: %s\n", strerror(errno));
+			sticky_timer = 0;
+		} else
+			sticky_timer = pid;
+	}
+
+	if (state_save()) {
+		fprintf(stderr, "Unable to save special wakeup state, releasing it\n");
+		sticky = false;
+		core_special_wakeup_set_sticky(false);
+	}
+}
+
+static int release(void)
+{
+	if (sticky_wakeup_release() == 0)
+		printf("No special wakeups held\n");
+
+	return 1;
+}
+OPTCMD_DEFINE_CMD(release, release);
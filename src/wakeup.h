@@ -0,0 +1,39 @@
+/* Copyright 2019 IBM Corp.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * 	http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or
+ * implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef __WAKEUP_H
+#define __WAKEUP_H
+
+#include <stdbool.h>
+
+/* Default number of seconds special wakeup is held after the last
+ * invocation in sticky mode */
+#define STICKY_WAKEUP_TIMEOUT	60
+
+/*
+ * Enter sticky wakeup mode if timeout is positive or a previous
+ * invocation left special wakeup asserted. Returns true if special
+ * wakeup will be left asserted on exit.
+ */
+bool sticky_wakeup_init(int timeout);
+
+/*
+ * Record the cores holding special wakeup and make sure a timer is
+ * running to release them. The timer runs release_argv once the
+ * timeout expires.
+ */
+void sticky_wakeup_save(char *const release_argv[]);
+
+#endif